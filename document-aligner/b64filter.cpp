@@ -1,45 +1,340 @@
 #include <thread>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <getopt.h>
+#include <iomanip>
+#include <memory>
+#include <unordered_set>
+#include <vector>
 #include "util/exception.hh"
 #include "util/pcqueue.hh"
 #include "util/file_stream.hh"
 #include "util/file_piece.hh"
 #include "src/single_producer_queue.h"
 #include "src/subprocess.h"
+#include "src/pipe.h"
+#include "src/line_cache.h"
+#include "src/filter_stats.h"
 #include "src/base64.h"
 
 using namespace std;
 using namespace bitextor;
 
 struct Document {
-	size_t line_cnt;
+	size_t line_cnt = 0;
+	bool has_trailing_newline = false;
+
+	// Position in the input, starting at 1
+	size_t doc_cnt = 0;
+
+	// When it was queued, with --stats
+	chrono::steady_clock::time_point queued;
+};
+
+/**
+ * With -c, which lines of a document were sent to a child and which ones have
+ * their output in the cache.
+ */
+struct CachedDocument {
+	// Child the lines that were sent went to, or NO_CHILD if there were none
+	size_t child;
+
 	bool has_trailing_newline;
+
+	// Hash of each line
+	vector<uint64_t> hashes;
+
+	// Whether each line was sent
+	vector<bool> sent;
+};
+
+constexpr size_t NO_CHILD = -1;
+
+/**
+ * One instance of the wrapped command, and the documents that were sent to it
+ * of which the output has not been read yet.
+ */
+struct Child {
+	Child(char **argv, size_t pipe_size)
+	: process(argv[0], pipe_size) {
+		process.start(argv);
+	}
+
+	subprocess process;
+
+	SingleProducerQueue<Document> line_cnt_queue;
+
+	// Output of each document, base64 encoded unless caching, followed by
+	// nullptr after the last one. Not used for a single child without cache.
+	SingleProducerQueue<shared_ptr<string>> output_queue;
 };
 
+int usage(char **argv) {
+	cerr << "usage: " << argv[0] << " [-j N] [-c] [-C FILE] [-z] [-v] [--stats[=FILE]] command [command-args...]\n"
+	        "\n"
+	        "Options:\n"
+	        "  -j N  Run N instances of command and divide the documents between\n"
+	        "        them. Output stays in the order of the input.\n"
+	        "  -c    Send each distinct line to command only once, and reuse its\n"
+	        "        output for the other times the line occurs\n"
+	        "  -C F  Like -c, and keep the output of lines in the file F for the\n"
+	        "        next run\n"
+	        "  -z    Hand input to command with vmsplice() instead of copying it.\n"
+	        "        Only if command reads its stdin, and does not splice() it.\n"
+	        "  -v    Print how fast data went to and came from command to stderr\n"
+	        "  --stats[=FILE]\n"
+	        "        Every 10 seconds print throughput, time spent waiting, latency\n"
+	        "        of documents and queue depth to stderr, or to FILE\n"
+	        "  --stats-interval=N\n"
+	        "        Print those every N seconds instead\n";
+	return 1;
+}
+
+/**
+ * Reads the output of the documents that were sent to child and hands each
+ * document to fun. Returns the number of bytes read. Adds to stats, if given.
+ */
+uint64_t read_output(Child &child, function<void(string &)> fun, FilterStats *stats) {
+	// Time spent waiting for output of the child, which is everything but
+	// waiting for the queue and calling fun.
+	auto wait_start = chrono::steady_clock::now();
+	auto add_waited = [stats, &wait_start]() {
+		if (stats)
+			stats->AddReaderBlocked(chrono::duration<double>(chrono::steady_clock::now() - wait_start).count());
+	};
+
+	// Reads the first bit of output already
+	util::FilePiece child_out(child.process.out.release());
+	add_waited();
+
+	uint64_t bytes = 0;
+
+	Document document;
+	string doc;
+
+	while (child.line_cnt_queue.Consume(document).line_cnt > 0) {
+		size_t doc_cnt = document.doc_cnt;
+
+		doc.clear();
+		doc.reserve(document.line_cnt * 4096); // 4096 is not a typical line length
+
+		size_t line_cnt = document.line_cnt;
+		uint64_t doc_bytes = bytes;
+
+		if (stats)
+			wait_start = chrono::steady_clock::now();
+
+		try {
+			while (document.line_cnt-- > 0) {
+				StringPiece line(child_out.ReadLine());
+				doc.append(line.data(), line.length());
+				bytes += line.length() + 1;
+
+				// ReadLine eats line endings. Between lines we definitely
+				// need to add them back. Whether we add the last one depends
+				// on whether the original document had a trailing newline.
+				if (document.line_cnt > 0 || document.has_trailing_newline)
+					doc.push_back('\n');
+			}
+		} catch (util::EndOfFileException &e) {
+			UTIL_THROW(util::Exception, "Sub-process stopped producing while expecting more lines while processing document " << doc_cnt);
+		}
+
+		if (stats) {
+			add_waited();
+			stats->AddOutput(bytes - doc_bytes, line_cnt);
+			stats->AddLatency(chrono::steady_clock::now() - document.queued);
+		}
+
+		fun(doc);
+
+		// Just to check, next time we call Consume(), will we block? If so,
+		// that means we've caught up with the producer. However, the order
+		// the producer fills line_cnt_queue is first giving us a new line-
+		// count and then sending the input to the sub-process. So if we do
+		// not have a new line count yet, the sub-process definitely can't
+		// have new output yet, and peek should block and once it unblocks
+		// we expect to have that line-count waiting. If we still don't,
+		// then what is this output that is being produced by the sub-
+		// process?
+		if (child.line_cnt_queue.Empty()) {
+			// If peek throws EOF now our sub-process stopped before its
+			// stdin was closed (producer produces the poison before it
+			// closes the sub-process's stdin.)
+			if (stats)
+				wait_start = chrono::steady_clock::now();
+
+			child_out.peek();
+			add_waited();
+
+			// peek() came back. We have a line-number now, right? If not
+			// sub-process is producing output without any input to base it
+			// on. Which is bad.
+			if (child.line_cnt_queue.Empty())
+				UTIL_THROW(util::Exception, "sub-process is producing more output than it was given input at document " << doc_cnt);
+		}
+	}
+
+	return bytes;
+}
+
 int main(int argc, char **argv) {
-	if (argc < 2) {
-		cerr << "usage: " << argv[0] << " command [command-args...]\n";
+	size_t n_children = 1;
+	bool zero_copy = false;
+	bool verbose = false;
+	bool use_cache = false;
+	string cache_path;
+	bool print_stats = false;
+	string stats_path;
+	double stats_interval = DEFAULT_STATS_INTERVAL;
+
+	option const long_options[] = {
+		{"stats", optional_argument, nullptr, 'S'},
+		{"stats-interval", required_argument, nullptr, 'I'},
+		{nullptr, 0, nullptr, 0}
+	};
+
+	while (true) {
+		switch (getopt_long(argc, argv, "+j:cC:zvh", long_options, nullptr)) {
+			case 'j': {
+				// Parsed as signed, so -1 does not become a huge size_t
+				char *end;
+				long value = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || value < 1)
+					return usage(argv);
+				n_children = value;
+				continue;
+			}
+
+			case 'c':
+				use_cache = true;
+				continue;
+
+			case 'C':
+				use_cache = true;
+				cache_path = optarg;
+				continue;
+
+			case 'z':
+				zero_copy = true;
+				continue;
+
+			case 'v':
+				verbose = true;
+				continue;
+
+			case 'S':
+				print_stats = true;
+				if (optarg)
+					stats_path = optarg;
+				continue;
+
+			case 'I':
+				stats_interval = atof(optarg);
+				if (stats_interval <= 0)
+					return usage(argv);
+				continue;
+
+			case 'h':
+			case '?':
+			default:
+				return usage(argv);
+
+			case -1:
+				break;
+		}
+		break;
+	}
+
+	if (optind == argc)
+		return usage(argv);
+
+	unique_ptr<LineCache> cache;
+
+	try {
+		if (use_cache)
+			cache.reset(cache_path.empty() ? new LineCache() : new LineCache(cache_path));
+	} catch (util::Exception const &e) {
+		cerr << e.what() << endl;
 		return 1;
 	}
 
-	SingleProducerQueue<Document> line_cnt_queue;
+	ofstream stats_file;
+	if (!stats_path.empty()) {
+		stats_file.open(stats_path);
+		if (!stats_file) {
+			cerr << "Could not open " << stats_path << " for writing" << endl;
+			return 1;
+		}
+	}
+
+	// Two pipes per child, which with many children cannot all be as large
+	// as the default.
+	size_t pipe_size = pipe_size_for(2 * n_children);
+
+	vector<unique_ptr<Child>> children;
+	for (size_t i = 0; i < n_children; ++i)
+		children.emplace_back(new Child(argv + optind, pipe_size));
+
+	// With -c, for each document which of its lines were sent to a child,
+	// followed by nullptr after the last one.
+	SingleProducerQueue<shared_ptr<CachedDocument>> cached_queue;
+
+	unique_ptr<FilterStats> stats;
+	if (print_stats) {
+		stats.reset(new FilterStats(stats_path.empty() ? cerr : stats_file, stats_interval, "documents"));
+
+		for (auto &child : children) {
+			Child *ptr = child.get();
+			stats->AddQueue([ptr]() { return ptr->line_cnt_queue.MaxDepth(); });
+			stats->AddQueue([ptr]() { return ptr->output_queue.MaxDepth(); });
+		}
+
+		stats->AddQueue([&cached_queue]() { return cached_queue.MaxDepth(); });
+	}
 
-	subprocess child(argv[1]);
+	auto start = chrono::steady_clock::now();
 
-	child.start(argv + 1);
+	// Bytes, and time until the last byte, in each direction
+	uint64_t bytes_in = 0, bytes_out = 0;
+	double seconds_in = 0, seconds_out = 0, seconds_blocked = 0;
+	bool spliced = false;
 
-	thread feeder([&child, &line_cnt_queue]() {
+	// Lines in the input, and how many of those were sent to a child
+	size_t line_cnt = 0, sent_line_cnt = 0;
+
+	thread feeder([&]() {
 		util::FilePiece in(STDIN_FILENO);
-		util::FileStream child_in(child.in.get());
+
+		vector<unique_ptr<PipeWriter>> children_in;
+		for (auto &child : children)
+			children_in.emplace_back(new PipeWriter(child->process.in.get(), zero_copy));
 
 		// Decoded document buffer
 		string doc;
 
+		// With -c, the lines of doc that go to the child, and the hashes of
+		// all lines sent so far.
+		string uncached_doc;
+		unordered_set<uint64_t> sent_hashes;
+
+		// Documents are dealt to the children in turn, so the reader knows
+		// which child has the output of which document. With -c documents of
+		// which all lines are cached are not dealt at all.
+		size_t doc_cnt = 0;
+		size_t dealt_cnt = 0;
+
 		for (StringPiece line : in) {
+			++doc_cnt;
+
 			base64_decode(line, doc);
 
 			// Description of the document
 			Document document;
-			document.has_trailing_newline = doc.back() == '\n';
+			document.has_trailing_newline = !doc.empty() && doc.back() == '\n';
+			document.doc_cnt = doc_cnt;
 
 			// Make the the document end with a new line. This to make sure
 			// the next doc we send to the child will be on its own line and the
@@ -48,88 +343,230 @@ int main(int argc, char **argv) {
 				doc.push_back('\n');
 
 			document.line_cnt = count(doc.cbegin(), doc.cend(), '\n');
-			
-			// Send line count first to the reader, so it can start reading as
-			// soon as we start feeding the document to the child.
-			line_cnt_queue.Produce(document);
-
-			// Feed the document to the child.
-			// Might block because it can cause a flush.
-			child_in << doc;
-		}
+			line_cnt += document.line_cnt;
 
-		// Tell the reader to stop
-		line_cnt_queue.Produce(Document{
-			.line_cnt = 0,
-			.has_trailing_newline = false
-		});
-
-		// Flush (blocks) & close the child's stdin
-		child_in.flush();
-		child.in.reset();
-	});
+			shared_ptr<CachedDocument> cached;
 
-	thread reader([&child, &line_cnt_queue]() {
-		util::FileStream out(STDOUT_FILENO);
-		util::FilePiece child_out(child.out.release());
+			if (cache) {
+				cached = make_shared<CachedDocument>();
+				cached->child = NO_CHILD;
+				cached->has_trailing_newline = document.has_trailing_newline;
+				uncached_doc.clear();
 
-		size_t doc_cnt = 0;
-		Document document;
-		string doc;
+				for (size_t pos = 0; pos < doc.size();) {
+					size_t end = doc.find('\n', pos);
+					StringPiece doc_line(doc.data() + pos, end - pos);
+					uint64_t hash = LineCache::Hash(doc_line);
+					StringPiece output;
 
-		while (line_cnt_queue.Consume(document).line_cnt > 0) {
-			++doc_cnt;
+					// Only the first time in this run, and not if an earlier
+					// run already did.
+					bool send = !cache->FindStored(hash, output) && sent_hashes.insert(hash).second;
 
-			doc.clear();
-			doc.reserve(document.line_cnt * 4096); // 4096 is not a typical line length
+					cached->hashes.push_back(hash);
+					cached->sent.push_back(send);
 
-			try {
-				while (document.line_cnt-- > 0) {
-					StringPiece line(child_out.ReadLine());
-					doc.append(line.data(), line.length());
+					if (send)
+						uncached_doc.append(doc, pos, end + 1 - pos);
 
-					// ReadLine eats line endings. Between lines we definitely
-					// need to add them back. Whether we add the last one depends
-					// on whether the original document had a trailing newline.
-					if (document.line_cnt > 0 || document.has_trailing_newline)
-						doc.push_back('\n');
+					pos = end + 1;
 				}
-			} catch (util::EndOfFileException &e) {
-				UTIL_THROW(util::Exception, "Sub-process stopped producing while expecting more lines while processing document " << doc_cnt);
+
+				// The reader puts the lines that were not sent back in
+				document.line_cnt = count(uncached_doc.cbegin(), uncached_doc.cend(), '\n');
+				document.has_trailing_newline = true;
+				doc.swap(uncached_doc);
 			}
 
-			string encoded_doc;
-			base64_encode(doc, encoded_doc);
-			out << encoded_doc << '\n';
-
-			// Just to check, next time we call Consume(), will we block? If so,
-			// that means we've caught up with the producer. However, the order
-			// the producer fills line_cnt_queue is first giving us a new line-
-			// count and then sending the input to the sub-process. So if we do
-			// not have a new line count yet, the sub-process definitely can't
-			// have new output yet, and peek should block and once it unblocks
-			// we expect to have that line-count waiting. If we still don't,
-			// then what is this output that is being produced by the sub-
-			// process?
-			if (line_cnt_queue.Empty()) {
-				// If peek throws EOF now our sub-process stopped before its
-				// stdin was closed (producer produces the poison before it
-				// closes the sub-process's stdin.)
-				child_out.peek();
-				
-				// peek() came back. We have a line-number now, right? If not
-				// sub-process is producing output without any input to base it
-				// on. Which is bad.
-				if (line_cnt_queue.Empty())
-					UTIL_THROW(util::Exception, "sub-process is producing more output than it was given input at document " << doc_cnt);
+			if (document.line_cnt > 0) {
+				size_t child_index = dealt_cnt++ % children.size();
+				Child &child = *children[child_index];
+
+				if (cached)
+					cached->child = child_index;
+
+				sent_line_cnt += document.line_cnt;
+
+				if (stats)
+					document.queued = chrono::steady_clock::now();
+
+				// Send line count first to the reader, so it can start reading as
+				// soon as we start feeding the document to the child.
+				child.line_cnt_queue.Produce(document);
+
+				if (cached)
+					cached_queue.Produce(cached);
+
+				// Feed the document to the child.
+				// Might block because it can cause a flush.
+				PipeWriter &child_in = *children_in[child_index];
+				double blocked = child_in.blocked_seconds();
+
+				child_in << doc;
+
+				if (stats) {
+					stats->AddInput(doc.size(), document.line_cnt);
+					stats->AddFeederBlocked(child_in.blocked_seconds() - blocked);
+				}
+			} else {
+				cached_queue.Produce(cached);
 			}
 		}
+
+		// Tell the readers to stop with a document of no lines
+		for (auto &child : children)
+			child->line_cnt_queue.Produce(Document());
+
+		if (cache)
+			cached_queue.Produce(nullptr);
+
+		// Flush (blocks) & close the children's stdin
+		for (size_t i = 0; i < children.size(); ++i) {
+			double blocked = children_in[i]->blocked_seconds();
+			children_in[i]->flush();
+			children[i]->process.in.reset();
+
+			if (stats)
+				stats->AddFeederBlocked(children_in[i]->blocked_seconds() - blocked);
+
+			bytes_in += children_in[i]->bytes();
+			seconds_blocked += children_in[i]->blocked_seconds();
+			spliced |= children_in[i]->zero_copy();
+		}
+
+		seconds_in = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 	});
 
-	int retval = child.wait();
+	vector<thread> readers;
+	vector<uint64_t> children_bytes_out(children.size(), 0);
+
+	if (children.size() == 1 && !cache) {
+		readers.emplace_back([&children, &children_bytes_out, &stats]() {
+			util::FileStream out(STDOUT_FILENO);
+			string encoded_doc;
+
+			children_bytes_out[0] = read_output(*children[0], [&out, &encoded_doc](string &doc) {
+				encoded_doc.clear();
+				base64_encode(doc, encoded_doc);
+				out << encoded_doc << '\n';
+			}, stats.get());
+		});
+	} else {
+		// Each child has its own reader, so no child blocks on writing its
+		// output while the writer waits for another one.
+		for (size_t i = 0; i < children.size(); ++i)
+			readers.emplace_back([&children, &children_bytes_out, &cache, &stats, i]() {
+				Child &child = *children[i];
+
+				children_bytes_out[i] = read_output(child, [&child, &cache](string &doc) {
+					// With -c the writer has to combine it with the cached
+					// lines first.
+					shared_ptr<string> output = make_shared<string>();
+					if (cache)
+						output->swap(doc);
+					else
+						base64_encode(doc, *output);
+
+					child.output_queue.Produce(output);
+				}, stats.get());
+
+				child.output_queue.Produce(nullptr);
+			});
+
+		if (!cache) {
+			// Writes the documents in the order they were dealt to the children
+			readers.emplace_back([&children]() {
+				util::FileStream out(STDOUT_FILENO);
+				shared_ptr<string> encoded_doc;
+
+				for (size_t doc_cnt = 0; children[doc_cnt % children.size()]->output_queue.Consume(encoded_doc); ++doc_cnt)
+					out << *encoded_doc << '\n';
+			});
+		} else {
+			// Puts the output of the lines that were sent and the cached ones
+			// together in the order of the input. The first time a line occurs
+			// it is sent, and documents are written in order, so the output of
+			// a line that was not sent is always in the cache by now.
+			readers.emplace_back([&children, &cache, &cached_queue]() {
+				util::FileStream out(STDOUT_FILENO);
+				shared_ptr<CachedDocument> cached;
+				shared_ptr<string> output;
+				string doc;
+				string encoded_doc;
+
+				while (cached_queue.Consume(cached)) {
+					if (cached->child != NO_CHILD)
+						children[cached->child]->output_queue.Consume(output);
+
+					doc.clear();
+					size_t pos = 0;
+
+					for (size_t i = 0; i < cached->hashes.size(); ++i) {
+						StringPiece line;
+
+						if (cached->sent[i]) {
+							size_t end = output->find('\n', pos);
+							line = StringPiece(output->data() + pos, end - pos);
+							pos = end + 1;
+							cache->Add(cached->hashes[i], line);
+						} else {
+							UTIL_THROW_IF(!cache->Find(cached->hashes[i], line), util::Exception, "Line missing from cache");
+						}
+
+						doc.append(line.data(), line.size());
+
+						// Same as read_output()
+						if (i + 1 < cached->hashes.size() || cached->has_trailing_newline)
+							doc.push_back('\n');
+					}
+
+					encoded_doc.clear();
+					base64_encode(doc, encoded_doc);
+					out << encoded_doc << '\n';
+				}
+			});
+		}
+	}
+
+	// Exit code of the first child that failed
+	int retval = 0;
+	for (auto &child : children) {
+		int child_retval = child->process.wait();
+		if (retval == 0)
+			retval = child_retval;
+	}
 
 	feeder.join();
-	reader.join();
-	
+	for (auto &reader : readers)
+		reader.join();
+
+	if (stats)
+		stats->Stop();
+
+	// Only keep what the command made of the lines if it did not fail
+	if (cache && retval == 0) {
+		try {
+			cache->Save();
+		} catch (util::Exception const &e) {
+			cerr << e.what() << endl;
+			return 1;
+		}
+	}
+
+	if (verbose) {
+		seconds_out = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		for (uint64_t bytes : children_bytes_out)
+			bytes_out += bytes;
+
+		print_throughput(cerr, "to command", bytes_in, seconds_in);
+		cerr << ", " << setprecision(2) << seconds_blocked << "s blocked on a full pipe" << (spliced ? ", vmsplice" : "") << '\n';
+		print_throughput(cerr, "from command", bytes_out, seconds_out);
+		cerr << '\n';
+
+		if (cache)
+			cerr << "cache: sent " << sent_line_cnt << " of " << line_cnt << " lines to command\n";
+	}
+
 	return retval;
-}
\ No newline at end of file
+}
@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/program_options.hpp>
+#include "util/file.hh"
+#include "util/file_stream.hh"
+#include "src/base64.h"
+#include "src/murmur_hash.h"
+
+using namespace std;
+using namespace bitextor;
+
+namespace po = boost::program_options;
+
+/**
+ * Generates a synthetic pair of document sets in the format docalign expects:
+ * one base64 encoded, tokenised document per line. A fraction of the English
+ * documents has a noisy copy (the "translation") somewhere in the translated
+ * set; those pairs are written to the gold file so recall can be measured.
+ *
+ * Every document is generated from its own seed, so documents can be
+ * regenerated on demand instead of being kept in memory. Memory use is a few
+ * integers per document, which makes it possible to generate 10M+ documents.
+ */
+struct corpus_options {
+	size_t en_document_cnt = 10000;
+	size_t in_document_cnt = 0; // 0 means same as en_document_cnt
+	size_t vocab_size = 100000;
+	double zipf_exponent = 1.0;
+	double mean_tokens = 300;
+	double sigma_tokens = 1.0;
+	size_t tokens_per_line = 20;
+	double duplicate_rate = 0.05;
+	double true_pair_rate = 0.8;
+	double noise_rate = 0.2;
+	uint64_t seed = 1;
+};
+
+class CorpusGenerator {
+public:
+	explicit CorpusGenerator(corpus_options const &options)
+	: options_(options) {
+		mt19937_64 random(options_.seed);
+
+		uniform_int_distribution<size_t> length(2, 10);
+		uniform_int_distribution<int> letter('a', 'z');
+		vector<double> weights(options_.vocab_size);
+
+		vocab_.reserve(options_.vocab_size);
+		for (size_t rank = 1; rank <= options_.vocab_size; ++rank) {
+			string word(length(random), ' ');
+			for (char &c : word)
+				c = letter(random);
+			vocab_.push_back(word);
+			weights[rank - 1] = 1.0 / pow(rank, options_.zipf_exponent);
+		}
+
+		word_ = discrete_distribution<uint32_t>(weights.begin(), weights.end());
+	}
+
+	// Generates the body of the document with the given seed. Noise replaces
+	// that fraction of tokens with random other ones using noise_seed.
+	void document(uint64_t seed, double noise_rate, uint64_t noise_seed, string &out) {
+		mt19937_64 random(seed);
+		mt19937_64 noise_random(noise_seed);
+		uniform_real_distribution<double> noise(0, 1);
+
+		// Lognormal so that most documents are around mean_tokens but there is
+		// a long tail of huge pages, as in a real crawl.
+		lognormal_distribution<double> n_tokens_dist(log(options_.mean_tokens) - options_.sigma_tokens * options_.sigma_tokens / 2, options_.sigma_tokens);
+		size_t n_tokens = max<size_t>(1, n_tokens_dist(random));
+
+		out.clear();
+		for (size_t i = 0; i < n_tokens; ++i) {
+			uint32_t word = word_(random);
+
+			if (noise_rate > 0 && noise(noise_random) < noise_rate)
+				word = word_(noise_random);
+
+			out.append(vocab_[word]);
+			out.push_back((i + 1) % options_.tokens_per_line == 0 || i + 1 == n_tokens ? '\n' : ' ');
+		}
+	}
+
+private:
+	corpus_options options_;
+	vector<string> vocab_;
+	discrete_distribution<uint32_t> word_;
+};
+
+/**
+ * Seed for document n of a side. Documents that are a duplicate of an earlier
+ * one share its content seed.
+ */
+uint64_t document_seed(uint64_t seed, uint64_t side, uint64_t n) {
+	return MurmurHashCombine(n, MurmurHashCombine(side, seed));
+}
+
+/**
+ * For each document pick which document's content it has: its own, or with
+ * probability duplicate_rate that of a random earlier document.
+ */
+vector<size_t> content_ids(size_t document_cnt, double duplicate_rate, mt19937_64 &random) {
+	vector<size_t> ids(document_cnt);
+	uniform_real_distribution<double> chance(0, 1);
+
+	for (size_t i = 0; i < document_cnt; ++i) {
+		if (i > 0 && chance(random) < duplicate_rate)
+			ids[i] = ids[uniform_int_distribution<size_t>(0, i - 1)(random)];
+		else
+			ids[i] = i;
+	}
+
+	return ids;
+}
+
+void write_document(util::FileStream &out, string const &document, string &encoded) {
+	base64_encode(document, encoded);
+	out << encoded << '\n';
+}
+
+int main(int argc, char *argv[]) {
+	corpus_options options;
+	string prefix;
+
+	po::options_description generic_desc("Options");
+	generic_desc.add_options()
+		("help", "produce help message")
+		("documents,n", po::value<size_t>(&options.en_document_cnt), "number of English documents (default: 10000)")
+		("translated-documents", po::value<size_t>(&options.in_document_cnt), "number of translated documents (default: same as --documents)")
+		("vocab", po::value<size_t>(&options.vocab_size), "vocabulary size (default: 100000)")
+		("zipf", po::value<double>(&options.zipf_exponent), "Zipf exponent of the word distribution (default: 1.0)")
+		("mean-tokens", po::value<double>(&options.mean_tokens), "mean number of tokens per document (default: 300)")
+		("sigma-tokens", po::value<double>(&options.sigma_tokens), "sigma of the lognormal document length distribution (default: 1.0)")
+		("tokens-per-line", po::value<size_t>(&options.tokens_per_line), "tokens per line in a document (default: 20)")
+		("duplicate-rate", po::value<double>(&options.duplicate_rate), "fraction of documents that duplicate an earlier document on the same side (default: 0.05)")
+		("true-pair-rate", po::value<double>(&options.true_pair_rate), "fraction of documents that have a translation on the other side (default: 0.8)")
+		("noise", po::value<double>(&options.noise_rate), "fraction of tokens replaced in translations (default: 0.2)")
+		("seed", po::value<uint64_t>(&options.seed), "random seed (default: 1)");
+
+	po::options_description hidden_desc("Hidden options");
+	hidden_desc.add_options()
+		("prefix", po::value<string>(&prefix), "output prefix");
+
+	po::positional_options_description arg_desc;
+	arg_desc.add("prefix", 1);
+
+	po::options_description opt_desc;
+	opt_desc.add(generic_desc).add(hidden_desc);
+
+	po::variables_map vm;
+
+	try {
+		po::store(po::command_line_parser(argc, argv).options(opt_desc).positional(arg_desc).run(), vm);
+		po::notify(vm);
+	} catch (const po::error &exception) {
+		cerr << exception.what() << endl;
+		return 1;
+	}
+
+	if (vm.count("help") || prefix.empty()) {
+		cout << "Usage: " << argv[0] << " PREFIX\n\n"
+		     << "Writes PREFIX.translated, PREFIX.english and PREFIX.gold. The gold file\n"
+		        "has the translated and English index (starting with 1) of each true\n"
+		        "pair, the same columns as docalign's output.\n\n"
+		     << generic_desc << endl;
+		return 1;
+	}
+
+	if (options.in_document_cnt == 0)
+		options.in_document_cnt = options.en_document_cnt;
+
+	CorpusGenerator generator(options);
+	mt19937_64 random(options.seed);
+
+	constexpr uint64_t ENGLISH = 1, TRANSLATED = 2, NOISE = 3;
+
+	vector<size_t> en_content(content_ids(options.en_document_cnt, options.duplicate_rate, random));
+	vector<size_t> in_content(content_ids(options.in_document_cnt, options.duplicate_rate, random));
+
+	// Pick which English documents get a translation, and where in the
+	// translated set each of those ends up. Documents that are duplicates
+	// are skipped as their translation would be ambiguous.
+	size_t pair_cnt = min(options.en_document_cnt, options.in_document_cnt) * options.true_pair_rate;
+
+	vector<size_t> en_candidates;
+	for (size_t i = 0; i < options.en_document_cnt; ++i)
+		if (en_content[i] == i)
+			en_candidates.push_back(i);
+
+	shuffle(en_candidates.begin(), en_candidates.end(), random);
+	en_candidates.resize(min(pair_cnt, en_candidates.size()));
+	sort(en_candidates.begin(), en_candidates.end());
+
+	vector<size_t> in_positions;
+	for (size_t i = 0; i < options.in_document_cnt; ++i)
+		if (in_content[i] == i)
+			in_positions.push_back(i);
+
+	shuffle(in_positions.begin(), in_positions.end(), random);
+	in_positions.resize(min(en_candidates.size(), in_positions.size()));
+
+	// For every translated document, which English document it translates.
+	// Documents that duplicate a translation are translations of the same.
+	constexpr size_t NONE = -1;
+	vector<size_t> translation_of(options.in_document_cnt, NONE);
+	for (size_t i = 0; i < in_positions.size(); ++i)
+		translation_of[in_positions[i]] = en_candidates[i];
+
+	util::scoped_fd en_fd(util::CreateOrThrow((prefix + ".english").c_str()));
+	util::scoped_fd in_fd(util::CreateOrThrow((prefix + ".translated").c_str()));
+	util::scoped_fd gold_fd(util::CreateOrThrow((prefix + ".gold").c_str()));
+
+	util::FileStream en_out(en_fd.get());
+	util::FileStream in_out(in_fd.get());
+	util::FileStream gold_out(gold_fd.get());
+
+	string document, encoded;
+
+	for (size_t i = 0; i < options.en_document_cnt; ++i) {
+		generator.document(document_seed(options.seed, ENGLISH, en_content[i]), 0, 0, document);
+		write_document(en_out, document, encoded);
+	}
+
+	for (size_t i = 0; i < options.in_document_cnt; ++i) {
+		size_t en_id = translation_of[in_content[i]];
+
+		if (en_id != NONE) {
+			generator.document(document_seed(options.seed, ENGLISH, en_id), options.noise_rate, document_seed(options.seed, NOISE, in_content[i]), document);
+
+			// Only the original is a true pair, duplicates are not.
+			if (in_content[i] == i)
+				gold_out << (i + 1) << '\t' << (en_id + 1) << '\n';
+		} else {
+			generator.document(document_seed(options.seed, TRANSLATED, in_content[i]), 0, 0, document);
+		}
+
+		write_document(in_out, document, encoded);
+	}
+
+	return 0;
+}
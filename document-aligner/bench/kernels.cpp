@@ -0,0 +1,410 @@
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <benchmark/benchmark.h>
+#include "../src/base64.h"
+#include "../src/blocking_queue.h"
+#include "../src/document.h"
+#include "../src/ngram.h"
+#include "../src/single_producer_queue.h"
+#include "../src/sparse_matrix.h"
+#include "../src/wrap.h"
+
+using namespace std;
+using namespace bitextor;
+
+namespace {
+
+/**
+ * Deterministic generator for text that looks a bit like tokenised web pages:
+ * words of 1 to 12 letters drawn from a Zipf-distributed vocabulary, split
+ * over lines of varying length.
+ */
+class SyntheticText {
+public:
+	explicit SyntheticText(size_t vocab_size = 50000, double zipf_exponent = 1.1)
+	: random_(42) {
+		uniform_int_distribution<size_t> length(1, 12);
+		uniform_int_distribution<int> letter('a', 'z');
+
+		vector<double> weights;
+		weights.reserve(vocab_size);
+		vocab_.reserve(vocab_size);
+
+		for (size_t rank = 1; rank <= vocab_size; ++rank) {
+			string word(length(random_), ' ');
+			for (char &c : word)
+				c = letter(random_);
+			vocab_.push_back(word);
+			weights.push_back(1.0 / pow(rank, zipf_exponent));
+		}
+
+		word_ = discrete_distribution<size_t>(weights.begin(), weights.end());
+	}
+
+	string document(size_t n_lines, size_t words_per_line) {
+		uniform_int_distribution<size_t> line_length(1, 2 * words_per_line);
+		string document;
+
+		for (size_t i = 0; i < n_lines; ++i) {
+			for (size_t j = 0, n = line_length(random_); j < n; ++j) {
+				if (j > 0)
+					document.push_back(' ');
+				document.append(vocab_[word_(random_)]);
+			}
+			document.push_back('\n');
+		}
+
+		return document;
+	}
+
+	vector<string> encoded_documents(size_t n, size_t n_lines = 40, size_t words_per_line = 15) {
+		vector<string> documents(n);
+		for (auto &encoded : documents)
+			base64_encode(document(n_lines, words_per_line), encoded);
+		return documents;
+	}
+
+private:
+	mt19937 random_;
+	vector<string> vocab_;
+	discrete_distribution<size_t> word_;
+};
+
+// Document frequency table over a set of documents, pruned the same way
+// docalign does it with its default settings.
+unordered_map<NGram,size_t> make_df(vector<Document> const &documents) {
+	unordered_map<NGram,size_t> df;
+	for (auto const &document : documents)
+		for (auto const &entry : document.vocab)
+			df[entry.first] += 1;
+
+	for (auto it = df.begin(); it != df.end();)
+		if (it->second < 2 || it->second > 1000)
+			it = df.erase(it);
+		else
+			++it;
+
+	return df;
+}
+
+vector<Document> read_documents(vector<string> const &encoded, size_t ngram_size) {
+	vector<Document> documents(encoded.size());
+	for (size_t i = 0; i < encoded.size(); ++i) {
+		documents[i].id = i + 1;
+		ReadDocument(encoded[i], documents[i], ngram_size);
+	}
+	return documents;
+}
+
+void BM_base64_encode(benchmark::State &state) {
+	SyntheticText text;
+	string document(text.document(state.range(0), 15));
+	string encoded;
+
+	for (auto _ : state) {
+		base64_encode(document, encoded);
+		benchmark::DoNotOptimize(encoded.data());
+	}
+
+	state.SetBytesProcessed(state.iterations() * document.size());
+}
+BENCHMARK(BM_base64_encode)->Arg(1)->Arg(40)->Arg(1000);
+
+void BM_base64_decode(benchmark::State &state) {
+	SyntheticText text;
+	string encoded, document;
+	base64_encode(text.document(state.range(0), 15), encoded);
+
+	for (auto _ : state) {
+		base64_decode(encoded, document);
+		benchmark::DoNotOptimize(document.data());
+	}
+
+	state.SetBytesProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_base64_decode)->Arg(1)->Arg(40)->Arg(1000);
+
+void BM_NGramIter(benchmark::State &state) {
+	SyntheticText text;
+	string document(text.document(40, 15));
+	size_t ngram_cnt = 0;
+
+	for (auto _ : state) {
+		for (NGramIter it(document, state.range(0)); it; ++it) {
+			benchmark::DoNotOptimize(*it);
+			++ngram_cnt;
+		}
+	}
+
+	state.SetBytesProcessed(state.iterations() * document.size());
+	state.counters["ngrams"] = benchmark::Counter(ngram_cnt, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_NGramIter)->DenseRange(1, 5);
+
+template <size_t N> void BM_FixedNGramIter(benchmark::State &state) {
+	SyntheticText text;
+	string document(text.document(40, 15));
+	size_t ngram_cnt = 0;
+
+	for (auto _ : state) {
+		for (FixedNGramIter<N> it(document); it; ++it) {
+			benchmark::DoNotOptimize(*it);
+			++ngram_cnt;
+		}
+	}
+
+	state.SetBytesProcessed(state.iterations() * document.size());
+	state.counters["ngrams"] = benchmark::Counter(ngram_cnt, benchmark::Counter::kIsRate);
+}
+BENCHMARK_TEMPLATE(BM_FixedNGramIter, 1);
+BENCHMARK_TEMPLATE(BM_FixedNGramIter, 2);
+BENCHMARK_TEMPLATE(BM_FixedNGramIter, 3);
+BENCHMARK_TEMPLATE(BM_FixedNGramIter, 4);
+BENCHMARK_TEMPLATE(BM_FixedNGramIter, 5);
+
+void BM_ReadDocument(benchmark::State &state) {
+	SyntheticText text;
+	vector<string> encoded(text.encoded_documents(64));
+	Document document;
+
+	for (auto _ : state)
+		for (auto const &line : encoded)
+			ReadDocument(line, document, state.range(0));
+
+	state.SetItemsProcessed(state.iterations() * encoded.size());
+}
+BENCHMARK(BM_ReadDocument)->DenseRange(1, 3);
+
+void BM_calculate_tfidf(benchmark::State &state) {
+	SyntheticText text;
+	vector<Document> documents(read_documents(text.encoded_documents(2000), 2));
+	unordered_map<NGram,size_t> df(make_df(documents));
+	DocumentRef ref;
+
+	for (auto _ : state)
+		for (auto const &document : documents)
+			calculate_tfidf(document, ref, documents.size(), df);
+
+	state.SetItemsProcessed(state.iterations() * documents.size());
+}
+BENCHMARK(BM_calculate_tfidf);
+
+// docalign's hash engine: the first half of the documents in an NGramIndex,
+// the second half scored against it with score_document.
+void BM_score(benchmark::State &state) {
+	SyntheticText text;
+	vector<Document> documents(read_documents(text.encoded_documents(state.range(0)), 2));
+	unordered_map<NGram,size_t> df(make_df(documents));
+
+	// Index the first half, score the second half against it.
+	size_t half = documents.size() / 2;
+	NGramIndex ref_index;
+	vector<DocumentRef> queries(documents.size() - half);
+
+	for (size_t i = 0; i < half; ++i) {
+		DocumentRef ref;
+		calculate_tfidf(documents[i], ref, documents.size(), df);
+		for (auto const &entry : ref.wordvec)
+			ref_index[entry.hash].push_back(DocumentNGramScore{ref.id, entry.tfidf});
+	}
+
+	for (size_t i = half; i < documents.size(); ++i)
+		calculate_tfidf(documents[i], queries[i - half], documents.size(), df);
+
+	size_t postings_cnt = 0;
+
+	for (auto _ : state) {
+		for (auto const &doc_ref : queries) {
+			unordered_map<size_t, float> ref_scores;
+			postings_cnt += score_document(doc_ref, ref_index, ref_scores);
+			benchmark::DoNotOptimize(ref_scores.size());
+		}
+	}
+
+	state.SetItemsProcessed(state.iterations() * queries.size());
+	state.counters["postings"] = benchmark::Counter(postings_cnt, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_score)->Arg(1000)->Arg(4000);
+
+// Same as BM_score, but with docalign's spgemm engine: the indexed half as a
+// matrix with a row per ngram, the other half multiplied with it in blocks.
+void BM_score_spgemm(benchmark::State &state) {
+	SyntheticText text;
+	vector<Document> documents(read_documents(text.encoded_documents(state.range(0)), 2));
+	unordered_map<NGram,size_t> df(make_df(documents));
+
+	size_t half = documents.size() / 2;
+	unordered_map<NGram, vector<pair<uint32_t, float>>> postings;
+	vector<DocumentRef> queries(documents.size() - half);
+
+	for (size_t i = 0; i < half; ++i) {
+		DocumentRef ref;
+		calculate_tfidf(documents[i], ref, documents.size(), df);
+		for (auto const &entry : ref.wordvec)
+			postings[entry.hash].emplace_back(i, entry.tfidf);
+	}
+
+	unordered_map<NGram, uint32_t> rows;
+	CSRMatrix index;
+
+	for (auto const &entry : postings) {
+		rows[entry.first] = index.rows();
+		for (auto const &posting : entry.second)
+			index.push_back(posting.first, posting.second);
+		index.end_row();
+	}
+
+	for (size_t i = half; i < documents.size(); ++i)
+		calculate_tfidf(documents[i], queries[i - half], documents.size(), df);
+
+	DenseAccumulator acc(half);
+	CSRMatrix block;
+	size_t entry_cnt = 0;
+
+	for (auto _ : state) {
+		block.clear();
+
+		for (auto const &doc_ref : queries) {
+			for (auto const &word_score : doc_ref.wordvec) {
+				auto it = rows.find(word_score.hash);
+
+				if (it != rows.end())
+					block.push_back(it->second, word_score.tfidf);
+			}
+
+			block.end_row();
+		}
+
+		entry_cnt += MultiplyRows(block, index, 0.1, acc, [](size_t, uint32_t, float score) {
+			benchmark::DoNotOptimize(score);
+		}, [](size_t) {});
+	}
+
+	state.SetItemsProcessed(state.iterations() * queries.size());
+	state.counters["entries"] = benchmark::Counter(entry_cnt, benchmark::Counter::kIsRate);
+}
+BENCHMARK(BM_score_spgemm)->Arg(1000)->Arg(4000);
+
+// Batches of lines pushed through the queue, similar to what queue_lines in
+// docalign does, with state.range(0) consumer threads.
+void BM_blocking_queue(benchmark::State &state) {
+	constexpr size_t n_items = 10000;
+	size_t n_consumers = state.range(0);
+
+	for (auto _ : state) {
+		blocking_queue<unique_ptr<vector<string>>> queue(n_consumers * 32);
+		vector<thread> consumers;
+
+		for (size_t i = 0; i < n_consumers; ++i)
+			consumers.emplace_back([&queue]() {
+				while (unique_ptr<vector<string>> batch = queue.pop())
+					benchmark::DoNotOptimize(batch->size());
+			});
+
+		for (size_t i = 0; i < n_items; ++i)
+			queue.push(unique_ptr<vector<string>>(new vector<string>(1)));
+
+		for (size_t i = 0; i < n_consumers; ++i)
+			queue.push(nullptr);
+
+		for (auto &consumer : consumers)
+			consumer.join();
+	}
+
+	state.SetItemsProcessed(state.iterations() * n_items);
+}
+BENCHMARK(BM_blocking_queue)->Arg(1)->Arg(4)->UseRealTime();
+
+// Line counts passed from the feeder to the reader thread, like b64filter.
+void BM_SingleProducerQueue(benchmark::State &state) {
+	constexpr size_t n_items = 100000;
+
+	struct Item {
+		size_t line_cnt;
+		bool has_trailing_newline;
+	};
+
+	for (auto _ : state) {
+		SingleProducerQueue<Item> queue;
+
+		thread consumer([&queue]() {
+			Item item;
+			while (queue.Consume(item).line_cnt > 0)
+				benchmark::DoNotOptimize(item.has_trailing_newline);
+		});
+
+		for (size_t i = 0; i < n_items; ++i)
+			queue.Produce(Item{i + 1, true});
+
+		queue.Produce(Item{0, false});
+		consumer.join();
+	}
+
+	state.SetItemsProcessed(state.iterations() * n_items);
+}
+BENCHMARK(BM_SingleProducerQueue)->UseRealTime();
+
+string wrap_document(int64_t words_per_line) {
+	SyntheticText text;
+	string document(text.document(200, words_per_line));
+
+	// Sprinkle in some punctuation and multi-byte characters so all branches
+	// of the delimiter search are taken.
+	mt19937 random(1);
+	for (size_t i = 0; i < document.size(); i += 7 + random() % 30)
+		if (document[i] != '\n')
+			document[i] = ",.:-/"[random() % 5];
+
+	for (size_t pos = document.find('\n'); pos != string::npos; pos = document.find('\n', pos + 5))
+		document.insert(pos, "\xc3\xa9\xc3\xa9");
+
+	return document;
+}
+
+vector<StringPiece> split_lines(string const &document) {
+	vector<StringPiece> lines;
+	for (size_t pos = 0, end; (end = document.find('\n', pos)) != string::npos; pos = end + 1)
+		lines.emplace_back(document.data() + pos, end - pos);
+	return lines;
+}
+
+void BM_wrap_lines(benchmark::State &state) {
+	string document(wrap_document(state.range(0)));
+	vector<StringPiece> lines(split_lines(document));
+
+	wrap_options options;
+
+	for (auto _ : state)
+		for (auto const &line : lines)
+			benchmark::DoNotOptimize(wrap_lines(line, options));
+
+	state.SetBytesProcessed(state.iterations() * document.size());
+}
+BENCHMARK(BM_wrap_lines)->Arg(5)->Arg(50);
+
+void BM_LineWrapper(benchmark::State &state) {
+	string document(wrap_document(state.range(0)));
+	vector<StringPiece> lines(split_lines(document));
+
+	wrap_options options;
+	LineWrapper wrapper(options);
+
+	for (auto _ : state) {
+		for (auto const &line : lines) {
+			wrapper.Wrap(line);
+			benchmark::DoNotOptimize(wrapper.lines().data());
+		}
+	}
+
+	state.SetBytesProcessed(state.iterations() * document.size());
+}
+BENCHMARK(BM_LineWrapper)->Arg(5)->Arg(50);
+
+} // namespace
+
+BENCHMARK_MAIN();
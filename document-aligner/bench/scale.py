@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+#  End-to-end benchmark for the document-aligner tools on a synthetic corpus.
+#
+#  Generates a corpus with gencorpus (unless it already exists), then runs
+#  docalign, docjoin, docenc, b64filter and foldfilter on it and records wall
+#  time, CPU time, peak RSS and throughput for each, plus the recall and
+#  precision of docalign against the gold pairs. Results are written as
+#  tab-separated `tool metric value` lines so two builds can be compared
+#  with diff or paste.
+
+import argparse
+import os
+import subprocess
+import sys
+import time
+
+
+def run(name, cmd, stdin=None, stdout=subprocess.DEVNULL):
+    """Run cmd, wait for it and return (wall seconds, cpu seconds, peak rss kB)."""
+    start = time.monotonic()
+    proc = subprocess.Popen(cmd, stdin=stdin, stdout=stdout)
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.monotonic() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        sys.exit("{} failed with exit code {}: {}".format(name, proc.returncode, " ".join(cmd)))
+    return wall, usage.ru_utime + usage.ru_stime, usage.ru_maxrss
+
+
+def count_lines(path):
+    with open(path, 'rb') as fh:
+        return sum(1 for _ in fh)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument('--bin', default='bin', help='directory with the docalign, docjoin, docenc, b64filter, foldfilter and gencorpus binaries')
+    parser.add_argument('--workdir', default='scale-bench', help='directory for the generated corpus and intermediate files')
+    parser.add_argument('--output', default='-', help='results file (default: stdout)')
+    parser.add_argument('--jobs', '-j', type=int, default=None, help='threads for docalign')
+    parser.add_argument('--docalign-args', default='', help='extra arguments for docalign')
+    parser.add_argument('gencorpus_args', nargs=argparse.REMAINDER, help='arguments passed to gencorpus after --, e.g. -- -n 1000000 --zipf 1.1')
+    args = parser.parse_args()
+
+    gen_args = [arg for arg in args.gencorpus_args if arg != '--']
+    os.makedirs(args.workdir, exist_ok=True)
+
+    # Name the corpus after its parameters so it is only generated once per setting.
+    prefix = os.path.join(args.workdir, 'corpus' + ''.join('_' + arg.lstrip('-') for arg in gen_args))
+    translated, english, gold = prefix + '.translated', prefix + '.english', prefix + '.gold'
+
+    results = []
+
+    def record(tool, wall, cpu, rss, documents, *paths):
+        size = sum(os.path.getsize(path) for path in paths)
+        results.extend([
+            (tool, 'wall_time', '{:.3f}'.format(wall)),
+            (tool, 'cpu_time', '{:.3f}'.format(cpu)),
+            (tool, 'peak_rss_kb', str(rss)),
+            (tool, 'documents_per_second', '{:.1f}'.format(documents / wall if wall else 0)),
+            (tool, 'mb_per_second', '{:.2f}'.format(size / 1e6 / wall if wall else 0)),
+        ])
+
+    if not all(os.path.exists(path) for path in (translated, english, gold)):
+        wall, cpu, rss = run('gencorpus', [os.path.join(args.bin, 'gencorpus')] + gen_args + [prefix])
+        results.append(('gencorpus', 'wall_time', '{:.3f}'.format(wall)))
+
+    en_cnt, in_cnt = count_lines(english), count_lines(translated)
+    results.extend([
+        ('corpus', 'parameters', ' '.join(gen_args) or '(defaults)'),
+        ('corpus', 'english_documents', str(en_cnt)),
+        ('corpus', 'translated_documents', str(in_cnt)),
+    ])
+
+    # docalign
+    matches = prefix + '.matches'
+    cmd = [os.path.join(args.bin, 'docalign'), translated, english] + args.docalign_args.split()
+    if args.jobs:
+        cmd += ['-j', str(args.jobs)]
+    with open(matches, 'wb') as fout:
+        wall, cpu, rss = run('docalign', cmd, stdout=fout)
+    record('docalign', wall, cpu, rss, en_cnt + in_cnt, translated, english)
+
+    with open(gold) as fh:
+        gold_pairs = set(tuple(line.split()[:2]) for line in fh)
+    with open(matches) as fh:
+        found_pairs = set(tuple(line.split()[1:3]) for line in fh)
+    correct = len(gold_pairs & found_pairs)
+    results.extend([
+        ('docalign', 'pairs', str(len(found_pairs))),
+        ('docalign', 'recall', '{:.4f}'.format(correct / len(gold_pairs) if gold_pairs else 0)),
+        ('docalign', 'precision', '{:.4f}'.format(correct / len(found_pairs) if found_pairs else 0)),
+    ])
+
+    # docjoin: join both sides of every match back together
+    joins = prefix + '.joins'
+    with open(matches) as fin, open(joins, 'w') as fout:
+        for line in fin:
+            fout.write('\t'.join(line.rstrip('\n').split('\t')[1:3]) + '\n')
+    with open(joins) as fin:
+        wall, cpu, rss = run('docjoin', [os.path.join(args.bin, 'docjoin'), '-li', '-ri', '-l', translated, '-r', english], stdin=fin)
+    record('docjoin', wall, cpu, rss, len(found_pairs), joins)
+
+    # docenc: decode into plain text sentences, which foldfilter needs
+    sentences = prefix + '.sentences'
+    with open(sentences, 'wb') as fout:
+        wall, cpu, rss = run('docenc', [os.path.join(args.bin, 'docenc'), '-d', english], stdout=fout)
+    record('docenc', wall, cpu, rss, en_cnt, english)
+
+    # b64filter around cat: the overhead of the wrapper itself
+    with open(english) as fin:
+        wall, cpu, rss = run('b64filter', [os.path.join(args.bin, 'b64filter'), 'cat'], stdin=fin)
+    record('b64filter', wall, cpu, rss, en_cnt, english)
+
+    # foldfilter around cat, with narrow columns so there is plenty to wrap
+    with open(sentences) as fin:
+        wall, cpu, rss = run('foldfilter', [os.path.join(args.bin, 'foldfilter'), '-w', '40', 'cat'], stdin=fin)
+    record('foldfilter', wall, cpu, rss, count_lines(sentences), sentences)
+
+    fout = sys.stdout if args.output == '-' else open(args.output, 'w')
+    for row in results:
+        fout.write('\t'.join(row) + '\n')
+    if fout is not sys.stdout:
+        fout.close()
+
+
+if __name__ == '__main__':
+    main()
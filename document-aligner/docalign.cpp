@@ -1,17 +1,39 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <map>
+#include <algorithm>
 #include <unordered_map>
+#include <unordered_set>
+#include <type_traits>
 #include <thread>
 #include <memory>
+#include <exception>
 #include <mutex>
+#include <atomic>
 #include <vector>
 #include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <limits>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
 #include <boost/program_options.hpp>
 #include "util/file_piece.hh"
+#include "util/file_stream.hh"
+#include "src/block_file.h"
 #include "src/document.h"
 #include "src/blocking_queue.h"
+#include "src/stats.h"
+#include "src/index_segment.h"
+#include "src/sparse_matrix.h"
+#include "src/unix_socket.h"
+#include "src/murmur_hash.h"
 
 
 using namespace bitextor;
@@ -30,15 +52,43 @@ struct DocumentPair {
 	size_t en_idx;
 };
 
-struct DocumentNGramScore {
-	size_t doc_id;
-	float tfidf;
+/**
+ * Measurements for a single phase of the alignment process, written to the
+ * file passed to --stats-json.
+ */
+struct PhaseStats {
+	string name;
+	double wall_time;
+	double cpu_time;
+	size_t peak_rss;
+	size_t documents;
+	size_t ngrams;
+
+	// Phase specific counts, i.e. DF size or number of candidate pairs
+	vector<pair<string,size_t>> counts;
+
+	// Performance of the queues used in this phase
+	vector<pair<string,queue_performance>> queues;
 };
 
 constexpr size_t QUEUE_SIZE_PER_THREAD = 32;
 
 constexpr size_t BATCH_SIZE = 512;
 
+// Rough memory cost of the DF table and index, used for --max-memory. A DF
+// entry and an index key are each a hash table node plus bucket. A posting is
+// a DocumentNGramScore in a vector that can be up to twice as large as needed.
+constexpr size_t DF_ENTRY_BYTES = 48;
+
+constexpr size_t INDEX_KEY_BYTES = 64;
+
+constexpr size_t POSTING_BYTES = 2 * sizeof(DocumentNGramScore);
+
+// With narrower ngram hashes, --verbose measures the collision rate over the
+// ngrams whose short hash is a multiple of this. Ngrams that collide share
+// that hash, so they are sampled together and the rate is not skewed.
+constexpr size_t COLLISION_SAMPLE_RATE = 64;
+
 /**
  * Utility to start N threads executing fun. Returns a vector with those thread objects.
  */
@@ -50,6 +100,45 @@ template <typename T> vector<thread> start(unsigned int n_threads, T fun) {
 	return threads;
 }
 
+/**
+ * First exception thrown by a set of worker threads.
+ */
+class worker_error {
+public:
+	void set(exception_ptr error) {
+		unique_lock<mutex> lock(mutex_);
+		if (!error_)
+			error_ = error;
+	}
+
+	// Throws it again, if there was one. Only once the workers have stopped.
+	void rethrow() const {
+		if (error_)
+			rethrow_exception(error_);
+	}
+
+private:
+	mutex mutex_;
+	exception_ptr error_;
+};
+
+/**
+ * Like start(), for workers that take work from queue until they get a null
+ * pointer. A worker that throws keeps emptying the queue after storing the
+ * exception in error, so whoever fills the queue does not wait forever.
+ */
+template <typename Q, typename T> vector<thread> start(unsigned int n_threads, blocking_queue<unique_ptr<Q>> &queue, worker_error &error, T fun) {
+	return start(n_threads, [&queue, &error, fun]() {
+		try {
+			fun();
+		} catch (...) {
+			error.set(current_exception());
+			while (queue.pop())
+				;
+		}
+	});
+}
+
 /**
  * Utility to stop & join threads. Needs access to the queue to supply it null pointers after which it waits
  * for the workers to stop & join.
@@ -67,384 +156,2121 @@ ostream &operator<<(ostream &out, queue_performance const &performance) {
 	           << "   overflow: " << performance.overflow << '\n';
 }
 
-void print_score(float score, size_t left_id, size_t right_id)
+void write_json(ostream &out, vector<PhaseStats> const &phases)
 {
-	cout << fixed << setprecision(5)
-	     << score
-	     << '\t' << left_id
-	     << '\t' << right_id
-	     << '\n';
-}
+	out << "{\n  \"phases\": [";
 
-size_t queue_lines(util::FilePiece &fin, blocking_queue<unique_ptr<vector<Line>>> &queue, size_t skip_rate = 1)
-{
-	size_t document_count = 0;
+	for (size_t i = 0; i < phases.size(); ++i) {
+		PhaseStats const &phase = phases[i];
 
-	auto it = fin.begin();
+		out << (i > 0 ? "," : "") << "\n    {\n"
+		    << "      \"name\": \"" << phase.name << "\",\n"
+		    << "      \"wall_time\": " << phase.wall_time << ",\n"
+		    << "      \"cpu_time\": " << phase.cpu_time << ",\n"
+		    << "      \"peak_rss\": " << phase.peak_rss << ",\n"
+		    << "      \"documents\": " << phase.documents << ",\n"
+		    << "      \"documents_per_second\": " << (phase.wall_time > 0 ? phase.documents / phase.wall_time : 0) << ",\n"
+		    << "      \"ngrams\": " << phase.ngrams << ",\n"
+		    << "      \"ngrams_per_second\": " << (phase.wall_time > 0 ? phase.ngrams / phase.wall_time : 0);
 
-	while (it != fin.end()) {
-		unique_ptr<vector<Line>> line_batch(new vector<Line>());
-		line_batch->reserve(BATCH_SIZE);
+		for (auto const &count : phase.counts)
+			out << ",\n      \"" << count.first << "\": " << count.second;
 
-		for (size_t i = 0; i < BATCH_SIZE; ++i) {
-			if (document_count++ % skip_rate == 0)
-				line_batch->push_back({
-					.str = string(it->data(), it->size()),
-					.n = document_count
-				});
+		out << ",\n      \"queues\": {";
 
-			if (++it == fin.end())
-				break;
+		for (size_t j = 0; j < phase.queues.size(); ++j) {
+			queue_performance const &performance = phase.queues[j].second;
+
+			out << (j > 0 ? "," : "") << "\n        \"" << phase.queues[j].first << "\": {"
+			    << "\"underflow\": " << performance.underflow << ", "
+			    << "\"overflow\": " << performance.overflow << ", "
+			    << "\"occupancy\": [";
+
+			// Skip the unused 0 bucket and the tail of the histogram that
+			// was never reached to keep the file readable.
+			size_t end = performance.occupancy.size();
+			while (end > 1 && performance.occupancy[end - 1] == 0)
+				--end;
+
+			for (size_t n = 1; n < end; ++n)
+				out << (n > 1 ? ", " : "") << performance.occupancy[n];
+
+			out << "]}";
 		}
 
-		queue.push(move(line_batch));
+		out << (phase.queues.empty() ? "}" : "\n      }") << "\n    }";
 	}
 
-	return document_count;
+	out << "\n  ]\n}\n";
 }
 
-size_t queue_lines(std::string const &path, blocking_queue<unique_ptr<vector<Line>>> &queue, size_t skip_rate = 1)
+/**
+ * Closes off a phase: records the time spent since timer was reset and the
+ * peak memory usage so far. Resets the timer for the next phase.
+ */
+PhaseStats &record_phase(vector<PhaseStats> &phases, string const &name, stopwatch &timer)
 {
-	util::FilePiece fin(path.c_str());
-	return queue_lines(fin, queue, skip_rate);
+	phases.emplace_back();
+	PhaseStats &phase = phases.back();
+	phase.name = name;
+	phase.wall_time = timer.wall_time();
+	phase.cpu_time = timer.cpu_time();
+	phase.peak_rss = peak_rss();
+	phase.documents = 0;
+	phase.ngrams = 0;
+	timer.reset();
+	return phase;
 }
 
-int main(int argc, char *argv[])
+template <typename NGramT> size_t count_ngrams(BasicDocument<NGramT> const &document)
 {
-	unsigned int n_threads = thread::hardware_concurrency();
-	
-	float threshold = 0.1;
-	
-	size_t df_sample_rate = 1;
-	
-	size_t ngram_size = 2;
-
-	size_t min_ngram_cnt = 2;
-
-	size_t max_ngram_cnt = 1000;
+	size_t ngram_cnt = 0;
+	for (auto const &entry : document.vocab)
+		ngram_cnt += entry.second;
+	return ngram_cnt;
+}
 
-	bool verbose = false;
+/**
+ * Builds the index matrix for the spgemm engine from documents, which are its
+ * columns. Each ngram that occurs in them gets a row, numbered in rows. The
+ * documents are freed as they are added.
+ */
+template <typename NGramT> void build_index_matrix(vector<BasicDocumentRef<NGramT>> &documents, unordered_map<NGramT, uint32_t> &rows, CSRMatrix &matrix)
+{
+	// Count the entries of each row, so the matrix can be filled in one go
+	vector<size_t> row_cnt;
 
-	bool print_all = false;
-	
-	po::positional_options_description arg_desc;
-	arg_desc.add("translated-tokens", 1);
-	arg_desc.add("english-tokens", 1);
-	
-	po::options_description generic_desc("Additional options");
-	generic_desc.add_options()
-		("help", "produce help message")
-		("df-sample-rate", po::value<size_t>(&df_sample_rate), "set sample rate to every n-th document (default: 1)")
-		("ngram_size,n", po::value<size_t>(&ngram_size), "ngram size (default: 2)")
-		("jobs,j", po::value<unsigned int>(&n_threads), "set number of threads (default: all)")
-		("threshold", po::value<float>(&threshold), "set score threshold (default: 0.1)")
-		("min_count", po::value<size_t>(&min_ngram_cnt), "minimal number of documents an ngram can appear in to be included in DF (default: 2)")
-		("max_count", po::value<size_t>(&max_ngram_cnt), "maximum number of documents for ngram to to appear in (default: 1000)")
-		("all", po::bool_switch(&print_all), "print all scores, not only the best pairs")
-		("verbose,v", po::bool_switch(&verbose), "show additional output");
-	
-	po::options_description hidden_desc("Hidden options");
-	hidden_desc.add_options()
-		("translated-tokens", po::value<string>(), "set input filename")
-		("english-tokens", po::value<string>(), "set input filename");
+	for (auto const &document : documents) {
+		for (auto const &entry : document.wordvec) {
+			auto it = rows.emplace(entry.hash, rows.size()).first;
 
-	po::options_description opt_desc;
-	opt_desc.add(generic_desc).add(hidden_desc);
+			if (it->second == row_cnt.size())
+				row_cnt.push_back(0);
 
-	po::variables_map vm;
-	
-	try {
-		po::store(po::command_line_parser(argc, argv).options(opt_desc).positional(arg_desc).run(), vm);
-		po::notify(vm);
-	} catch (const po::error &exception) {
-		cerr << exception.what() << endl;
-		return 1;
-	}
-	
-	if (vm.count("help") || !vm.count("translated-tokens") || !vm.count("english-tokens")) {
-		cout << "Usage: " << argv[0]
-		     << " TRANSLATED-TOKENS ENGLISH-TOKENS\n\n"
-		     << generic_desc << endl;
-		return 1;
+			++row_cnt[it->second];
+		}
 	}
 
-	unsigned int n_sample_threads = n_threads;
-
-	unsigned int n_load_threads = n_threads;
-
-	// Note: I've tried many heuristics for the number of reading threads, but
-	// my conclusion was that I either have too few and the scoring threads are
-	// waiting, or the queue is filled and the reading threads are blocking
-	// anyway. On desktop (macOS) just using maximum threads everywhere was
-	// always the fastest.
-	unsigned int n_read_threads = n_threads;
+	matrix.row_ptr.assign(row_cnt.size() + 1, 0);
+	for (size_t row = 0; row < row_cnt.size(); ++row)
+		matrix.row_ptr[row + 1] = matrix.row_ptr[row] + row_cnt[row];
 
-	unsigned int n_score_threads = n_threads;
-	
-	// Calculate the document frequency for terms. Starts a couple of threads
-	// that parse documents and keep a local hash table for counting. At the
-	// end these tables are merged into df.
-	unordered_map<NGram,size_t> df;
-	size_t in_document_cnt, en_document_cnt, document_cnt;
+	matrix.col.resize(matrix.row_ptr.back());
+	matrix.value.resize(matrix.row_ptr.back());
 
-	{
-		mutex df_mutex;
-		blocking_queue<unique_ptr<vector<Line>>> queue(n_sample_threads * QUEUE_SIZE_PER_THREAD);
-		vector<thread> workers(start(n_sample_threads, [&queue, &df, &df_mutex, &ngram_size, &df_sample_rate]() {
-			unordered_map<NGram, size_t> local_df;
+	// Reuse row_cnt as the position to write the next entry of each row at
+	for (size_t row = 0; row < row_cnt.size(); ++row)
+		row_cnt[row] = matrix.row_ptr[row];
 
-			while (true) {
-				unique_ptr<vector<Line>> line_batch(queue.pop());
+	for (size_t column = 0; column < documents.size(); ++column) {
+		for (auto const &entry : documents[column].wordvec) {
+			size_t pos = row_cnt[rows[entry.hash]]++;
+			matrix.col[pos] = column;
+			matrix.value[pos] = entry.tfidf;
+		}
 
-				if (!line_batch)
-					break;
+		vector<BasicWordScore<NGramT>>().swap(documents[column].wordvec);
+	}
+}
 
-				for (Line const &line : *line_batch) {
-					Document document;
-					ReadDocument(line.str, document, ngram_size);
-					for (auto const &entry : document.vocab)
-						local_df[entry.first] += 1; // Count once every document
-				}
-			}
+/**
+ * Parses a size in bytes with an optional K, M, G or T suffix, i.e. 512M or
+ * 1.5G. Returns false if str is not understood.
+ */
+bool parse_size(string const &str, size_t &size)
+{
+	char *end;
+	double value = strtod(str.c_str(), &end);
 
-			// Merge the local DF into the global one. Multiply by df_sample_rate
-			// to compensate for reading only nth part of the whole collection.
-			{
-				unique_lock<mutex> lock(df_mutex);
-				for (auto const &entry : local_df)
-					df[entry.first] += entry.second * df_sample_rate;
-			}
-		}));
+	if (end == str.c_str() || value < 0)
+		return false;
 
-		// We'll use in_document_cnt later to reserve some space for the documents
-		// we want to keep in memory. (Also this line is the whole reason the
-		// worker management + reading isn't wrapped in a single function: I
-		// want to re-use the same workers for two files.)
-		en_document_cnt = queue_lines(vm["english-tokens"].as<std::string>(), queue, df_sample_rate);
-		in_document_cnt = queue_lines(vm["translated-tokens"].as<std::string>(), queue, df_sample_rate);
-		document_cnt = in_document_cnt + en_document_cnt;
+	string suffix(end);
+	size_t multiplier = 1;
 
-		stop(queue, workers);
+	if (!suffix.empty()) {
+		size_t unit = string("KMGT").find(toupper(suffix[0]));
 
-		if (verbose)
-			cerr << "Calculated DF from " << document_cnt / df_sample_rate << " documents" << endl;
+		if (unit == string::npos || suffix.size() > 2 || (suffix.size() == 2 && toupper(suffix[1]) != 'B'))
+			return false;
 
-		if (verbose)
-			cerr << "DF queue performance:\n" << queue.performance();
+		multiplier = size_t(1) << (10 * (unit + 1));
 	}
 
-	// Prune the DF table, similar to what the Python implementation does. Note
-	// that these counts are linked to sample-rate already, so if you have a
-	// sample rate of higher than 1, your min_ngram_count should also be a
-	// multiple of sample rate + 1.
-	{
-		unordered_map<NGram, size_t> pruned_df;
-		for (auto const &entry : df) {
-			if (entry.second < min_ngram_cnt)
-				continue;
+	size = value * multiplier;
+	return true;
+}
 
-			if (entry.second > max_ngram_cnt)
-				continue;
+/**
+ * Parses a comma separated list of ngram sizes, i.e. 1,2,3. The sizes are
+ * returned sorted and without duplicates. Returns false if str is not
+ * understood or contains a size of 0.
+ */
+bool parse_ngram_sizes(string const &str, vector<size_t> &ngram_sizes)
+{
+	ngram_sizes.clear();
 
-			pruned_df[entry.first] = entry.second;
-		}
+	for (size_t pos = 0; pos <= str.size();) {
+		size_t end = min(str.find(',', pos), str.size());
+		string size_str(str.substr(pos, end - pos));
+		char *size_end;
+		unsigned long size = strtoul(size_str.c_str(), &size_end, 10);
 
-		if (verbose)
-			cerr << "Pruned " << df.size() - pruned_df.size() << " (" << 100.0 - 100.0 * pruned_df.size() / df.size() << "%) entries from DF" << endl;
+		if (size_str.empty() || *size_end != '\0' || size == 0)
+			return false;
 
-		swap(df, pruned_df);
+		ngram_sizes.push_back(size);
+		pos = end + 1;
 	}
 
-	// Read translated documents & pre-calculate TF/DF for each of these documents
-	unordered_map<NGram, vector<DocumentNGramScore>> ref_index;
-	
-	{
-		mutex ref_index_mutex;
+	sort(ngram_sizes.begin(), ngram_sizes.end());
+	ngram_sizes.erase(unique(ngram_sizes.begin(), ngram_sizes.end()), ngram_sizes.end());
+	return true;
+}
 
-		blocking_queue<unique_ptr<vector<Line>>> queue(n_load_threads * QUEUE_SIZE_PER_THREAD);
-		vector<thread> workers(start(n_load_threads, [&queue, &ref_index, &ref_index_mutex, &df, &document_cnt, &ngram_size]() {
-			unordered_map<NGram, vector<DocumentNGramScore>> local_ref_index;
+string format_ngram_sizes(vector<size_t> const &ngram_sizes)
+{
+	string str;
+	for (size_t ngram_size : ngram_sizes)
+		str += (str.empty() ? "" : ",") + to_string(ngram_size);
+	return str;
+}
 
-			while (true) {
-				unique_ptr<vector<Line>> line_batch(queue.pop());
+void print_score(ostream &out, float score, size_t left_id, size_t right_id)
+{
+	out << fixed << setprecision(5)
+	     << score
+	     << '\t' << left_id
+	     << '\t' << right_id
+	     << '\n';
+}
 
-				if (!line_batch)
-					break;
+/**
+ * Reads lines from fin and queues them in batches. Only every skip_rate-th
+ * line is queued. Stops after max_lines lines, so it can be called again on
+ * the same fin to continue where it left off. Lines are numbered starting at
+ * offset + 1. Returns the number of lines read.
+ */
+size_t queue_lines(DocumentReader &fin, blocking_queue<unique_ptr<vector<Line>>> &queue, size_t skip_rate = 1, size_t offset = 0, size_t max_lines = numeric_limits<size_t>::max())
+{
+	size_t document_count = 0;
 
-				for (Line const &line : *line_batch) {
-					Document doc{.id = line.n, .vocab = {}};
-					ReadDocument(line.str, doc, ngram_size);
-
-					// Note that each worker writes to a different line in the refs
-					// vector and the vector has been initialized with enough lines
-					// so there should be no concurrency issue.
-					// DF is accessed read-only. N starts counting at 1.
-					DocumentRef ref;
-					calculate_tfidf(doc, ref, document_cnt, df);
-
-					for (auto const &entry : ref.wordvec) {
-						local_ref_index[entry.hash].push_back(DocumentNGramScore{
-							.doc_id = line.n,
-							.tfidf = entry.tfidf
-						});
-					}
-				}
-			}
+	StringPiece line;
 
-			{
-				// Merge the local index we built into the global one
-				unique_lock<mutex> lock(ref_index_mutex);
-				for (auto &entry : local_ref_index) {
-					auto &dest = ref_index[entry.first];
+	bool eof = false;
 
-					// Minor optimisation: copy the fewest elements possible
-					if (dest.size() < entry.second.size())
-						swap(dest, entry.second);
+	while (!eof && document_count < max_lines) {
+		unique_ptr<vector<Line>> line_batch(new vector<Line>());
+		line_batch->reserve(BATCH_SIZE);
 
-					dest.reserve(dest.size() + entry.second.size());
-					
-					move(entry.second.begin(), entry.second.end(), back_inserter(dest));
-				}
+		for (size_t i = 0; i < BATCH_SIZE && document_count < max_lines; ++i) {
+			if (!fin.ReadLineOrEOF(line)) {
+				eof = true;
+				break;
 			}
-		}));
 
-		size_t refs_cnt = queue_lines(vm["translated-tokens"].as<std::string>(), queue);
+			if (document_count++ % skip_rate == 0)
+				line_batch->push_back({
+					.str = string(line.data(), line.size()),
+					.n = offset + document_count
+				});
+		}
 
-		stop(queue, workers);
+		if (!line_batch->empty())
+			queue.push(move(line_batch));
+	}
 
-		if (verbose)
-			cerr << "Read " << refs_cnt << " documents into memory" << endl;
+	return document_count;
+}
 
-		if (verbose)
-			cerr << "Load queue performance:\n" << queue.performance();
-	}
+/**
+ * Returns the host of url, in lowercase and without "www.", i.e. example.com
+ * for https://www.Example.com:8080/page. Without a scheme, url is taken to
+ * start with the host.
+ */
+string url_host(StringPiece const &url)
+{
+	string host(url.data(), url.size());
 
-	// Start reading the other set of documents we match against and do the matching.
-	{
-		blocking_queue<unique_ptr<vector<Line>>> read_queue(n_read_threads * QUEUE_SIZE_PER_THREAD);
+	size_t scheme = host.find("://");
+	if (scheme != string::npos)
+		host.erase(0, scheme + 3);
 
-		blocking_queue<unique_ptr<vector<DocumentRef>>> score_queue(n_score_threads * QUEUE_SIZE_PER_THREAD);
+	host.erase(min(host.find_first_of("/?#"), host.size()));
 
-		vector<thread> read_workers(start(n_read_threads, [&read_queue, &score_queue, &document_cnt, &df, &ngram_size]() {
-			while (true) {
-				unique_ptr<vector<Line>> line_batch(read_queue.pop());
+	size_t userinfo = host.rfind('@');
+	if (userinfo != string::npos)
+		host.erase(0, userinfo + 1);
 
-				// Empty pointer is poison
-				if (!line_batch)
-					break;
+	host.erase(min(host.find(':'), host.size()));
 
-				unique_ptr<vector<DocumentRef>> ref_batch(new vector<DocumentRef>());
-				ref_batch->reserve(line_batch->size());
-			
-				for (Line const &line : *line_batch) {
-					Document doc{.id = line.n, .vocab = {}};
-					ReadDocument(line.str, doc, ngram_size);
+	transform(host.begin(), host.end(), host.begin(), ::tolower);
 
-					ref_batch->emplace_back();
-					calculate_tfidf(doc, ref_batch->back(), document_cnt, df);
-				}
+	if (host.compare(0, 4, "www.") == 0)
+		host.erase(0, 4);
 
-				score_queue.push(move(ref_batch));
-			}
-		}));
+	return host;
+}
 
-		// Function used to report the score. Implementation depends on whether
-		// we are doing print_all or not. Mutex is necessary for both cases,
-		// either for writing to top_scores or for printing to stdout.
-		function<void (float, size_t in_ref, size_t en_ref)> mark_score;
-		mutex mark_score_mutex;
+/**
+ * Block of each document of both sides, for --translated-keys and
+ * --english-keys. Only documents in the same block are scored against each
+ * other. Blocks are numbered in the order their keys are first seen.
+ */
+struct DocumentBlocks {
+	// Block of each document, by id - 1. Empty without block keys.
+	vector<uint32_t> in_blocks;
+	vector<uint32_t> en_blocks;
 
-		// Scores for all pairs (that meet the threshold). Only used with 
-		vector<DocumentPair> scored_pairs;
+	// For each block, whether it has documents on both sides
+	vector<bool> shared;
 
-		if (!print_all) {
-			mark_score = [&scored_pairs, &mark_score_mutex] (float score, size_t in_ref, size_t en_ref) {
-				unique_lock<mutex> lock(mark_score_mutex);
-				scored_pairs.push_back({score, in_ref, en_ref});
-			};
-		} else {
-			mark_score = [&mark_score_mutex](float score, size_t in_ref, size_t en_ref) {
-				unique_lock<mutex> lock(mark_score_mutex);
-				print_score(score, in_ref, en_ref);
-			};
-		}
+	bool empty() const {
+		return in_blocks.empty();
+	}
+};
 
-		vector<thread> score_workers(start(n_score_threads, [&score_queue, &ref_index, &threshold, &mark_score]() {
-			while (true) {
-				unique_ptr<vector<DocumentRef>> doc_ref_batch(score_queue.pop());
+/**
+ * Reads a block key per line from path into blocks, numbering new keys from
+ * the size of ids. With host, the key is the host of the URL on the line.
+ */
+void read_block_keys(string const &path, bool host, unordered_map<string, uint32_t> &ids, vector<uint32_t> &blocks)
+{
+	util::FilePiece fin(path.c_str());
 
-				if (!doc_ref_batch)
-					break;
+	for (StringPiece line : fin) {
+		string key(host ? url_host(line) : string(line.data(), line.size()));
+		blocks.push_back(ids.emplace(key, ids.size()).first->second);
+	}
+}
 
-				for (auto &doc_ref : *doc_ref_batch) {
-					unordered_map<size_t, float> ref_scores;
-					
-					for (auto const &word_score : doc_ref.wordvec) {
-						// Search ngram hash (uint64_t) in ref_index
-						auto it = ref_index.find(word_score.hash);
-						
-						if (it == ref_index.end())
-							continue;
-						
-						for (auto const &ref_score : it->second)
-							ref_scores[ref_score.doc_id] += word_score.tfidf * ref_score.tfidf;
-					}
+DocumentBlocks read_blocks(string const &in_path, string const &en_path, bool host)
+{
+	DocumentBlocks blocks;
+	unordered_map<string, uint32_t> ids;
 
-					for (auto const &ref : ref_scores)
-						if (ref.second >= threshold)
-							mark_score(ref.second, ref.first, doc_ref.id);
-				}
-			}
-		}));
+	read_block_keys(in_path, host, ids, blocks.in_blocks);
+	read_block_keys(en_path, host, ids, blocks.en_blocks);
 
-		queue_lines(vm["english-tokens"].as<std::string>(), read_queue);
+	vector<bool> in_side(ids.size(), false);
+	for (uint32_t block : blocks.in_blocks)
+		in_side[block] = true;
 
-		// Tell all workers there is nothing left and wait for them to stop.
-		stop(read_queue, read_workers);
-		stop(score_queue, score_workers);
+	blocks.shared.assign(ids.size(), false);
+	for (uint32_t block : blocks.en_blocks)
+		blocks.shared[block] = in_side[block];
+
+	return blocks;
+}
 
-		if (!print_all) {
-			// Sort scores, best on top. Also sort on other properties to make
-			// it a consistent order, c.f. not depending on the processing order.
-			sort(scored_pairs.begin(), scored_pairs.end(), [](DocumentPair const &a, DocumentPair const &b) {
-				if (a.score != b.score)
-					return a.score > b.score;
+/**
+ * Mixes block into the ngram hashes of document, so it only matches documents
+ * of the same block in the index. That splits the index into a part for each
+ * block, without a hash table for each.
+ */
+template <typename NGramT> void move_to_block(BasicDocumentRef<NGramT> &document, uint32_t block)
+{
+	for (auto &entry : document.wordvec)
+		entry.hash = fold_ngram<NGramT>(NGram{MurmurHashCombine(entry.hash.hash, block)});
+}
 
-				if (a.in_idx != b.in_idx)
-					return a.in_idx > b.in_idx;
+/**
+ * The documents of one side grouped by their ngram bag, for --dedup. Only the
+ * first document of each class, its representative, is indexed or scored.
+ * Without --dedup every document is a class of its own.
+ */
+struct DuplicateClasses {
+	// For each document (by id - 1) the id of its representative. Empty
+	// without --dedup.
+	vector<size_t> representative;
 
-				return a.en_idx > b.en_idx;
-			});
+	// For each class of more than one document, by representative, its
+	// documents in order.
+	unordered_map<size_t, vector<size_t>> members;
 
-			// Keep track of which documents have already been assigned
-			vector<bool> in_seen(in_document_cnt);
-			vector<bool> en_seen(en_document_cnt);
+	// Documents that are not a representative
+	size_t duplicate_cnt = 0;
 
-			// Also keep a quick tally on whether we've printed scores for
-			// every document, so we don't keep searching while in_seen or
-			// en_seen is completely filled.
-			size_t cnt = 0;
-			size_t document_cnt = min(in_document_cnt, en_document_cnt);
+	bool is_representative(size_t id) const {
+		return representative.empty() || representative[id - 1] == id;
+	}
 
-			// For each pair (with score, sorted from good to bad)
-			for (DocumentPair const &pair : scored_pairs) {
-				// If either of the documents has already been printed, skip it.
-				if (in_seen[pair.in_idx - 1] || en_seen[pair.en_idx - 1])
-					continue;
+	// The documents in the class of representative id, in order. That is just
+	// id itself (so it has to stay around) if the class has no others.
+	pair<size_t const *, size_t> class_of(size_t const &id) const {
+		if (!members.empty()) {
+			auto it = members.find(id);
+			if (it != members.end())
+				return make_pair(it->second.data(), it->second.size());
+		}
 
-				print_score(pair.score, pair.in_idx, pair.en_idx);
-				in_seen[pair.in_idx - 1] = true;
-				en_seen[pair.en_idx - 1] = true;
+		return make_pair(&id, size_t(1));
+	}
+};
 
-				if (++cnt == document_cnt)
-					break;
-			}
+/**
+ * Groups document_cnt documents, numbered from offset + 1, by the hash of
+ * their ngram bag. bags holds (id, hash) for at least those documents. With
+ * blocks, the block of each document, only documents of the same block are
+ * grouped.
+ */
+DuplicateClasses group_duplicates(vector<pair<size_t, uint64_t>> const &bags, size_t offset, size_t document_cnt, vector<uint32_t> const &blocks)
+{
+	vector<uint64_t> hashes(document_cnt);
+	for (auto const &bag : bags)
+		if (bag.first > offset && bag.first <= offset + document_cnt)
+			hashes[bag.first - offset - 1] = bag.second;
+
+	if (!blocks.empty())
+		for (size_t i = 0; i < document_cnt; ++i)
+			hashes[i] = MurmurHashCombine(hashes[i], blocks[i]);
+
+	DuplicateClasses classes;
+	classes.representative.resize(document_cnt);
+
+	// Representative of each hash seen so far
+	unordered_map<uint64_t, size_t> first;
+
+	for (size_t id = 1; id <= document_cnt; ++id) {
+		size_t representative = first.emplace(hashes[id - 1], id).first->second;
+		classes.representative[id - 1] = representative;
+
+		if (representative != id) {
+			vector<size_t> &members = classes.members[representative];
+			if (members.empty())
+				members.push_back(representative);
+			members.push_back(id);
+			++classes.duplicate_cnt;
 		}
+	}
+
+	return classes;
+}
+
+/**
+ * Prints the best match for each document: goes through all pairs from best to
+ * worst score and prints those of which neither document has been printed
+ * yet. Sorts scored_pairs in the process. Returns the number of pairs printed.
+ *
+ * With --dedup each pair is one of representatives, and stands for all pairs
+ * of the documents in their classes. Those that are both still unassigned are
+ * paired up from the highest id down, the way the ties between them would be
+ * broken if they had all been scored.
+ */
+size_t print_best_pairs(ostream &out, vector<DocumentPair> &scored_pairs, size_t in_document_cnt, size_t en_document_cnt, DuplicateClasses const &in_classes = DuplicateClasses(), DuplicateClasses const &en_classes = DuplicateClasses())
+{
+	// Sort scores, best on top. Also sort on other properties to make
+	// it a consistent order, c.f. not depending on the processing order.
+	sort(scored_pairs.begin(), scored_pairs.end(), [](DocumentPair const &a, DocumentPair const &b) {
+		if (a.score != b.score)
+			return a.score > b.score;
+
+		if (a.in_idx != b.in_idx)
+			return a.in_idx > b.in_idx;
+
+		return a.en_idx > b.en_idx;
+	});
+
+	// Keep track of which documents have already been assigned
+	vector<bool> in_seen(in_document_cnt);
+	vector<bool> en_seen(en_document_cnt);
+
+	// Also keep a quick tally on whether we've printed scores for
+	// every document, so we don't keep searching while in_seen or
+	// en_seen is completely filled.
+	size_t cnt = 0;
+	size_t document_cnt = min(in_document_cnt, en_document_cnt);
+
+	// For each pair (with score, sorted from good to bad)
+	for (DocumentPair const &pair : scored_pairs) {
+		auto in_class = in_classes.class_of(pair.in_idx);
+		auto en_class = en_classes.class_of(pair.en_idx);
+		size_t in_pos = in_class.second, en_pos = en_class.second;
+
+		while (true) {
+			// If either of the documents has already been printed, skip it.
+			while (in_pos > 0 && in_seen[in_class.first[in_pos - 1] - 1])
+				--in_pos;
+
+			while (en_pos > 0 && en_seen[en_class.first[en_pos - 1] - 1])
+				--en_pos;
+
+			if (in_pos == 0 || en_pos == 0)
+				break;
 
-		if (verbose)
-			cerr << "Read queue performance (Note: blocks when score queue fills up):\n" << read_queue.performance()
-			     << "Score queue performance:\n" << score_queue.performance();
+			size_t in_idx = in_class.first[--in_pos];
+			size_t en_idx = en_class.first[--en_pos];
+
+			print_score(out, pair.score, in_idx, en_idx);
+			in_seen[in_idx - 1] = true;
+			en_seen[en_idx - 1] = true;
+
+			if (++cnt == document_cnt)
+				return cnt;
+		}
 	}
 
-	return 0;
+	return cnt;
+}
+
+/**
+ * Order of the candidates for --top-k: higher score first. Ties are broken on
+ * the document indices so the selection does not depend on the order in which
+ * the threads happened to score the pairs.
+ */
+bool better_pair(DocumentPair const &a, DocumentPair const &b)
+{
+	if (a.score != b.score)
+		return a.score > b.score;
+
+	if (a.in_idx != b.in_idx)
+		return a.in_idx < b.in_idx;
+
+	return a.en_idx < b.en_idx;
+}
+
+/**
+ * Adds pair to a heap of at most k candidates. The worst candidate is on top,
+ * so it is the one that is dropped once a better one comes along.
+ */
+void push_bounded(vector<DocumentPair> &heap, size_t k, DocumentPair const &pair)
+{
+	if (heap.size() < k) {
+		heap.push_back(pair);
+		push_heap(heap.begin(), heap.end(), better_pair);
+	} else if (better_pair(pair, heap.front())) {
+		pop_heap(heap.begin(), heap.end(), better_pair);
+		heap.back() = pair;
+		push_heap(heap.begin(), heap.end(), better_pair);
+	}
+}
+
+/**
+ * Prints the k best translated documents for each English document, ordered
+ * by English document and then from best to worst. scored_pairs may hold more
+ * than k candidates per English document, i.e. one heap per thread or chunk.
+ * Sorts scored_pairs in the process. Returns the number of pairs printed.
+ */
+size_t print_top_pairs(ostream &out, vector<DocumentPair> &scored_pairs, size_t k)
+{
+	sort(scored_pairs.begin(), scored_pairs.end(), [](DocumentPair const &a, DocumentPair const &b) {
+		if (a.en_idx != b.en_idx)
+			return a.en_idx < b.en_idx;
+
+		return better_pair(a, b);
+	});
+
+	size_t cnt = 0;
+
+	for (auto it = scored_pairs.begin(); it != scored_pairs.end();) {
+		auto end = it;
+		while (end != scored_pairs.end() && end->en_idx == it->en_idx)
+			++end;
+
+		for (auto pair = it; pair != end && pair != it + k; ++pair, ++cnt)
+			print_score(out, pair->score, pair->in_idx, pair->en_idx);
+
+		it = end;
+	}
+
+	return cnt;
+}
+
+/**
+ * For --top-k with --dedup: turns the candidates of representatives in
+ * scored_pairs into those of every document in their classes. The K best
+ * classes for an English document hold its K best translated documents, so
+ * those are found among their members. Sorts scored_pairs in the process.
+ */
+vector<DocumentPair> expand_top_pairs(vector<DocumentPair> &scored_pairs, size_t k, DuplicateClasses const &in_classes, DuplicateClasses const &en_classes)
+{
+	sort(scored_pairs.begin(), scored_pairs.end(), [](DocumentPair const &a, DocumentPair const &b) {
+		return a.en_idx < b.en_idx;
+	});
+
+	vector<DocumentPair> expanded;
+	vector<DocumentPair> candidates;
+
+	for (auto it = scored_pairs.begin(); it != scored_pairs.end();) {
+		auto end = it;
+		while (end != scored_pairs.end() && end->en_idx == it->en_idx)
+			++end;
+
+		candidates.clear();
+
+		for (auto pair = it; pair != end; ++pair) {
+			auto in_class = in_classes.class_of(pair->in_idx);
+			for (size_t i = 0; i < in_class.second; ++i)
+				candidates.push_back({pair->score, in_class.first[i], pair->en_idx});
+		}
+
+		sort(candidates.begin(), candidates.end(), better_pair);
+		candidates.resize(min(candidates.size(), k));
+
+		auto en_class = en_classes.class_of(it->en_idx);
+		for (size_t i = 0; i < en_class.second; ++i)
+			for (auto const &candidate : candidates)
+				expanded.push_back({candidate.score, candidate.in_idx, en_class.first[i]});
+
+		it = end;
+	}
+
+	return expanded;
+}
+
+size_t queue_lines(std::string const &path, blocking_queue<unique_ptr<vector<Line>>> &queue, size_t skip_rate = 1)
+{
+	DocumentReader fin(path);
+	return queue_lines(fin, queue, skip_rate);
+}
+
+/**
+ * Runs fun(i) for i in [0, n) on n_threads threads. If fun throws, the other
+ * threads stop early and the first exception is thrown again once they have.
+ */
+template <typename T> void parallel_for(unsigned int n_threads, size_t n, T fun) {
+	atomic<size_t> next(0);
+	exception_ptr error;
+	mutex error_mutex;
+
+	vector<thread> workers(start(n_threads, [&next, &n, &fun, &error, &error_mutex]() {
+		try {
+			for (size_t i = next++; i < n; i = next++)
+				fun(i);
+		} catch (...) {
+			next = n;
+			unique_lock<mutex> lock(error_mutex);
+			if (!error)
+				error = current_exception();
+		}
+	}));
+
+	for (auto &worker : workers)
+		worker.join();
+
+	if (error)
+		rethrow_exception(error);
+}
+
+struct AlignOptions {
+	string in_path;
+	string en_path;
+	unsigned int n_threads;
+	float threshold;
+	size_t df_sample_rate;
+	vector<size_t> ngram_sizes;
+	size_t min_ngram_cnt;
+	size_t max_ngram_cnt;
+	bool print_all;
+	size_t top_k;
+	bool verbose;
+	string stats_path;
+	size_t max_memory;
+	string max_memory_str;
+	string index_side;
+	string engine;
+	bool dedup;
+
+	// Block key of each document, see DocumentBlocks. Either both or none.
+	string in_keys_path;
+	string en_keys_path;
+	bool key_host;
+
+	// Where the scores are printed to
+	ostream *out;
+
+	// Where errors and --verbose output are printed to
+	ostream *err;
+};
+
+/**
+ * What is stored in the state directory of an incremental run: how many
+ * documents of each side have been aligned in how many runs. Run n wrote the
+ * files translated.n, english.n (index segments) and pairs.n (scored pairs).
+ * The DF of all documents seen so far is in df.<runs>.
+ */
+struct IncrementalState {
+	string ngram_sizes;
+	size_t runs;
+	size_t in_document_cnt;
+	size_t en_document_cnt;
+};
+
+bool read_state(string const &path, IncrementalState &state)
+{
+	ifstream fin(path);
+
+	if (!fin)
+		return false;
+
+	string key, value;
+	while (fin >> key >> value) {
+		if (key == "ngram_size")
+			state.ngram_sizes = value;
+		else if (key == "runs")
+			state.runs = stoul(value);
+		else if (key == "translated_documents")
+			state.in_document_cnt = stoul(value);
+		else if (key == "english_documents")
+			state.en_document_cnt = stoul(value);
+	}
+
+	UTIL_THROW_IF(!fin.eof(), util::Exception, "Could not read " << path);
+	return true;
+}
+
+void write_state(string const &path, IncrementalState const &state)
+{
+	// Write to a temporary file and move it into place so the state is never
+	// half-written. Everything else written in this run is only picked up
+	// after this succeeds.
+	{
+		ofstream fout(path + ".tmp");
+		fout << "ngram_size " << state.ngram_sizes << '\n'
+		     << "runs " << state.runs << '\n'
+		     << "translated_documents " << state.in_document_cnt << '\n'
+		     << "english_documents " << state.en_document_cnt << '\n';
+		UTIL_THROW_IF(!fout.flush(), util::Exception, "Could not write " << path << ".tmp");
+	}
+
+	UTIL_THROW_IF(rename((path + ".tmp").c_str(), path.c_str()) != 0, util::ErrnoException, "Could not move " << path << ".tmp into place");
+}
+
+/**
+ * Reads the documents after the first skip lines of path.
+ */
+vector<Document> read_new_documents(string const &path, size_t skip, vector<size_t> const &ngram_sizes, unsigned int n_threads)
+{
+	DocumentReader fin(path);
+	StringPiece line;
+	vector<string> lines;
+
+	UTIL_THROW_IF(fin.Skip(skip) != skip, util::Exception, path << " has fewer documents than the previous run, while documents can only be added");
+
+	while (fin.ReadLineOrEOF(line))
+		lines.emplace_back(line.data(), line.size());
+
+	vector<Document> documents(lines.size());
+
+	parallel_for(n_threads, lines.size(), [&](size_t i) {
+		documents[i].id = skip + i + 1;
+		ReadDocument(lines[i], documents[i], ngram_sizes);
+	});
+
+	return documents;
+}
+
+/**
+ * Size of a pair in a pairs.n file of an incremental run: the score as a
+ * float, then the translated and English document as 64 bit numbers.
+ */
+constexpr size_t PAIR_RECORD_BYTES = sizeof(float) + 2 * sizeof(uint64_t);
+
+void write_pairs(string const &path, vector<DocumentPair> const &pairs)
+{
+	util::scoped_fd fd(util::CreateOrThrow(path.c_str()));
+	util::FileStream out(fd.get());
+
+	for (DocumentPair const &pair : pairs) {
+		uint64_t in_idx = pair.in_idx, en_idx = pair.en_idx;
+		out.write(&pair.score, sizeof(pair.score));
+		out.write(&in_idx, sizeof(in_idx));
+		out.write(&en_idx, sizeof(en_idx));
+	}
+
+	out.flush();
+}
+
+void read_pairs(string const &path, vector<DocumentPair> &pairs)
+{
+	util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+	uint64_t size = util::SizeOrThrow(fd.get());
+
+	UTIL_THROW_IF(size % PAIR_RECORD_BYTES != 0, util::Exception, path << " is not a pairs file");
+
+	vector<char> data(size);
+	util::ReadOrThrow(fd.get(), data.data(), data.size());
+
+	pairs.reserve(pairs.size() + size / PAIR_RECORD_BYTES);
+
+	for (char const *record = data.data(); record != data.data() + data.size(); record += PAIR_RECORD_BYTES) {
+		float score;
+		uint64_t in_idx, en_idx;
+		memcpy(&score, record, sizeof(score));
+		memcpy(&in_idx, record + sizeof(score), sizeof(in_idx));
+		memcpy(&en_idx, record + sizeof(score) + sizeof(in_idx), sizeof(en_idx));
+		pairs.push_back(DocumentPair{score, in_idx, en_idx});
+	}
+}
+
+/**
+ * Adds the ids of the documents in segments that share an ngram with any of
+ * documents to ids.
+ */
+void find_candidates(vector<DocumentRef> const &documents, vector<unique_ptr<IndexSegment>> const &segments, unsigned int n_threads, unordered_set<size_t> &ids)
+{
+	mutex ids_mutex;
+
+	parallel_for(n_threads, documents.size(), [&](size_t i) {
+		vector<size_t> local_ids;
+
+		for (auto const &word_score : documents[i].wordvec) {
+			for (auto const &segment : segments) {
+				auto postings = segment->find(word_score.hash);
+				local_ids.insert(local_ids.end(), postings.first, postings.second);
+			}
+		}
+
+		unique_lock<mutex> lock(ids_mutex);
+		ids.insert(local_ids.begin(), local_ids.end());
+	});
+}
+
+/**
+ * TF/IDF vectors of the documents with these ids in segments, in the order of
+ * ids, with the DF of this run.
+ */
+vector<DocumentRef> read_segment_documents(vector<size_t> const &ids, vector<unique_ptr<IndexSegment>> const &segments, size_t document_cnt, unordered_map<NGram,size_t> const &df, unsigned int n_threads)
+{
+	vector<DocumentRef> documents(ids.size());
+
+	parallel_for(n_threads, ids.size(), [&](size_t i) {
+		for (auto const &segment : segments) {
+			if (segment->contains(ids[i])) {
+				segment->calculate_tfidf(ids[i], documents[i], document_cnt, df);
+				return;
+			}
+		}
+
+		UTIL_THROW(util::Exception, "Document " << ids[i] << " is not in any index segment");
+	});
+
+	return documents;
+}
+
+/**
+ * Incremental alignment. Documents that were not in TRANSLATED-TOKENS and
+ * ENGLISH-TOKENS the last time docalign was run with the same state directory
+ * are new. Only those are read: they update the DF, and are scored against
+ * each other and against the documents of earlier runs they share an ngram
+ * with. Index segments keep the ngram counts of earlier documents, so those
+ * get the TF/IDF vectors they would have in a full run with the new DF. The
+ * new pairs are stored next to those of earlier runs. For the best pairs, the
+ * stored pairs of earlier runs are scored again with the new DF as well, and
+ * the best pairs are selected from all of them.
+ */
+int align_incremental(string const &state_dir, AlignOptions const &options)
+{
+	string ngram_sizes(format_ngram_sizes(options.ngram_sizes));
+	IncrementalState state{ngram_sizes, 0, 0, 0};
+
+	if (read_state(state_dir + "/state", state) && state.ngram_sizes != ngram_sizes) {
+		*options.err << "State in " << state_dir << " was built with ngram size " << state.ngram_sizes << endl;
+		return 1;
+	}
+
+	vector<Document> in_documents(read_new_documents(options.in_path, state.in_document_cnt, options.ngram_sizes, options.n_threads));
+	vector<Document> en_documents(read_new_documents(options.en_path, state.en_document_cnt, options.ngram_sizes, options.n_threads));
+
+	if (options.verbose)
+		*options.err << "Found " << in_documents.size() << " new translated and " << en_documents.size() << " new English documents" << endl;
+
+	// Update the DF with the new documents, and prune it for TF/IDF
+	unordered_map<NGram,size_t> df;
+
+	if (state.runs > 0)
+		ReadDF(state_dir + "/df." + to_string(state.runs), df);
+
+	for (auto const *documents : {&in_documents, &en_documents})
+		for (auto const &document : *documents)
+			for (auto const &entry : document.vocab)
+				df[entry.first] += 1;
+
+	unordered_map<NGram,size_t> pruned_df;
+	for (auto const &entry : df)
+		if (entry.second >= options.min_ngram_cnt && entry.second <= options.max_ngram_cnt)
+			pruned_df.insert(entry);
+
+	size_t document_cnt = state.in_document_cnt + in_documents.size() + state.en_document_cnt + en_documents.size();
+
+	vector<DocumentRef> in_refs(in_documents.size()), en_refs(en_documents.size());
+
+	parallel_for(options.n_threads, in_refs.size(), [&](size_t i) {
+		calculate_tfidf(in_documents[i], in_refs[i], document_cnt, pruned_df);
+	});
+
+	parallel_for(options.n_threads, en_refs.size(), [&](size_t i) {
+		calculate_tfidf(en_documents[i], en_refs[i], document_cnt, pruned_df);
+	});
+
+	// Open the segments of earlier runs. Nothing of those is read until we
+	// look something up.
+	vector<unique_ptr<IndexSegment>> in_segments, en_segments;
+	for (size_t run = 0; run < state.runs; ++run) {
+		in_segments.emplace_back(new IndexSegment(state_dir + "/translated." + to_string(run)));
+		en_segments.emplace_back(new IndexSegment(state_dir + "/english." + to_string(run)));
+	}
+
+	// Pairs of earlier runs, only needed to pick the best pairs
+	vector<DocumentPair> old_pairs;
+
+	if (!options.print_all)
+		for (size_t run = 0; run < state.runs; ++run)
+			read_pairs(state_dir + "/pairs." + to_string(run), old_pairs);
+
+	// Documents of earlier runs that are needed: those that share an ngram
+	// with a new document on the other side, and those in earlier pairs.
+	unordered_set<size_t> old_in_set, old_en_set;
+	find_candidates(en_refs, in_segments, options.n_threads, old_in_set);
+	find_candidates(in_refs, en_segments, options.n_threads, old_en_set);
+
+	for (DocumentPair const &pair : old_pairs) {
+		old_in_set.insert(pair.in_idx);
+		old_en_set.insert(pair.en_idx);
+	}
+
+	vector<size_t> old_in_ids(old_in_set.begin(), old_in_set.end()), old_en_ids(old_en_set.begin(), old_en_set.end());
+	sort(old_in_ids.begin(), old_in_ids.end());
+	sort(old_en_ids.begin(), old_en_ids.end());
+
+	vector<DocumentRef> old_in_refs(read_segment_documents(old_in_ids, in_segments, document_cnt, pruned_df, options.n_threads));
+	vector<DocumentRef> old_en_refs(read_segment_documents(old_en_ids, en_segments, document_cnt, pruned_df, options.n_threads));
+
+	if (options.verbose)
+		*options.err << "Read " << old_in_refs.size() << " translated and " << old_en_refs.size() << " English documents of " << state.runs << " earlier run(s)" << endl;
+
+	// Index the translated documents, as a full run would. The new ones and
+	// those of earlier runs separately, as the English documents of earlier
+	// runs are only scored against the new ones.
+	NGramIndex new_index, old_index;
+
+	for (auto const &ref : in_refs)
+		for (auto const &entry : ref.wordvec)
+			new_index[entry.hash].push_back(DocumentNGramScore{ref.id, entry.tfidf});
+
+	for (auto const &ref : old_in_refs)
+		for (auto const &entry : ref.wordvec)
+			old_index[entry.hash].push_back(DocumentNGramScore{ref.id, entry.tfidf});
+
+	vector<DocumentPair> new_pairs;
+	mutex new_pairs_mutex;
+
+	// New English documents against all translated documents
+	parallel_for(options.n_threads, en_refs.size(), [&](size_t i) {
+		unordered_map<size_t, float> ref_scores;
+		score_document(en_refs[i], new_index, ref_scores);
+		score_document(en_refs[i], old_index, ref_scores);
+
+		unique_lock<mutex> lock(new_pairs_mutex);
+		for (auto const &ref : ref_scores)
+			if (ref.second >= options.threshold)
+				new_pairs.push_back({ref.second, ref.first, en_refs[i].id});
+	});
+
+	// English documents of earlier runs against the new translated documents
+	parallel_for(options.n_threads, old_en_refs.size(), [&](size_t i) {
+		unordered_map<size_t, float> ref_scores;
+		score_document(old_en_refs[i], new_index, ref_scores);
+
+		unique_lock<mutex> lock(new_pairs_mutex);
+		for (auto const &ref : ref_scores)
+			if (ref.second >= options.threshold)
+				new_pairs.push_back({ref.second, ref.first, old_en_refs[i].id});
+	});
+
+	if (options.verbose)
+		*options.err << "Scored " << new_pairs.size() << " new pairs against " << state.runs << " earlier run(s)" << endl;
+
+	// Store this run. The new state is written last, so if anything fails
+	// before that the next run will start from the previous state again.
+	string run = to_string(state.runs);
+
+	WriteIndexSegment(state_dir + "/translated." + run, in_documents);
+	WriteIndexSegment(state_dir + "/english." + run, en_documents);
+	WriteDF(state_dir + "/df." + to_string(state.runs + 1), df);
+	write_pairs(state_dir + "/pairs." + run, new_pairs);
+
+	IncrementalState next_state{ngram_sizes, state.runs + 1, state.in_document_cnt + in_refs.size(), state.en_document_cnt + en_refs.size()};
+	write_state(state_dir + "/state", next_state);
+
+	if (state.runs > 0)
+		remove((state_dir + "/df." + to_string(state.runs)).c_str());
+
+	if (options.print_all) {
+		sort(new_pairs.begin(), new_pairs.end(), [](DocumentPair const &a, DocumentPair const &b) {
+			return a.in_idx != b.in_idx ? a.in_idx < b.in_idx : a.en_idx < b.en_idx;
+		});
+
+		for (auto const &pair : new_pairs)
+			print_score(*options.out, pair.score, pair.in_idx, pair.en_idx);
+
+		return 0;
+	}
+
+	// Score the pairs of earlier runs again with the new DF. Adding up over
+	// the ngrams of the English document gives the same score as a full run.
+	unordered_map<size_t, size_t> old_in_pos, old_en_pos;
+	for (size_t i = 0; i < old_in_ids.size(); ++i)
+		old_in_pos[old_in_ids[i]] = i;
+	for (size_t i = 0; i < old_en_ids.size(); ++i)
+		old_en_pos[old_en_ids[i]] = i;
+
+	vector<unordered_map<NGram, float>> old_in_vectors(old_in_refs.size());
+	parallel_for(options.n_threads, old_in_refs.size(), [&](size_t i) {
+		for (auto const &entry : old_in_refs[i].wordvec)
+			old_in_vectors[i][entry.hash] = entry.tfidf;
+	});
+
+	parallel_for(options.n_threads, old_pairs.size(), [&](size_t i) {
+		unordered_map<NGram, float> const &in_vector = old_in_vectors[old_in_pos[old_pairs[i].in_idx]];
+		float score = 0;
+
+		for (auto const &word_score : old_en_refs[old_en_pos[old_pairs[i].en_idx]].wordvec) {
+			auto it = in_vector.find(word_score.hash);
+			if (it != in_vector.end())
+				score += word_score.tfidf * it->second;
+		}
+
+		old_pairs[i].score = score;
+	});
+
+	// Best match selection over the pairs of all runs that still meet the
+	// threshold.
+	vector<DocumentPair> scored_pairs;
+	swap(scored_pairs, new_pairs);
+
+	for (DocumentPair const &pair : old_pairs)
+		if (pair.score >= options.threshold)
+			scored_pairs.push_back(pair);
+
+	if (options.top_k > 0)
+		print_top_pairs(*options.out, scored_pairs, options.top_k);
+	else
+		print_best_pairs(*options.out, scored_pairs, next_state.in_document_cnt, next_state.en_document_cnt);
+
+	return 0;
+}
+
+/**
+ * Aligns the documents in options.in_path and options.en_path, with ngram
+ * hashes of type NGramT.
+ */
+template <typename NGramT> int align(AlignOptions const &options)
+{
+	unsigned int n_sample_threads = options.n_threads;
+
+	unsigned int n_load_threads = options.n_threads;
+
+	// Note: I've tried many heuristics for the number of reading threads, but
+	// my conclusion was that I either have too few and the scoring threads are
+	// waiting, or the queue is filled and the reading threads are blocking
+	// anyway. On desktop (macOS) just using maximum threads everywhere was
+	// always the fastest.
+	unsigned int n_read_threads = options.n_threads;
+
+	unsigned int n_score_threads = options.n_threads;
+
+	// Statistics per phase, only written out if stats_path is set. Each phase
+	// resets the timer when it is recorded.
+	vector<PhaseStats> phases;
+
+	stopwatch timer;
+	
+	// Calculate the document frequency for terms. Starts a couple of threads
+	// that parse documents and keep a local hash table for counting. At the
+	// end these tables are merged into df.
+	unordered_map<NGramT,size_t> df;
+	size_t in_document_cnt, en_document_cnt, document_cnt;
+
+	// With --dedup, the documents of each side grouped by their ngram bag
+	DuplicateClasses in_classes, en_classes;
+
+	// With block keys, the block of each document
+	DocumentBlocks blocks;
+
+	{
+		mutex df_mutex;
+		atomic<size_t> ngram_cnt(0);
+
+		// With --dedup, the hash of the ngram bag of each document. The
+		// translated documents are numbered after the English ones.
+		vector<pair<size_t, uint64_t>> bags;
+
+		// Full 64 bit hashes of a sample of the ngrams, to measure how many
+		// of them collide once folded into NGramT.
+		bool measure_collisions = options.verbose && !is_same<NGramT, NGram>::value;
+		unordered_set<uint64_t> collision_sample;
+
+		blocking_queue<unique_ptr<vector<Line>>> queue(n_sample_threads * QUEUE_SIZE_PER_THREAD);
+		worker_error workers_error;
+		vector<thread> workers(start(n_sample_threads, queue, workers_error, [&queue, &df, &df_mutex, &ngram_cnt, &options, &measure_collisions, &collision_sample, &bags]() {
+			unordered_map<NGramT, size_t> local_df;
+			unordered_set<uint64_t> local_collision_sample;
+			vector<pair<size_t, uint64_t>> local_bags;
+			size_t local_ngram_cnt = 0;
+
+			while (true) {
+				unique_ptr<vector<Line>> line_batch(queue.pop());
+
+				if (!line_batch)
+					break;
+
+				for (Line const &line : *line_batch) {
+					BasicDocument<NGramT> document;
+					ReadDocument(line.str, document, options.ngram_sizes);
+					for (auto const &entry : document.vocab) {
+						local_df[entry.first] += 1; // Count once every document
+						local_ngram_cnt += entry.second;
+					}
+
+					if (options.dedup)
+						local_bags.emplace_back(line.n, hash_vocab(document));
+
+					if (measure_collisions) {
+						Document wide_document;
+						ReadDocument(line.str, wide_document, options.ngram_sizes);
+						for (auto const &entry : wide_document.vocab)
+							if (fold_ngram<NGramT>(entry.first).hash % COLLISION_SAMPLE_RATE == 0)
+								local_collision_sample.insert(entry.first.hash);
+					}
+				}
+			}
+
+			ngram_cnt += local_ngram_cnt;
+
+			// Merge the local DF into the global one. Multiply by df_sample_rate
+			// to compensate for reading only nth part of the whole collection.
+			{
+				unique_lock<mutex> lock(df_mutex);
+				for (auto const &entry : local_df)
+					df[entry.first] += entry.second * options.df_sample_rate;
+
+				collision_sample.insert(local_collision_sample.begin(), local_collision_sample.end());
+				bags.insert(bags.end(), local_bags.begin(), local_bags.end());
+			}
+		}));
+
+		// We'll use in_document_cnt later to reserve some space for the documents
+		// we want to keep in memory. (Also this line is the whole reason the
+		// worker management + reading isn't wrapped in a single function: I
+		// want to re-use the same workers for two files.)
+		DocumentReader en_file(options.en_path);
+		en_document_cnt = queue_lines(en_file, queue, options.df_sample_rate);
+
+		DocumentReader in_file(options.in_path);
+		in_document_cnt = queue_lines(in_file, queue, options.df_sample_rate, en_document_cnt);
+
+		document_cnt = in_document_cnt + en_document_cnt;
+
+		stop(queue, workers);
+		workers_error.rethrow();
+
+		if (options.verbose)
+			*options.err << "Calculated DF from " << document_cnt / options.df_sample_rate << " documents" << endl;
+
+		if (!options.in_keys_path.empty()) {
+			blocks = read_blocks(options.in_keys_path, options.en_keys_path, options.key_host);
+
+			if (blocks.in_blocks.size() != in_document_cnt || blocks.en_blocks.size() != en_document_cnt) {
+				*options.err << "Expected a block key for each of the " << in_document_cnt << " translated and "
+				     << en_document_cnt << " English documents, but found " << blocks.in_blocks.size()
+				     << " and " << blocks.en_blocks.size() << endl;
+				return 1;
+			}
+
+			if (options.verbose)
+				*options.err << "Found " << blocks.shared.size() << " blocks, " << count(blocks.shared.begin(), blocks.shared.end(), true)
+				     << " of which have documents on both sides" << endl;
+		}
+
+		if (options.dedup) {
+			en_classes = group_duplicates(bags, 0, en_document_cnt, blocks.en_blocks);
+			in_classes = group_duplicates(bags, en_document_cnt, in_document_cnt, blocks.in_blocks);
+
+			if (options.verbose)
+				*options.err << "Found " << in_classes.duplicate_cnt << " duplicate translated and "
+				     << en_classes.duplicate_cnt << " duplicate English documents" << endl;
+		}
+
+		if (measure_collisions) {
+			unordered_set<typename NGramT::hash_type> folded;
+			for (uint64_t hash : collision_sample)
+				folded.insert(fold_ngram<NGramT>(NGram{hash}).hash);
+
+			*options.err << "Measured hash collisions in " << sizeof(typename NGramT::hash_type) * 8 << " bits: "
+			     << collision_sample.size() - folded.size() << " of " << collision_sample.size() << " sampled ngrams ("
+			     << (collision_sample.empty() ? 0 : 100.0 * (collision_sample.size() - folded.size()) / collision_sample.size()) << "%)" << endl;
+		}
+
+		if (options.verbose)
+			*options.err << "DF queue performance:\n" << queue.performance();
+
+		PhaseStats &phase = record_phase(phases, "df", timer);
+		phase.documents = document_cnt / options.df_sample_rate;
+		phase.ngrams = ngram_cnt;
+		phase.counts.emplace_back("df_size", df.size());
+		phase.queues.emplace_back("df", queue.performance());
+
+		if (!blocks.empty())
+			phase.counts.emplace_back("blocks", blocks.shared.size());
+
+		if (options.dedup) {
+			phase.counts.emplace_back("duplicate_translated_documents", in_classes.duplicate_cnt);
+			phase.counts.emplace_back("duplicate_english_documents", en_classes.duplicate_cnt);
+		}
+	}
+
+	// Prune the DF table, similar to what the Python implementation does. Note
+	// that these counts are linked to sample-rate already, so if you have a
+	// sample rate of higher than 1, your min_ngram_count should also be a
+	// multiple of sample rate + 1.
+	size_t postings_cnt = 0;
+
+	{
+		unordered_map<NGramT, size_t> pruned_df;
+		for (auto const &entry : df) {
+			if (entry.second < options.min_ngram_cnt)
+				continue;
+
+			if (entry.second > options.max_ngram_cnt)
+				continue;
+
+			pruned_df[entry.first] = entry.second;
+
+			// Each document an ngram occurs in will be a posting in the index
+			postings_cnt += entry.second;
+		}
+
+		if (options.verbose)
+			*options.err << "Pruned " << df.size() - pruned_df.size() << " (" << 100.0 - 100.0 * pruned_df.size() / df.size() << "%) entries from DF" << endl;
+
+		PhaseStats &phase = record_phase(phases, "prune", timer);
+		phase.counts.emplace_back("df_size_before", df.size());
+		phase.counts.emplace_back("df_size_after", pruned_df.size());
+
+		swap(df, pruned_df);
+	}
+
+	// Index the translated documents, or with --index the side asked for, and
+	// stream the other one past it. The pairs are always reported as
+	// (translated, english).
+	bool index_english = options.index_side == "english" || (options.index_side == "auto" && en_document_cnt < in_document_cnt);
+
+	string index_path = index_english ? options.en_path : options.in_path;
+	string query_path = index_english ? options.in_path : options.en_path;
+	size_t index_document_cnt = index_english ? en_document_cnt : in_document_cnt;
+
+	DuplicateClasses const &index_classes = index_english ? en_classes : in_classes;
+	DuplicateClasses const &query_classes = index_english ? in_classes : en_classes;
+
+	vector<uint32_t> const &index_blocks = index_english ? blocks.en_blocks : blocks.in_blocks;
+	vector<uint32_t> const &query_blocks = index_english ? blocks.in_blocks : blocks.en_blocks;
+
+	if (options.verbose)
+		*options.err << "Indexing the " << (index_english ? "English" : "translated") << " documents" << endl;
+
+	// Number of documents to index at once. Without a memory limit that is all
+	// of them. Otherwise estimate the size of the index: every document an
+	// ngram in the pruned DF occurs in is a posting, and the indexed documents
+	// are index_document_cnt out of document_cnt of those.
+	size_t chunk_size = max<size_t>(index_document_cnt, 1);
+
+	if (options.max_memory > 0 && document_cnt > 0) {
+		size_t index_postings_cnt = double(postings_cnt) * index_document_cnt / document_cnt;
+		size_t fixed_bytes = df.size() * (DF_ENTRY_BYTES + INDEX_KEY_BYTES);
+
+		if (fixed_bytes >= options.max_memory) {
+			*options.err << "The DF table alone will need about " << fixed_bytes / (1 << 20) << "MB, which is more than --max-memory "
+			     << options.max_memory_str << ". Try a higher --df-sample-rate or --min_count." << endl;
+			return 1;
+		}
+
+		size_t chunk_postings_cnt = max<size_t>((options.max_memory - fixed_bytes) / POSTING_BYTES, 1);
+		size_t chunk_cnt = (index_postings_cnt + chunk_postings_cnt - 1) / chunk_postings_cnt;
+
+		if (chunk_cnt > 1)
+			chunk_size = (index_document_cnt + chunk_cnt - 1) / chunk_cnt;
+
+		if (options.verbose)
+			*options.err << "Estimated index size is " << (index_postings_cnt * POSTING_BYTES + fixed_bytes) / (1 << 20) << "MB, "
+			     << "indexing documents in " << chunk_cnt << " chunk(s) of " << chunk_size << endl;
+	}
+
+	// The spgemm engine numbers the documents in a chunk with 32 bits
+	if (options.engine == "spgemm")
+		chunk_size = min<size_t>(chunk_size, numeric_limits<uint32_t>::max());
+
+	// Function used to report the score. Implementation depends on whether
+	// we are doing print_all or not. Mutex is necessary for both cases,
+	// either for writing to scored_pairs or for printing to stdout. With
+	// --top-k the scorers only report the candidates that made their heaps.
+	function<void (float, size_t in_ref, size_t en_ref)> mark_score;
+	mutex mark_score_mutex;
+
+	// Scores for all pairs (that meet the threshold). Only used without --all.
+	vector<DocumentPair> scored_pairs;
+
+	if (!options.print_all) {
+		mark_score = [&scored_pairs, &mark_score_mutex] (float score, size_t in_ref, size_t en_ref) {
+			unique_lock<mutex> lock(mark_score_mutex);
+			scored_pairs.push_back({score, in_ref, en_ref});
+		};
+	} else {
+		mark_score = [&mark_score_mutex, &options, &in_classes, &en_classes](float score, size_t in_ref, size_t en_ref) {
+			unique_lock<mutex> lock(mark_score_mutex);
+
+			// With --dedup, the score of every pair of their duplicates
+			auto in_class = in_classes.class_of(in_ref);
+			auto en_class = en_classes.class_of(en_ref);
+
+			for (size_t i = 0; i < in_class.second; ++i)
+				for (size_t j = 0; j < en_class.second; ++j)
+					print_score(*options.out, score, in_class.first[i], en_class.first[j]);
+		};
+	}
+
+	DocumentReader index_file(index_path);
+
+	// For each chunk of documents on the index side: build an index for it,
+	// and then read all documents of the other side and score them against it.
+	for (size_t chunk_offset = 0; chunk_offset < index_document_cnt; chunk_offset += chunk_size) {
+		size_t chunk_document_cnt = min(chunk_size, index_document_cnt - chunk_offset);
+
+		// Read documents & pre-calculate TF/DF for each of these documents
+		BasicNGramIndex<NGramT> ref_index;
+
+		// The same for the spgemm engine: the documents as a matrix with a row
+		// for each ngram and a column for each document in this chunk.
+		unordered_map<NGramT, uint32_t> index_rows;
+		CSRMatrix index_matrix;
+
+		{
+			mutex ref_index_mutex;
+			atomic<size_t> ngram_cnt(0);
+
+			// Only used by the spgemm engine, with the documents by their
+			// position in this chunk.
+			vector<BasicDocumentRef<NGramT>> index_documents(options.engine == "spgemm" ? chunk_document_cnt : 0);
+
+			blocking_queue<unique_ptr<vector<Line>>> queue(n_load_threads * QUEUE_SIZE_PER_THREAD);
+			worker_error workers_error;
+			vector<thread> workers(start(n_load_threads, queue, workers_error, [&queue, &ref_index, &ref_index_mutex, &index_documents, &chunk_offset, &ngram_cnt, &df, &document_cnt, &index_classes, &index_blocks, &blocks, &options]() {
+				BasicNGramIndex<NGramT> local_ref_index;
+				size_t local_ngram_cnt = 0;
+
+				while (true) {
+					unique_ptr<vector<Line>> line_batch(queue.pop());
+
+					if (!line_batch)
+						break;
+
+					for (Line const &line : *line_batch) {
+						// Duplicates are scored through their representative, and
+						// there is nothing to score in a block of just this side.
+						if (!index_classes.is_representative(line.n) || (!blocks.empty() && !blocks.shared[index_blocks[line.n - 1]]))
+							continue;
+
+						BasicDocument<NGramT> doc{.id = line.n, .vocab = {}};
+						ReadDocument(line.str, doc, options.ngram_sizes);
+						local_ngram_cnt += count_ngrams(doc);
+
+						// Note that each worker writes to a different line in the refs
+						// vector and the vector has been initialized with enough lines
+						// so there should be no concurrency issue.
+						// DF is accessed read-only. N starts counting at 1.
+						BasicDocumentRef<NGramT> ref;
+						calculate_tfidf(doc, ref, document_cnt, df);
+
+						if (!blocks.empty())
+							move_to_block(ref, index_blocks[line.n - 1]);
+
+						if (options.engine == "spgemm") {
+							swap(index_documents[line.n - chunk_offset - 1], ref);
+							continue;
+						}
+
+						for (auto const &entry : ref.wordvec) {
+							local_ref_index[entry.hash].push_back(DocumentNGramScore{
+								.doc_id = line.n,
+								.tfidf = entry.tfidf
+							});
+						}
+					}
+				}
+
+				ngram_cnt += local_ngram_cnt;
+
+				{
+					// Merge the local index we built into the global one
+					unique_lock<mutex> lock(ref_index_mutex);
+					for (auto &entry : local_ref_index) {
+						auto &dest = ref_index[entry.first];
+
+						// Minor optimisation: copy the fewest elements possible
+						if (dest.size() < entry.second.size())
+							swap(dest, entry.second);
+
+						dest.reserve(dest.size() + entry.second.size());
+					
+						move(entry.second.begin(), entry.second.end(), back_inserter(dest));
+
+						// Free memory as we go, the local index is no longer needed
+						vector<DocumentNGramScore>().swap(entry.second);
+					}
+				}
+			}));
+
+			size_t refs_cnt = queue_lines(index_file, queue, 1, chunk_offset, chunk_size);
+
+			stop(queue, workers);
+			workers_error.rethrow();
+
+			if (options.verbose)
+				*options.err << "Read " << refs_cnt << " documents into memory"
+				     << (chunk_size < index_document_cnt ? " (chunk " + to_string(chunk_offset / chunk_size + 1) + ")" : "") << endl;
+
+			if (options.verbose)
+				*options.err << "Load queue performance:\n" << queue.performance();
+
+			size_t index_postings_cnt = 0;
+			for (auto const &entry : ref_index)
+				index_postings_cnt += entry.second.size();
+
+			if (options.engine == "spgemm") {
+				build_index_matrix(index_documents, index_rows, index_matrix);
+				index_postings_cnt = index_matrix.col.size();
+			}
+
+			PhaseStats &phase = record_phase(phases, "load", timer);
+			phase.documents = refs_cnt;
+			phase.ngrams = ngram_cnt;
+			phase.counts.emplace_back("index_size", max(ref_index.size(), index_rows.size()));
+			phase.counts.emplace_back("postings", index_postings_cnt);
+			phase.counts.emplace_back("chunk_offset", chunk_offset);
+			phase.queues.emplace_back("load", queue.performance());
+		}
+
+		// Start reading the other set of documents we match against and do the matching.
+		{
+			blocking_queue<unique_ptr<vector<Line>>> read_queue(n_read_threads * QUEUE_SIZE_PER_THREAD);
+
+			blocking_queue<unique_ptr<vector<BasicDocumentRef<NGramT>>>> score_queue(n_score_threads * QUEUE_SIZE_PER_THREAD);
+
+			atomic<size_t> ngram_cnt(0), candidate_cnt(0), above_threshold_cnt(0);
+
+			worker_error workers_error;
+			vector<thread> read_workers(start(n_read_threads, read_queue, workers_error, [&read_queue, &score_queue, &ngram_cnt, &document_cnt, &df, &query_classes, &query_blocks, &blocks, &options]() {
+				size_t local_ngram_cnt = 0;
+
+				while (true) {
+					unique_ptr<vector<Line>> line_batch(read_queue.pop());
+
+					// Empty pointer is poison
+					if (!line_batch)
+						break;
+
+					unique_ptr<vector<BasicDocumentRef<NGramT>>> ref_batch(new vector<BasicDocumentRef<NGramT>>());
+					ref_batch->reserve(line_batch->size());
+			
+					for (Line const &line : *line_batch) {
+						if (!query_classes.is_representative(line.n) || (!blocks.empty() && !blocks.shared[query_blocks[line.n - 1]]))
+							continue;
+
+						BasicDocument<NGramT> doc{.id = line.n, .vocab = {}};
+						ReadDocument(line.str, doc, options.ngram_sizes);
+						local_ngram_cnt += count_ngrams(doc);
+
+						ref_batch->emplace_back();
+						calculate_tfidf(doc, ref_batch->back(), document_cnt, df);
+
+						if (!blocks.empty())
+							move_to_block(ref_batch->back(), query_blocks[line.n - 1]);
+					}
+
+					score_queue.push(move(ref_batch));
+				}
+
+				ngram_cnt += local_ngram_cnt;
+			}));
+
+			vector<thread> score_workers(start(n_score_threads, score_queue, workers_error, [&score_queue, &ref_index, &index_rows, &index_matrix, &chunk_offset, &chunk_document_cnt, &options, &mark_score, &candidate_cnt, &above_threshold_cnt, &index_english, &blocks]() {
+				size_t local_candidate_cnt = 0;
+				size_t local_above_threshold_cnt = 0;
+
+				// For --top-k: the best candidates for the English document being
+				// scored, or if the English documents are the indexed ones, a heap
+				// for every English document this thread has seen a candidate for.
+				vector<DocumentPair> query_heap;
+				unordered_map<size_t, vector<DocumentPair>> en_heaps;
+
+				// Reports the score of a document against an indexed one that met
+				// the threshold. With --top-k only to the heaps.
+				auto report = [&](float score, size_t query_id, size_t index_id) {
+					DocumentPair pair{score, index_english ? query_id : index_id, index_english ? index_id : query_id};
+
+					// Only if their ngrams matched because the hashes with the
+					// blocks mixed in happened to be the same.
+					if (!blocks.empty() && blocks.in_blocks[pair.in_idx - 1] != blocks.en_blocks[pair.en_idx - 1])
+						return;
+
+					if (options.top_k == 0)
+						mark_score(pair.score, pair.in_idx, pair.en_idx);
+					else if (index_english)
+						push_bounded(en_heaps[pair.en_idx], options.top_k, pair);
+					else
+						push_bounded(query_heap, options.top_k, pair);
+
+					++local_above_threshold_cnt;
+				};
+
+				// Called once all scores of a document have been reported
+				auto end_query = [&]() {
+					for (auto const &pair : query_heap)
+						mark_score(pair.score, pair.in_idx, pair.en_idx);
+
+					query_heap.clear();
+				};
+
+				// For the spgemm engine: the batch as a block of rows of the query
+				// matrix, and a sum for each document in the index.
+				CSRMatrix query_matrix;
+				unique_ptr<DenseAccumulator> acc(options.engine == "spgemm" ? new DenseAccumulator(chunk_document_cnt) : nullptr);
+
+				while (true) {
+					unique_ptr<vector<BasicDocumentRef<NGramT>>> doc_ref_batch(score_queue.pop());
+
+					if (!doc_ref_batch)
+						break;
+
+					if (options.engine == "spgemm") {
+						query_matrix.clear();
+
+						for (auto const &doc_ref : *doc_ref_batch) {
+							for (auto const &word_score : doc_ref.wordvec) {
+								auto it = index_rows.find(word_score.hash);
+
+								if (it != index_rows.end())
+									query_matrix.push_back(it->second, word_score.tfidf);
+							}
+
+							query_matrix.end_row();
+						}
+
+						local_candidate_cnt += MultiplyRows(query_matrix, index_matrix, options.threshold, *acc,
+							[&](size_t row, uint32_t column, float score) {
+								report(score, (*doc_ref_batch)[row].id, chunk_offset + column + 1);
+							},
+							[&](size_t) {
+								end_query();
+							});
+
+						continue;
+					}
+
+					for (auto &doc_ref : *doc_ref_batch) {
+						unordered_map<size_t, float> ref_scores;
+						score_document(doc_ref, ref_index, ref_scores);
+
+						local_candidate_cnt += ref_scores.size();
+
+						for (auto const &ref : ref_scores)
+							if (ref.second >= options.threshold)
+								report(ref.second, doc_ref.id, ref.first);
+
+						end_query();
+					}
+				}
+
+				for (auto const &entry : en_heaps)
+					for (auto const &pair : entry.second)
+						mark_score(pair.score, pair.in_idx, pair.en_idx);
+
+				candidate_cnt += local_candidate_cnt;
+				above_threshold_cnt += local_above_threshold_cnt;
+			}));
+
+			size_t query_cnt = queue_lines(query_path, read_queue);
+
+			// Tell all workers there is nothing left and wait for them to stop.
+			stop(read_queue, read_workers);
+			stop(score_queue, score_workers);
+			workers_error.rethrow();
+
+			{
+				PhaseStats &phase = record_phase(phases, "score", timer);
+				phase.documents = query_cnt;
+				phase.ngrams = ngram_cnt;
+				phase.counts.emplace_back("candidate_pairs", candidate_cnt);
+				phase.counts.emplace_back("pairs_above_threshold", above_threshold_cnt);
+				phase.queues.emplace_back("read", read_queue.performance());
+				phase.queues.emplace_back("score", score_queue.performance());
+				phase.counts.emplace_back("chunk_offset", chunk_offset);
+			}
+
+			if (options.verbose)
+				*options.err << "Read queue performance (Note: blocks when score queue fills up):\n" << read_queue.performance()
+				     << "Score queue performance:\n" << score_queue.performance();
+		}
+	}
+
+	// Pick the best pairs across all chunks
+	if (options.top_k > 0) {
+		if (options.dedup)
+			scored_pairs = expand_top_pairs(scored_pairs, options.top_k, in_classes, en_classes);
+
+		size_t cnt = print_top_pairs(*options.out, scored_pairs, options.top_k);
+
+		PhaseStats &phase = record_phase(phases, "top_k", timer);
+		phase.documents = cnt;
+		phase.counts.emplace_back("pairs_sorted", scored_pairs.size());
+	} else if (!options.print_all) {
+		size_t cnt = print_best_pairs(*options.out, scored_pairs, in_document_cnt, en_document_cnt, in_classes, en_classes);
+
+		PhaseStats &phase = record_phase(phases, "best", timer);
+		phase.documents = cnt;
+		phase.counts.emplace_back("pairs_sorted", scored_pairs.size());
+	}
+
+	if (!options.stats_path.empty()) {
+		ofstream stats_out(options.stats_path);
+		write_json(stats_out, phases);
+
+		if (!stats_out) {
+			*options.err << "Could not write statistics to " << options.stats_path << endl;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+struct ManifestJob {
+	string in_path;
+	string en_path;
+	string out_path;
+	size_t size;
+};
+
+/**
+ * Reads a manifest: on each line the paths of the translated documents, the
+ * English documents and the output file, separated by whitespace. Empty
+ * lines are skipped.
+ */
+vector<ManifestJob> read_manifest(string const &path)
+{
+	ifstream fin(path);
+	UTIL_THROW_IF(!fin, util::ErrnoException, "Could not open manifest " << path);
+
+	vector<ManifestJob> jobs;
+	string line;
+
+	for (size_t line_no = 1; getline(fin, line); ++line_no) {
+		istringstream fields(line);
+		ManifestJob job{"", "", "", 0};
+		string rest;
+
+		if (!(fields >> job.in_path))
+			continue;
+
+		UTIL_THROW_IF(!(fields >> job.en_path >> job.out_path) || (fields >> rest), util::Exception,
+			path << ":" << line_no << ": expected TRANSLATED-TOKENS ENGLISH-TOKENS OUTPUT");
+
+		util::scoped_fd in_fd(util::OpenReadOrThrow(job.in_path.c_str()));
+		util::scoped_fd en_fd(util::OpenReadOrThrow(job.en_path.c_str()));
+		job.size = util::SizeOrThrow(in_fd.get()) + util::SizeOrThrow(en_fd.get());
+
+		jobs.push_back(job);
+	}
+
+	return jobs;
+}
+
+/**
+ * Runs all jobs in the manifest in this process. Jobs that are more than
+ * their share of the total input size are run one after the other with all
+ * threads. The rest, typically many tiny ones, are run side by side with a
+ * thread each, biggest first, so all cores stay busy until the end.
+ */
+int align_manifest(string const &manifest_path, AlignOptions const &defaults, int (*align_fn)(AlignOptions const &))
+{
+	vector<ManifestJob> jobs(read_manifest(manifest_path));
+
+	size_t total_size = 0;
+	for (auto const &job : jobs)
+		total_size += job.size;
+
+	stable_sort(jobs.begin(), jobs.end(), [](ManifestJob const &a, ManifestJob const &b) {
+		return a.size > b.size;
+	});
+
+	atomic<size_t> failed_cnt(0);
+	mutex err_mutex;
+
+	auto run_job = [&defaults, &align_fn, &failed_cnt, &err_mutex](ManifestJob const &job, unsigned int n_threads) {
+		ofstream fout(job.out_path);
+		ostringstream err;
+		AlignOptions options(defaults);
+		options.in_path = job.in_path;
+		options.en_path = job.en_path;
+		options.n_threads = n_threads;
+		options.out = &fout;
+		options.err = &err;
+
+		try {
+			if (!fout || align_fn(options) != 0 || !fout.flush()) {
+				err << "Failed to align " << job.in_path << " and " << job.en_path << " into " << job.out_path << endl;
+				++failed_cnt;
+			}
+		} catch (std::exception const &e) {
+			// Not only util::Exception: anything that escapes would end the
+			// other jobs in parallel_for as well.
+			err << job.in_path << ": " << e.what() << endl;
+			++failed_cnt;
+		} catch (...) {
+			err << "Failed to align " << job.in_path << " and " << job.en_path << " into " << job.out_path << endl;
+			++failed_cnt;
+		}
+
+		// Jobs run side by side, so only print their messages once done
+		unique_lock<mutex> lock(err_mutex);
+		*defaults.err << err.str() << flush;
+	};
+
+	size_t large_cnt = 0;
+	while (large_cnt < jobs.size() && jobs[large_cnt].size * defaults.n_threads > total_size)
+		run_job(jobs[large_cnt++], defaults.n_threads);
+
+	parallel_for(defaults.n_threads, jobs.size() - large_cnt, [&](size_t i) {
+		run_job(jobs[large_cnt + i], 1);
+	});
+
+	if (defaults.verbose)
+		*defaults.err << "Aligned " << jobs.size() - failed_cnt << " of " << jobs.size() << " jobs, "
+		     << large_cnt << " of which with all threads" << endl;
+
+	return failed_cnt > 0 ? 1 : 0;
+}
+
+int run(vector<string> const &args, ostream &out, ostream &err, bool job = false);
+
+/**
+ * Temporary files that are removed when this goes out of scope.
+ */
+struct TempFiles {
+	vector<string> paths;
+
+	~TempFiles() {
+		for (string const &path : paths)
+			unlink(path.c_str());
+	}
+
+	// Creates a file with contents in TMPDIR and returns its path
+	string const &create(string const &contents) {
+		char const *tmpdir = getenv("TMPDIR");
+		string path(string(tmpdir ? tmpdir : "/tmp") + "/docalign-XXXXXX");
+
+		util::scoped_fd fd(mkstemp(&path[0]));
+		UTIL_THROW_IF(fd.get() == -1, util::ErrnoException, "Could not create temporary file " << path);
+		paths.push_back(path);
+
+		util::WriteOrThrow(fd.get(), contents.data(), contents.size());
+		return paths.back();
+	}
+};
+
+/**
+ * A request to the service. The client sends one item per line, ending the
+ * request with an empty line:
+ *
+ *   arg ARGUMENT         a docalign command line argument
+ *   translated DOCUMENT  a base64 encoded translated document
+ *   english DOCUMENT     a base64 encoded English document
+ *
+ * Inline documents take the place of TRANSLATED-TOKENS and ENGLISH-TOKENS.
+ * Only the options that do not touch files other than the input can be used,
+ * see run(). The service replies with the output of docalign as it is
+ * printed, then any errors and --verbose output as lines starting with
+ * "#stderr ", and finally "#exit CODE" with what would have been the exit code
+ * of docalign. If the job dies, the connection closes without "#exit".
+ */
+int serve_connection(int fd)
+{
+	util::scoped_fd connection(fd);
+	LineReader reader(connection.get());
+
+	vector<string> args;
+	string inline_documents[2];
+	size_t inline_cnt[2] = {0, 0};
+
+	FDStreamBuf out_buf(connection.get());
+	ostream out(&out_buf);
+	ostringstream err;
+	int code = 1;
+
+	try {
+		string line;
+		while (reader.ReadLine(line) && !line.empty()) {
+			size_t space = line.find(' ');
+			string kind(line.substr(0, space));
+			string value(space == string::npos ? "" : line.substr(space + 1));
+
+			if (kind == "arg") {
+				args.push_back(value);
+			} else if (kind == "translated" || kind == "english") {
+				size_t side = kind == "translated" ? 0 : 1;
+				inline_documents[side].append(value).push_back('\n');
+				++inline_cnt[side];
+			} else {
+				UTIL_THROW(util::Exception, "Unknown request line: " << kind);
+			}
+		}
+
+		// Inline documents are written to temporary files so the job can read
+		// them as often as it needs, the same as any other input.
+		TempFiles temp_files;
+
+		if (inline_cnt[0] > 0 || inline_cnt[1] > 0)
+			for (string const &documents : inline_documents)
+				args.push_back(temp_files.create(documents));
+
+		code = run(args, out, err, true);
+	} catch (std::exception const &e) {
+		err << e.what() << '\n';
+		code = 1;
+	}
+
+	istringstream err_lines(err.str());
+	for (string line; getline(err_lines, line);)
+		out << "#stderr " << line << '\n';
+
+	out << "#exit " << code << '\n' << flush;
+	return code;
+}
+
+/**
+ * Runs docalign as a service on a Unix socket. Every connection is a job that
+ * runs in a child process of its own, see serve_connection() for the
+ * protocol. Whatever happens to a job, i.e. an exception in one of its
+ * threads, only takes that job down. At most max_jobs run at once, further
+ * connections wait until one has finished.
+ */
+int serve(string const &path, size_t max_jobs)
+{
+	// A client that disconnects early should not take the service down
+	signal(SIGPIPE, SIG_IGN);
+
+	util::scoped_fd listen_fd;
+
+	try {
+		listen_fd.reset(ListenUnixSocket(path));
+	} catch (util::Exception const &e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	cerr << "Listening on " << path << endl;
+
+	size_t running_cnt = 0;
+
+	while (true) {
+		// Clean up jobs that have finished, waiting for one if all slots are
+		// taken.
+		while (running_cnt > 0) {
+			int status;
+			pid_t pid = waitpid(-1, &status, running_cnt >= max_jobs ? 0 : WNOHANG);
+
+			if (pid == 0)
+				break;
+
+			if (pid == -1) {
+				if (errno == EINTR)
+					continue;
+
+				cerr << "Could not wait for job: " << strerror(errno) << endl;
+				return 1;
+			}
+
+			--running_cnt;
+
+			if (WIFSIGNALED(status))
+				cerr << "Job " << pid << " was killed by signal " << WTERMSIG(status) << endl;
+		}
+
+		int fd = accept(listen_fd.get(), nullptr, nullptr);
+
+		if (fd == -1) {
+			if (errno == EINTR)
+				continue;
+
+			cerr << "Could not accept connection: " << strerror(errno) << endl;
+			return 1;
+		}
+
+		util::scoped_fd connection(fd);
+
+		pid_t pid = fork();
+
+		if (pid == -1) {
+			cerr << "Could not start job: " << strerror(errno) << endl;
+			continue;
+		}
+
+		if (pid == 0) {
+			listen_fd.reset();
+			_exit(serve_connection(connection.release()));
+		}
+
+		++running_cnt;
+	}
+}
+
+/**
+ * Runs docalign with the command line arguments args (without the program
+ * name), printing output to out and errors to err. Used for the command line
+ * and, with job set, for each job submitted to --listen. Jobs can only use the
+ * options that read nothing but the input and write nothing but the output.
+ */
+int run(vector<string> const &args, ostream &out, ostream &err, bool job)
+{
+	unsigned int n_threads = thread::hardware_concurrency();
+	
+	float threshold = 0.1;
+	
+	size_t df_sample_rate = 1;
+	
+	string ngram_size_str = "2";
+
+	vector<size_t> ngram_sizes;
+
+	size_t min_ngram_cnt = 2;
+
+	size_t max_ngram_cnt = 1000;
+
+	bool verbose = false;
+
+	bool print_all = false;
+
+	size_t top_k = 0;
+
+	string stats_path;
+
+	string max_memory_str;
+
+	string incremental_dir;
+
+	string manifest_path;
+
+	string listen_path;
+
+	string index_side = "translated";
+
+	string engine = "hash";
+
+	unsigned int hash_bits = 64;
+
+	bool dedup = false;
+
+	string in_keys_path;
+
+	string en_keys_path;
+
+	string key_type = "host";
+
+	size_t max_jobs = 4;
+	
+	po::positional_options_description arg_desc;
+	arg_desc.add("translated-tokens", 1);
+	arg_desc.add("english-tokens", 1);
+	
+	po::options_description generic_desc("Additional options");
+	generic_desc.add_options()
+		("help", "produce help message")
+		("df-sample-rate", po::value<size_t>(&df_sample_rate), "set sample rate to every n-th document (default: 1)")
+		("ngram_size,n", po::value<string>(&ngram_size_str), "ngram size, or a comma separated list of sizes to use them all at once, i.e. 1,2,3 (default: 2)")
+		("jobs,j", po::value<unsigned int>(&n_threads), "set number of threads (default: all)")
+		("threshold", po::value<float>(&threshold), "set score threshold (default: 0.1)")
+		("min_count", po::value<size_t>(&min_ngram_cnt), "minimal number of documents an ngram can appear in to be included in DF (default: 2)")
+		("max_count", po::value<size_t>(&max_ngram_cnt), "maximum number of documents for ngram to to appear in (default: 1000)")
+		("all", po::bool_switch(&print_all), "print all scores, not only the best pairs")
+		("top-k", po::value<size_t>(&top_k), "print the K best scoring translated documents for each English document, instead of only the best pairs")
+		("max-memory", po::value<string>(&max_memory_str), "memory budget for DF and index, e.g. 8G. If the index would not fit, the documents of the indexed side are indexed in chunks (default: unlimited)")
+		("index", po::value<string>(&index_side), "which documents to keep in memory: translated, english or auto for the side with the fewest documents. Scores may differ in the last digit between sides (default: translated)")
+		("engine", po::value<string>(&engine), "how to score: hash to sum scores per document in a hash table, or spgemm to multiply both sides as sparse matrices (default: hash)")
+		("hash-bits", po::value<unsigned int>(&hash_bits), "size of the ngram hashes, 32 or 64. 32 bits uses less memory but more ngrams share a hash (default: 64)")
+		("dedup", po::bool_switch(&dedup), "score only one of the documents with the same ngrams on each side, and match its duplicates with those of the other document")
+		("verbose,v", po::bool_switch(&verbose), "show additional output");
+
+	// Options that read or write other files, or change how docalign runs.
+	// These are not available to jobs of --listen.
+	if (!job) {
+		generic_desc.add_options()
+			("stats-json", po::value<string>(&stats_path), "write time, throughput and memory usage per phase to this file")
+			("translated-keys", po::value<string>(&in_keys_path), "file with a block key, e.g. the URL, for each translated document. Only documents with the same key are scored against each other. Requires --english-keys")
+			("english-keys", po::value<string>(&en_keys_path), "the same for the English documents")
+			("key", po::value<string>(&key_type), "what the block key is: host for the host of the URL on each line of the key files, or line for the whole line (default: host)")
+			("incremental", po::value<string>(&incremental_dir), "keep DF, index and scores in this directory and only align documents added since the last run")
+			("manifest", po::value<string>(&manifest_path), "align each TRANSLATED-TOKENS ENGLISH-TOKENS OUTPUT triple listed in this file, instead of the two files given as arguments")
+			("listen", po::value<string>(&listen_path), "run as a service that takes docalign jobs from clients connecting to this Unix socket, see docalign-client")
+			("max-jobs", po::value<size_t>(&max_jobs), "with --listen, how many jobs to run at once. Further clients wait for a job to finish (default: 4)");
+	}
+	
+	po::options_description hidden_desc("Hidden options");
+	hidden_desc.add_options()
+		("translated-tokens", po::value<string>(), "set input filename")
+		("english-tokens", po::value<string>(), "set input filename");
+
+	po::options_description opt_desc;
+	opt_desc.add(generic_desc).add(hidden_desc);
+
+	po::variables_map vm;
+	
+	try {
+		po::store(po::command_line_parser(args).options(opt_desc).positional(arg_desc).run(), vm);
+		po::notify(vm);
+	} catch (const po::error &exception) {
+		err << exception.what() << endl;
+		return 1;
+	}
+	
+	if (!listen_path.empty()) {
+		if (max_jobs == 0) {
+			err << "--max-jobs must be at least 1" << endl;
+			return 1;
+		}
+
+		return serve(listen_path, max_jobs);
+	}
+
+	if (vm.count("help") || (manifest_path.empty() && (!vm.count("translated-tokens") || !vm.count("english-tokens")))) {
+		out << "Usage: docalign TRANSLATED-TOKENS ENGLISH-TOKENS\n"
+		    << "       docalign --manifest FILE\n"
+		    << "       docalign --listen SOCKET\n\n"
+		    << generic_desc << endl;
+		return 1;
+	}
+
+	if (!parse_ngram_sizes(ngram_size_str, ngram_sizes)) {
+		err << "Cannot understand --ngram_size " << ngram_size_str << endl;
+		return 1;
+	}
+
+	if (hash_bits != 32 && hash_bits != 64) {
+		err << "--hash-bits must be 32 or 64" << endl;
+		return 1;
+	}
+
+	if (index_side != "auto" && index_side != "translated" && index_side != "english") {
+		err << "--index must be translated, english or auto" << endl;
+		return 1;
+	}
+
+	if (engine != "hash" && engine != "spgemm") {
+		err << "--engine must be hash or spgemm" << endl;
+		return 1;
+	}
+
+	if (print_all && top_k > 0) {
+		err << "--top-k cannot be combined with --all" << endl;
+		return 1;
+	}
+
+	if (in_keys_path.empty() != en_keys_path.empty()) {
+		err << "--translated-keys and --english-keys have to be used together" << endl;
+		return 1;
+	}
+
+	if (key_type != "host" && key_type != "line") {
+		err << "--key must be host or line" << endl;
+		return 1;
+	}
+
+	if (dedup && df_sample_rate != 1) {
+		err << "--dedup cannot be combined with --df-sample-rate" << endl;
+		return 1;
+	}
+
+	size_t max_memory = 0;
+
+	if (!max_memory_str.empty() && !parse_size(max_memory_str, max_memory)) {
+		err << "Cannot understand --max-memory " << max_memory_str << endl;
+		return 1;
+	}
+
+	AlignOptions options{
+		vm.count("translated-tokens") ? vm["translated-tokens"].as<std::string>() : "",
+		vm.count("english-tokens") ? vm["english-tokens"].as<std::string>() : "",
+		n_threads,
+		threshold,
+		df_sample_rate,
+		ngram_sizes,
+		min_ngram_cnt,
+		max_ngram_cnt,
+		print_all,
+		top_k,
+		verbose,
+		stats_path,
+		max_memory,
+		max_memory_str,
+		index_side,
+		engine,
+		dedup,
+		in_keys_path,
+		en_keys_path,
+		key_type == "host",
+		&out,
+		&err
+	};
+
+	if (!manifest_path.empty()) {
+		if (vm.count("translated-tokens") || vm.count("stats-json") || !incremental_dir.empty() || !in_keys_path.empty()) {
+			err << "--manifest cannot be combined with input files, --stats-json, --incremental or block keys" << endl;
+			return 1;
+		}
+
+		try {
+			return align_manifest(manifest_path, options, hash_bits == 32 ? &align<NGram32> : &align<NGram>);
+		} catch (util::Exception const &e) {
+			err << e.what() << endl;
+			return 1;
+		}
+	}
+
+	if (!incremental_dir.empty()) {
+		if (vm.count("df-sample-rate") || vm.count("max-memory") || vm.count("stats-json") || hash_bits != 64 || engine != "hash" || dedup || !in_keys_path.empty()) {
+			err << "--incremental cannot be combined with --df-sample-rate, --max-memory, --stats-json, --hash-bits, --engine, --dedup or block keys" << endl;
+			return 1;
+		}
+
+		try {
+			return align_incremental(incremental_dir, options);
+		} catch (util::Exception const &e) {
+			err << e.what() << endl;
+			return 1;
+		}
+	}
+
+	// Check the input files up front: failing to open them later on, with
+	// worker threads running, would abort the whole process.
+	try {
+		util::scoped_fd in_fd(util::OpenReadOrThrow(options.in_path.c_str()));
+		util::scoped_fd en_fd(util::OpenReadOrThrow(options.en_path.c_str()));
+
+		if (!options.in_keys_path.empty()) {
+			util::scoped_fd in_keys_fd(util::OpenReadOrThrow(options.in_keys_path.c_str()));
+			util::scoped_fd en_keys_fd(util::OpenReadOrThrow(options.en_keys_path.c_str()));
+		}
+	} catch (util::Exception const &e) {
+		err << e.what() << endl;
+		return 1;
+	}
+
+	if (hash_bits == 32)
+		return align<NGram32>(options);
+	else
+		return align<NGram>(options);
+}
+
+int main(int argc, char *argv[])
+{
+	return run(vector<string>(argv + 1, argv + argc), cout, cerr);
 }
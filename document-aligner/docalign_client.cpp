@@ -0,0 +1,102 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "util/file_piece.hh"
+#include "util/file_stream.hh"
+#include "src/unix_socket.h"
+
+using namespace std;
+using namespace bitextor;
+
+/**
+ * Client for `docalign --listen SOCKET`. Sends the docalign arguments it is
+ * given as a job and prints the output as it comes in. With -t and -e the
+ * documents of that file are sent along with the job, for when the service
+ * cannot read the client's files.
+ */
+void usage(char const *program) {
+	cerr << "usage: " << program << " [-t TRANSLATED-TOKENS] [-e ENGLISH-TOKENS] SOCKET [docalign-args...]\n"
+	        "\n"
+	        "  -t FILE  send the translated documents in FILE along with the job\n"
+	        "  -e FILE  send the English documents in FILE along with the job\n"
+	        "\n"
+	        "Without -t and -e, pass TRANSLATED-TOKENS ENGLISH-TOKENS as docalign-args.\n"
+	        "Paths are opened by the service, so make them absolute.\n";
+}
+
+void send_documents(util::FileStream &out, char const *kind, string const &path) {
+	util::FilePiece in(path.c_str());
+	for (StringPiece line : in)
+		out << kind << ' ' << line << '\n';
+}
+
+int main(int argc, char *argv[]) {
+	string inline_paths[2];
+	int i = 1;
+
+	for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+		if (string(argv[i]) == "-t")
+			inline_paths[0] = argv[i + 1];
+		else if (string(argv[i]) == "-e")
+			inline_paths[1] = argv[i + 1];
+		else
+			break;
+	}
+
+	if (i >= argc || argv[i][0] == '-') {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (inline_paths[0].empty() != inline_paths[1].empty()) {
+		cerr << "Use -t and -e together" << endl;
+		return 1;
+	}
+
+	try {
+		util::scoped_fd fd(ConnectUnixSocket(argv[i]));
+
+		{
+			util::FileStream request(fd.get());
+
+			for (++i; i < argc; ++i) {
+				UTIL_THROW_IF(string(argv[i]).find('\n') != string::npos, util::Exception, "Arguments cannot contain newlines");
+				request << "arg " << StringPiece(argv[i]) << '\n';
+			}
+
+			if (!inline_paths[0].empty()) {
+				send_documents(request, "translated", inline_paths[0]);
+				send_documents(request, "english", inline_paths[1]);
+			}
+
+			request << '\n';
+			request.flush();
+		}
+
+		// Print output until the service tells us how the job ended
+		LineReader reader(fd.get());
+		util::FileStream out(STDOUT_FILENO);
+		string line;
+
+		while (reader.ReadLine(line)) {
+			if (line.compare(0, 8, "#stderr ") == 0) {
+				out.flush();
+				cerr << line.substr(8) << '\n';
+			} else if (line.compare(0, 6, "#exit ") == 0) {
+				out.flush();
+				return stoi(line.substr(6));
+			} else {
+				out << line << '\n';
+			}
+		}
+
+		out.flush();
+		cerr << "Connection closed before the job finished" << endl;
+		return 1;
+	} catch (util::Exception const &e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+}
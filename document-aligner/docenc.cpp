@@ -1,61 +1,215 @@
 #include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <exception>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 #include "util/file_stream.hh"
 #include "util/file_piece.hh"
 #include "util/string_piece.hh"
 #include "src/base64.h"
+#include "src/block_file.h"
+#include "src/blocking_queue.h"
+#include "src/line_index.h"
 
 using namespace std;
+using namespace bitextor;
 
 enum Mode {
 	COMPRESS,
 	DECOMPRESS
 };
 
-string prefix_lines(string const &input, string const prefix)
-{
-	stringstream sin(input);
-	stringstream sout;
+// A batch is handed to a worker once it has this many documents or bytes
+constexpr size_t BATCH_DOCUMENTS = 256;
 
-	string line;
-	while (getline(sin, line))
-		sout << prefix << line << '\n';
+constexpr size_t BATCH_BYTES = 1 << 20;
 
-	return sout.str();
+void prefix_lines(string const &input, string const &prefix, string &out)
+{
+	for (size_t pos = 0; pos < input.size();) {
+		size_t end = input.find('\n', pos);
+		if (end == string::npos)
+			end = input.size();
+
+		out.append(prefix);
+		out.append(input, pos, end - pos);
+		out.push_back('\n');
+		pos = end + 1;
+	}
 }
 
-size_t decode(util::FilePiece &in, util::FileStream &out, char delimiter, vector<size_t> const &indices, bool print_document_index, bool &delimiter_encountered) {
-	size_t document_index = 0;
-	vector<size_t>::const_iterator indices_it(indices.begin());
+/**
+ * Documents read by the main thread, to be encoded or decoded by a worker and
+ * then written in the order they were read.
+ */
+struct Batch {
+	// Decode: base64 encoded lines. Encode: plain text documents.
+	vector<string> documents;
 
+	// Index of each document in its file, for -n
+	vector<size_t> document_indices;
 
-	for (StringPiece line : in) {
-		++document_index;
+	string output;
 
-		if (!indices.empty()) {
-			if (*indices_it != document_index) {
-				continue; // skip document
-			} else {
-				indices_it++;
+	// Length of each line of output, for -w
+	vector<uint64_t> line_lengths;
+
+	bool delimiter_encountered;
+
+	promise<void> done;
+};
+
+void decode_batch(Batch &batch, char delimiter, bool print_document_index) {
+	string document;
+
+	for (size_t i = 0; i < batch.documents.size(); ++i) {
+		document.clear();
+		bitextor::base64_decode(batch.documents[i], document);
+
+		if (!batch.delimiter_encountered && document.find(delimiter == '\n' ? string("\n\n") : string(&delimiter, 1)) != string::npos)
+			batch.delimiter_encountered = true;
+
+		if (print_document_index)
+			prefix_lines(document, to_string(batch.document_indices[i]) + "\t", batch.output);
+		else
+			batch.output.append(document);
+
+		batch.output.push_back(delimiter);
+	}
+}
+
+void encode_batch(Batch &batch) {
+	string encoded_document;
+
+	for (string const &document : batch.documents) {
+		encoded_document.clear();
+		bitextor::base64_encode(StringPiece(document.data(), document.size()), encoded_document);
+		batch.output.append(encoded_document);
+		batch.output.push_back('\n');
+		batch.line_lengths.push_back(encoded_document.size() + 1);
+	}
+}
+
+/**
+ * Processes batches on n_threads worker threads and writes them in order on
+ * another thread. With one thread, processes and writes them right away.
+ */
+class OrderedPipeline {
+public:
+	OrderedPipeline(unsigned int n_threads, function<void(Batch &)> process, function<void(Batch &)> write)
+	: n_threads_(n_threads),
+	  process_(process),
+	  write_(write),
+	  work_(n_threads * QUEUE_SIZE_PER_THREAD),
+	  ordered_(n_threads * QUEUE_SIZE_PER_THREAD) {
+		if (n_threads_ == 1)
+			return;
+
+		for (unsigned int i = 0; i < n_threads_; ++i)
+			workers_.emplace_back([this]() {
+				while (Batch *batch = work_.pop()) {
+					try {
+						process_(*batch);
+						batch->done.set_value();
+					} catch (...) {
+						batch->done.set_exception(current_exception());
+					}
+				}
+			});
+
+		writer_ = thread([this]() {
+			while (unique_ptr<Batch> batch = ordered_.pop()) {
+				// After an error, only drain the queue so the reader can finish
+				if (error_)
+					continue;
+
+				try {
+					batch->done.get_future().get();
+					write_(*batch);
+				} catch (...) {
+					error_ = current_exception();
+				}
 			}
+		});
+	}
+
+	~OrderedPipeline() {
+		if (n_threads_ > 1 && writer_.joinable())
+			Stop();
+	}
+
+	void push(unique_ptr<Batch> batch) {
+		if (n_threads_ == 1) {
+			process_(*batch);
+			write_(*batch);
+			return;
 		}
 
-		string document;
-		bitextor::base64_decode(line, document);
+		work_.push(batch.get());
+		ordered_.push(std::move(batch));
+	}
 
-		if (!delimiter_encountered && document.find(delimiter == '\n' ? string("\n\n") : string(&delimiter, 1)) != string::npos)
-			delimiter_encountered = true;
+	// Waits for all batches to be written. Rethrows the first error a worker
+	// or the writer ran into.
+	void finish() {
+		if (n_threads_ > 1)
+			Stop();
 
-		if (print_document_index)
-			document = prefix_lines(document, to_string(document_index) + "\t");
+		if (error_)
+			rethrow_exception(error_);
+	}
+
+private:
+	static constexpr size_t QUEUE_SIZE_PER_THREAD = 4;
+
+	void Stop() {
+		for (size_t i = 0; i < workers_.size(); ++i)
+			work_.push(nullptr);
+
+		for (auto &worker : workers_)
+			worker.join();
+
+		ordered_.push(nullptr);
+		writer_.join();
+	}
+
+	unsigned int n_threads_;
+	function<void(Batch &)> process_;
+	function<void(Batch &)> write_;
+	blocking_queue<Batch *> work_;
+	blocking_queue<unique_ptr<Batch>> ordered_;
+	vector<thread> workers_;
+	thread writer_;
+	exception_ptr error_;
+};
 
-		out << document << delimiter;
+// Calls fun(document_index, line) for each document to decode
+template <typename T> size_t read_encoded(DocumentReader &in, vector<size_t> const &indices, T fun) {
+	size_t document_index = 0;
+	vector<size_t>::const_iterator indices_it(indices.begin());
+
+	StringPiece line;
+
+	while (true) {
+		// Skip to the next document we care about. For block files and files
+		// with an index that does not need to read the documents in between.
+		if (!indices.empty())
+			document_index += in.Skip(*indices_it++ - 1 - document_index);
+
+		if (!in.ReadLineOrEOF(line))
+			break;
+
+		++document_index;
+
+		fun(document_index, line);
 
 		// Have we found all our indices? Then stop early
 		if (!indices.empty() && indices_it == indices.end())
@@ -65,7 +219,8 @@ size_t decode(util::FilePiece &in, util::FileStream &out, char delimiter, vector
 	return document_index;
 }
 
-size_t encode(util::FilePiece &in, util::FileStream &out, char delimiter, vector<size_t> const &indices) {
+// Calls fun(document) for each document to encode
+template <typename T> size_t read_plain(DocumentReader &in, char delimiter, vector<size_t> const &indices, T fun) {
 	size_t document_index = 0;
 	string document;
 	vector<size_t>::const_iterator indices_it(indices.begin());
@@ -115,14 +270,27 @@ size_t encode(util::FilePiece &in, util::FileStream &out, char delimiter, vector
 			}
 		}
 
-		string encoded_document;
-		bitextor::base64_encode(StringPiece(document.data(), document.size()), encoded_document);
-		out << encoded_document << '\n';
+		fun(document);
 	}
 
 	return document_index;
 }
 
+// Creates FILE.idx next to a plain or gzip file if it does not have one that
+// matches the file yet. Block files need none.
+void create_index(string const &path, bool verbose) {
+	if (LineIndex::Matches(path, path + ".idx"))
+		return;
+
+	if (BlockFileReader::Detect(util::scoped_fd(util::OpenReadOrThrow(path.c_str())).get()))
+		return;
+
+	if (verbose)
+		cerr << "Indexing " << path << ".\n";
+
+	LineIndex::Build(path).Save(path + ".idx");
+}
+
 int usage(char program_name[]) {
 	cerr << "Usage: "
 	     << program_name << " [ index ... ] [ files ... ]\n"
@@ -136,7 +304,13 @@ int usage(char program_name[]) {
 	        "  -0   Use nullbyte as document delimiter (default: blank line)\n"
 	        "  -q   Do not voice concerns\n"
 	        "  -v   Voice additional info\n"
-	        "  -n   Print document index for each line\n";
+	        "  -n   Print document index for each line\n"
+	        "  -i   When decoding indices, use FILE.idx to find them, and create it\n"
+	        "       first if it does not exist or no longer matches FILE\n"
+	        "  -w F When encoding, also write an index of the output to F. Only\n"
+	        "       valid if the output is stored as is, e.g. F=out.b64.idx for\n"
+	        "       > out.b64\n"
+	        "  -j N Encode or decode on N threads (default: 1)\n";
 	return 1;
 }
 
@@ -180,7 +354,12 @@ int main(int argc, char **argv) {
 	char delimiter = '\n'; // default: second newline
 	bool print_document_index = false;
 
-	vector<util::FilePiece> files;
+	unsigned int n_threads = 1;
+
+	bool build_index = false;
+	string index_output;
+
+	vector<string> paths;
 	vector<size_t> indices;
 	
 	try {
@@ -207,13 +386,27 @@ int main(int argc, char **argv) {
 						print_document_index = true;
 						break;
 
+					case 'i':
+						build_index = true;
+						break;
+
+					case 'w':
+						UTIL_THROW_IF(i + 1 == argc, util::Exception, "Option -w needs a file name.\n");
+						index_output = argv[++i];
+						break;
+
+					case 'j':
+						UTIL_THROW_IF(i + 1 == argc || atoi(argv[i + 1]) < 1, util::Exception, "Option -j needs a number of threads.\n");
+						n_threads = atoi(argv[++i]);
+						break;
+
 					default:
 						UTIL_THROW(util::Exception, "Unknown option " << argv[i] << ".\n");
 				}
 			} else if (parse_range(argv[i], indices)) {
 				// Okay!
 			} else {
-				files.emplace_back(argv[i]);
+				paths.push_back(argv[i]);
 			}
 		}
 	} catch (util::Exception &e) {
@@ -224,33 +417,109 @@ int main(int argc, char **argv) {
 	if (print_document_index && mode == COMPRESS)
 		cerr << "Warning: printing document numbers (i.e. using -n) won't do anything.\n";
 	
+	if (build_index && (mode == COMPRESS || indices.empty()))
+		cerr << "Warning: indexing input (i.e. using -i) only helps when decoding specific documents.\n";
+
+	if (!index_output.empty() && mode == DECOMPRESS)
+		cerr << "Warning: writing an index (i.e. using -w) only works when encoding.\n";
+
 	sort(indices.begin(), indices.end());
+	indices.erase(unique(indices.begin(), indices.end()), indices.end());
+
+	vector<unique_ptr<DocumentReader>> files;
+
+	try {
+		for (string const &path : paths) {
+			// DocumentReader picks up FILE.idx by itself, it only has to exist.
+			// Encoding reads documents that are not lines, which it cannot use.
+			if (build_index && mode == DECOMPRESS && !indices.empty())
+				create_index(path, verbose > 1);
+
+			files.emplace_back(new DocumentReader(path, mode == DECOMPRESS ? DocumentReader::USE_INDEX : DocumentReader::NO_INDEX));
+		}
+	} catch (util::Exception &e) {
+		cerr << e.what() << '\n';
+		return 1;
+	}
 
 	// If no files are passed in, read from stdi
 	if (files.empty())
-		files.emplace_back(STDIN_FILENO);
+		files.emplace_back(new DocumentReader(STDIN_FILENO, "stdin"));
+
+	vector<uint64_t> line_lengths;
 
 	util::FileStream out(STDOUT_FILENO);
 
 	size_t document_count = 0;
 
-	for (util::FilePiece &in : files) {
+	for (auto &file : files) {
+		DocumentReader &in = *file;
+
 		// Initialize this with true to skip checks altogether
 		bool delimiter_encountered = verbose > 0 ? false : true;
-		
+
+		OrderedPipeline pipeline(n_threads,
+			[&](Batch &batch) {
+				if (mode == DECOMPRESS)
+					decode_batch(batch, delimiter, print_document_index);
+				else
+					encode_batch(batch);
+			},
+			[&](Batch &batch) {
+				out << batch.output;
+				delimiter_encountered |= batch.delimiter_encountered;
+				line_lengths.insert(line_lengths.end(), batch.line_lengths.begin(), batch.line_lengths.end());
+			});
+
+		unique_ptr<Batch> batch;
+		size_t batch_bytes = 0;
+
+		auto add = [&](size_t document_index, StringPiece const &document) {
+			if (!batch) {
+				batch.reset(new Batch());
+				batch->delimiter_encountered = verbose > 0 ? false : true;
+				batch_bytes = 0;
+			}
+
+			batch->documents.emplace_back(document.data(), document.size());
+			batch->document_indices.push_back(document_index);
+			batch_bytes += document.size();
+
+			if (batch->documents.size() == BATCH_DOCUMENTS || batch_bytes >= BATCH_BYTES)
+				pipeline.push(std::move(batch));
+		};
+
 		switch (mode) {
 			case DECOMPRESS:
-				document_count += decode(in, out, delimiter, indices, print_document_index, delimiter_encountered);
+				document_count += read_encoded(in, indices, add);
 				break;
 			case COMPRESS:
-				document_count += encode(in, out, delimiter, indices);
+				document_count += read_plain(in, delimiter, indices, [&](string const &document) {
+					add(0, document);
+				});
 				break;
 		}
 
+		if (batch)
+			pipeline.push(std::move(batch));
+
+		pipeline.finish();
+
 		if (verbose > 0 && delimiter_encountered)
 			cerr << "Warning: document separator occurs in documents in " << in.FileName() << ".\n";
 	}
 
+	if (!index_output.empty() && mode == COMPRESS) {
+		out.flush();
+
+		try {
+			LineIndex::FromLineLengths(STDOUT_FILENO, line_lengths).Save(index_output);
+		} catch (util::Exception &e) {
+			cerr << "Could not write index " << index_output << ": " << e.what() << '\n';
+			return 1;
+		}
+	}
+
 	if (verbose > 1)
 		cerr << "Processed " << document_count << " documents.\n";
 
@@ -1,11 +1,22 @@
 #include <algorithm>
 #include <vector>
 #include <iostream>
-#include <sstream>
 #include <memory>
 #include <numeric>
+#include <queue>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include <limits>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "util/exception.hh"
+#include "util/file.hh"
 #include "util/file_piece.hh"
+#include "util/file_stream.hh"
 #include "src/base64.h"
+#include "src/block_file.h"
 
 
 using namespace bitextor;
@@ -14,6 +25,10 @@ using namespace std;
 struct Join {
 	size_t left_index;
 	size_t right_index;
+
+	// Line of the input it was read from, to keep the order of joins with the
+	// same index stable when sorting externally.
+	size_t line;
 };
 
 struct Row {
@@ -34,15 +49,14 @@ ostream &operator<<(ostream &out, Row const &row) {
 	return out;
 }
 
-typedef vector<unique_ptr<util::FilePiece>> FileSet;
+typedef vector<unique_ptr<DocumentReader>> FileSet;
 
 size_t skip_rows(FileSet &files, size_t n) {
-	StringPiece line;
-
-	for (auto &file : files)
-		for (size_t i = 0; i < n; ++i)
-			if (!file->ReadLineOrEOF(line))
-				return i;
+	for (auto &file : files) {
+		size_t skipped = file->Skip(n);
+		if (skipped != n)
+			return skipped;
+	}
 
 	return n;
 }
@@ -62,6 +76,55 @@ bool read_row(FileSet &files, Row &row) {
 	return true;
 }
 
+/**
+ * Reads through a set of files in order to the row with a given index, which
+ * start at 1. Indices can repeat but not go back. Without files every row is
+ * an empty row.
+ */
+class RowCursor {
+public:
+	explicit RowCursor(FileSet &files)
+	: files_(files),
+	  offset_(0) {
+	}
+
+	// Returns false if index lies beyond the end of the files
+	bool seek(size_t index) {
+		// While our index is still far off, skip rows
+		if (offset_ < index - 1) {
+			size_t rows_to_skip = (index - 1) - offset_;
+			size_t rows_skipped = skip_rows(files_, rows_to_skip);
+			offset_ += rows_skipped;
+			if (rows_skipped != rows_to_skip)
+				return false;
+		}
+
+		// Next row is the row we want, read it.
+		if (offset_ == index - 1) {
+			if (!read_row(files_, row_))
+				return false;
+			++offset_;
+		}
+
+		return true;
+	}
+
+	Row const &row() const {
+		return row_;
+	}
+
+	// Number of rows read so far
+	size_t offset() const {
+		return offset_;
+	}
+
+private:
+	FileSet &files_;
+	size_t offset_; // the indices used by docalign start at 1, so let's call
+	                // everything that starts counting at 0 "offset"
+	Row row_;
+};
+
 enum Source {
 	LEFT,
 	RIGHT,
@@ -69,8 +132,345 @@ enum Source {
 	RIGHT_INDEX
 };
 
+/**
+ * Prints the columns of a join in the order in which the input files were
+ * given to the program.
+ */
+void print_join(ostream &out, vector<Source> const &order, Join const &join, Row const &left_row, Row const &right_row) {
+	for (size_t i = 0, l = 0, r = 0; i < order.size(); ++i) {
+		if (i > 0)
+			out << '\t';
+
+		switch (order[i]) {
+			case LEFT:
+				out << left_row.cells[l++];
+				break;
+			case RIGHT:
+				out << right_row.cells[r++];
+				break;
+			case LEFT_INDEX:
+				out << join.left_index;
+				break;
+			case RIGHT_INDEX:
+				out << join.right_index;
+				break;
+		}
+	}
+	out << '\n';
+}
+
+bool parse_index(char const *&it, char const *end, size_t &index) {
+	while (it != end && isspace(*it))
+		++it;
+
+	if (it == end || !isdigit(*it))
+		return false;
+
+	for (index = 0; it != end && isdigit(*it); ++it)
+		index = index * 10 + (*it - '0');
+
+	return true;
+}
+
+/**
+ * Parses `<left index> <whitespace> <right index>` at the start of line. Does
+ * the same as reading them from an istringstream, without its overhead.
+ */
+bool parse_join(StringPiece const &line, Join &join) {
+	char const *it = line.data(), *end = line.data() + line.size();
+	return parse_index(it, end, join.left_index) && parse_index(it, end, join.right_index);
+}
+
+/**
+ * Reads the joins from stdin and calls fun for each of them. Returns false
+ * if a line could not be parsed.
+ */
+template <typename Fun> bool read_joins(Fun fun) {
+	util::FilePiece in(0, "stdin");
+	StringPiece line;
+	Join join;
+
+	for (join.line = 1; in.ReadLineOrEOF(line); ++join.line) {
+		if (!parse_join(line, join)) {
+			cerr << "Parse error at line " << join.line << " \"" << line << "\"\n";
+			return false;
+		}
+
+		fun(join);
+	}
+
+	return true;
+}
+
+// Buffer size for reading back each sorted run
+constexpr size_t RUN_BUFFER_SIZE = 1 << 16;
+
+/**
+ * Reads back a temporary file written by RunWriter, from the start.
+ */
+class RunReader {
+public:
+	explicit RunReader(int fd)
+	: fd_(fd),
+	  buffer_(RUN_BUFFER_SIZE),
+	  pos_(0),
+	  end_(0) {
+		util::SeekOrThrow(fd_.get(), 0);
+	}
+
+	// Reads size bytes into to. Returns false at the end of the file.
+	bool read(void *to, size_t size) {
+		char *out = static_cast<char *>(to);
+
+		while (size > 0) {
+			if (pos_ == end_) {
+				pos_ = 0;
+				end_ = util::ReadOrEOF(fd_.get(), buffer_.data(), buffer_.size());
+
+				if (end_ == 0) {
+					UTIL_THROW_IF(out != to, util::EndOfFileException, "Temporary file is truncated");
+					return false;
+				}
+			}
+
+			size_t n = min(size, end_ - pos_);
+			memcpy(out, buffer_.data() + pos_, n);
+			pos_ += n;
+			out += n;
+			size -= n;
+		}
+
+		return true;
+	}
+
+private:
+	util::scoped_fd fd_;
+	vector<char> buffer_;
+	size_t pos_;
+	size_t end_;
+};
+
+/**
+ * A join with the cells of its left row, as passed from the left to the right
+ * side of the external join.
+ */
+struct LeftRow {
+	Join join;
+	Row row;
+};
+
+// Memory a record allocates besides the record itself
+size_t record_size(Join const &) {
+	return 0;
+}
+
+size_t record_size(LeftRow const &record) {
+	size_t size = record.row.cells.capacity() * sizeof(string);
+	for (auto const &cell : record.row.cells)
+		size += cell.capacity();
+	return size;
+}
+
+void write_record(util::FileStream &out, Join const &join) {
+	out.write(&join, sizeof(join));
+}
+
+void write_record(util::FileStream &out, LeftRow const &record) {
+	out.write(&record.join, sizeof(record.join));
+
+	uint64_t cell_cnt = record.row.cells.size();
+	out.write(&cell_cnt, sizeof(cell_cnt));
+
+	for (auto const &cell : record.row.cells) {
+		uint64_t size = cell.size();
+		out.write(&size, sizeof(size));
+		out.write(cell.data(), cell.size());
+	}
+}
+
+bool read_record(RunReader &in, Join &join) {
+	return in.read(&join, sizeof(join));
+}
+
+bool read_record(RunReader &in, LeftRow &record) {
+	if (!in.read(&record.join, sizeof(record.join)))
+		return false;
+
+	uint64_t cell_cnt;
+	in.read(&cell_cnt, sizeof(cell_cnt));
+	record.row.cells.resize(cell_cnt);
+
+	for (auto &cell : record.row.cells) {
+		uint64_t size;
+		in.read(&size, sizeof(size));
+		cell.resize(size);
+		in.read(&cell[0], size);
+	}
+
+	return true;
+}
+
+/**
+ * Collects records in memory until they take up about max_bytes, then writes
+ * them sorted as a run to an (already unlinked) temporary file. That counts
+ * what the records and the vector holding them have allocated, including the
+ * doubling of the vector when it grows.
+ */
+template <typename Record, typename Less> class RunWriter {
+public:
+	RunWriter(string const &temp_prefix, size_t max_bytes, Less less)
+	: temp_prefix_(temp_prefix),
+	  max_bytes_(max_bytes),
+	  bytes_(0),
+	  less_(less) {
+	}
+
+	void push(Record &&record) {
+		size_t size = record_size(record);
+		size_t capacity = records_.size() < records_.capacity() ? records_.capacity() : max<size_t>(2 * records_.capacity(), 1);
+
+		if (!records_.empty() && bytes_ + size + capacity * sizeof(Record) > max_bytes_)
+			spill();
+
+		bytes_ += size;
+		records_.push_back(move(record));
+	}
+
+	// Writes what is left and returns the runs to merge
+	vector<unique_ptr<RunReader>> finish() {
+		if (!records_.empty())
+			spill();
+
+		return move(runs_);
+	}
+
+private:
+	void spill() {
+		sort(records_.begin(), records_.end(), less_);
+
+		util::scoped_fd fd(util::MakeTemp(temp_prefix_));
+
+		{
+			util::FileStream out(fd.get());
+			for (auto const &record : records_)
+				write_record(out, record);
+			out.flush();
+		}
+
+		runs_.emplace_back(new RunReader(fd.release()));
+
+		// Keeps the capacity of records_, which the next run will fill again
+		records_.clear();
+		bytes_ = 0;
+	}
+
+	string temp_prefix_;
+	size_t max_bytes_;
+	size_t bytes_;
+	Less less_;
+	vector<Record> records_;
+	vector<unique_ptr<RunReader>> runs_;
+};
+
+/**
+ * Merges sorted runs, calling fun for each record in order.
+ */
+template <typename Record, typename Less, typename Fun> void merge_runs(vector<unique_ptr<RunReader>> &runs, Less less, Fun fun) {
+	vector<Record> heads(runs.size());
+
+	// Min-heap of the runs by their current head record
+	auto greater = [&heads, &less](size_t a, size_t b) {
+		return less(heads[b], heads[a]);
+	};
+
+	priority_queue<size_t, vector<size_t>, decltype(greater)> queue(greater);
+
+	for (size_t i = 0; i < runs.size(); ++i)
+		if (read_record(*runs[i], heads[i]))
+			queue.push(i);
+
+	while (!queue.empty()) {
+		size_t i = queue.top();
+		queue.pop();
+
+		fun(heads[i]);
+
+		if (read_record(*runs[i], heads[i]))
+			queue.push(i);
+	}
+}
+
+/**
+ * Joins without keeping the left rows in memory: sorts the joins by left
+ * index in runs of at most max_bytes on disk, merges those while reading
+ * through the left files to attach the left cells to each join, sorts those
+ * by right index the same way, and merges them while reading through the
+ * right files to print the output. Joins with the same right index are
+ * printed in the order of the input.
+ */
+int external_join(FileSet &left_files, FileSet &right_files, vector<Source> const &order, string const &temp_prefix, size_t max_bytes) {
+	auto by_left = [](Join const &a, Join const &b) {
+		return a.left_index != b.left_index ? a.left_index < b.left_index : a.line < b.line;
+	};
+
+	auto by_right = [](LeftRow const &a, LeftRow const &b) {
+		return a.join.right_index != b.join.right_index ? a.join.right_index < b.join.right_index : a.join.line < b.join.line;
+	};
+
+	RunWriter<Join, decltype(by_left)> joins(temp_prefix, max_bytes, by_left);
+
+	if (!read_joins([&joins](Join const &join) { joins.push(Join(join)); }))
+		return 1;
+
+	vector<unique_ptr<RunReader>> join_runs(joins.finish());
+
+	// Attach the left cells to each join
+	RunWriter<LeftRow, decltype(by_right)> left_rows(temp_prefix, max_bytes, by_right);
+	RowCursor left(left_files);
+	bool left_in_range = true;
+
+	merge_runs<Join>(join_runs, by_left, [&](Join const &join) {
+		if (!left_in_range)
+			return;
+
+		if (!left.seek(join.left_index)) {
+			cerr << "Left index " << join.left_index << " outside of range " << left.offset() << endl;
+			left_in_range = false;
+			return;
+		}
+
+		left_rows.push(LeftRow{join, left.row()});
+	});
+
+	if (!left_in_range)
+		return 2;
+
+	join_runs.clear();
+
+	vector<unique_ptr<RunReader>> left_row_runs(left_rows.finish());
+
+	// Then go through the right rows in order and print
+	RowCursor right(right_files);
+	bool right_in_range = true;
+
+	merge_runs<LeftRow>(left_row_runs, by_right, [&](LeftRow const &record) {
+		if (!right_in_range)
+			return;
+
+		if (!right.seek(record.join.right_index)) {
+			cerr << "Right index " << record.join.right_index << " outside of range " << right.offset() << endl;
+			right_in_range = false;
+			return;
+		}
+
+		print_join(cout, order, record.join, record.row, right.row());
+	});
+
+	return right_in_range ? 0 : 1;
+}
+
 int usage(char *progname) {
-	cout << "Usage: " << progname << " [ -l filename | -r filename | -li | -ri ] ...\n"
+	cout << "Usage: " << progname << " [ -x [ -S MB ] [ -T dir ] ] [ -l filename | -r filename | -li | -ri ] ...\n"
 	        "Input via stdin: <left index> \"\\t\" <right index> \"\\n\"\n"
 	        "\n"
 	        "This program joins rows from two sets of files into tab-separated output.\n"
@@ -82,7 +482,12 @@ int usage(char *progname) {
 	        "  -ri   Print the right index\n"
 	        "\n"
 	        "The order of the columns in the output is the same as the order of the\n"
-	        "arguments given to the program.\n";
+	        "arguments given to the program.\n"
+	        "\n"
+	        "Memory options:\n"
+	        "  -x    Sort on disk instead of keeping all left rows in memory\n"
+	        "  -S    Memory to use for sorting with -x in MB (default: 1024)\n"
+	        "  -T    Directory for temporary files with -x (default: $TMPDIR or /tmp)\n";
 	return 127;
 }
 
@@ -99,6 +504,10 @@ int main(int argc, char *argv[]) {
 
 	// Trick to easily switch between left & right files using side
 	FileSet *files[]{&left_files, &right_files};
+
+	bool external = false;
+	size_t max_mb = 1024;
+	string temp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
 	
 	for (int pos = 1; pos < argc; ++pos) {
 		if (string(argv[pos]) == "-l")
@@ -109,28 +518,46 @@ int main(int argc, char *argv[]) {
 			order.push_back(LEFT_INDEX);
 		else if (string(argv[pos]) == "-ri")
 			order.push_back(RIGHT_INDEX);
+		else if (string(argv[pos]) == "-x")
+			external = true;
+		else if (string(argv[pos]) == "-S" && pos + 1 < argc) {
+			char *end;
+			errno = 0;
+			max_mb = strtoul(argv[++pos], &end, 10);
+
+			if (!isdigit(*argv[pos]) || *end != '\0' || errno == ERANGE || max_mb == 0 || max_mb > (numeric_limits<size_t>::max() >> 20)) {
+				cerr << "-S must be a number of MB of at least 1, not " << argv[pos] << endl;
+				return 1;
+			}
+		}
+		else if (string(argv[pos]) == "-T" && pos + 1 < argc)
+			temp_dir = argv[++pos];
 		else {
-			files[side]->emplace_back(new util::FilePiece(argv[pos]));
+			files[side]->emplace_back(new DocumentReader(argv[pos]));
 			order.push_back(side);
 		}
 	}
 
-	// Read our joins into memory
-	vector<Join> joins;
-	string line;
-	size_t index = 0;
-	while (getline(cin, line)) {
-		++index;
-		istringstream iline(line);
-		Join join;
-		if (iline >> join.left_index >> join.right_index) {
-			joins.push_back(join);
-		} else {
-			cerr << "Parse error at line " << index << " \"" << line << "\"\n";
+	if (external) {
+		struct stat temp_stat;
+		if (stat(temp_dir.c_str(), &temp_stat) != 0 || !S_ISDIR(temp_stat.st_mode) || access(temp_dir.c_str(), W_OK | X_OK) != 0) {
+			cerr << "Cannot write temporary files to " << temp_dir << endl;
+			return 1;
+		}
+
+		try {
+			return external_join(left_files, right_files, order, temp_dir + "/docjoin", max_mb << 20);
+		} catch (util::Exception const &e) {
+			cerr << e.what() << endl;
 			return 1;
 		}
 	}
 
+	// Read our joins into memory
+	vector<Join> joins;
+	if (!read_joins([&joins](Join const &join) { joins.push_back(join); }))
+		return 1;
+
 	// Empty input? Empty output! Totally fine!
 	if (joins.empty())
 		return 0;
@@ -164,33 +591,14 @@ int main(int argc, char *argv[]) {
 
 	// For all joins (sorted by their right index) start reading through right
 	// and every time we encounter one that we need we print left + right.
-
-	size_t right_offset = 0; // the indices used by docalign start at 1, so
-	                         // let's call everything that starts counting at
-	                         // 0 "offset"
-	Row right_row;
+	RowCursor right(right_files);
 	for (auto join_it = joins.begin(); join_it != joins.end(); ++join_it) {
 		// Assume we sorted correctly and we read from 1 to n without jumps...
-		assert(join_it->right_index >= right_offset);
+		assert(join_it->right_index >= right.offset());
 
-		// While our index is still far off, skip rows
-		if (right_offset < join_it->right_index - 1) {
-			size_t rows_to_skip = (join_it->right_index - 1) - right_offset;
-			size_t rows_skipped = skip_rows(right_files, rows_to_skip);
-			if (rows_skipped != rows_to_skip) {
-				cerr << "Right index " << join_it->right_index << " outside of range " << right_offset + rows_skipped << endl;
-				return 1;
-			}
-			right_offset += rows_skipped;
-		}
-
-		// Next row is the row we want, read it.
-		if (right_offset == join_it->right_index - 1) {
-			if (!read_row(right_files, right_row)) {
-				cerr << "Right index " << join_it->right_index << " outside of range " << right_offset << endl;
-				return 1;
-			}
-			++right_offset;
+		if (!right.seek(join_it->right_index)) {
+			cerr << "Right index " << join_it->right_index << " outside of range " << right.offset() << endl;
+			return 1;
 		}
 
 		// Our left index is outside of what's in memory? Sad!
@@ -199,27 +607,7 @@ int main(int argc, char *argv[]) {
 			return 2;
 		}
 
-		// Print the columns in the order in which the input files were given to the program
-		for (size_t i = 0, l = 0, r = 0; i < order.size(); ++i) {
-			if (i > 0)
-				cout << '\t';
-			
-			switch (order[i]) {
-				case LEFT:
-					cout << left_rows[join_it->left_index - 1].cells[l++];
-					break;
-				case RIGHT:
-					cout << right_row.cells[r++];
-					break;
-				case LEFT_INDEX:
-					cout << join_it->left_index;
-					break;
-				case RIGHT_INDEX:
-					cout << join_it->right_index;
-					break;
-			}
-		}
-		cout << endl;
+		print_join(cout, order, *join_it, left_rows[join_it->left_index - 1], right.row());
 	}
 
 	return 0;
@@ -0,0 +1,75 @@
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "util/file_stream.hh"
+#include "src/block_file.h"
+
+using namespace std;
+using namespace bitextor;
+
+int usage(char const *program_name) {
+	cerr << "Usage: " << program_name << " [ -b N ] [ -u ] [ input [ output ] ]\n"
+	        "\n"
+	        "Converts a file with a document on each line (plain, gzip, xz, ...) into a\n"
+	        "block file, in which any document can be found without reading the ones\n"
+	        "before it. All document-aligner tools read both.\n"
+	        "\n"
+	        "Options:\n"
+	        "  -b N  Documents per block (default: 256)\n"
+	        "  -u    Unpack: convert a block file back into plain lines\n"
+	        "\n"
+	        "Without input and output, reads from stdin and writes to stdout.\n";
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	size_t documents_per_block = 256;
+	bool unpack = false;
+	vector<string> paths;
+
+	for (int i = 1; i < argc; ++i) {
+		string arg(argv[i]);
+
+		if (arg == "-b" && i + 1 < argc)
+			documents_per_block = atol(argv[++i]);
+		else if (arg == "-u")
+			unpack = true;
+		else if (arg[0] == '-' && arg.size() > 1)
+			return usage(argv[0]);
+		else
+			paths.push_back(arg);
+	}
+
+	if (paths.size() > 2 || documents_per_block == 0)
+		return usage(argv[0]);
+
+	try {
+		DocumentReader in(paths.size() > 0 && paths[0] != "-"
+			? DocumentReader(paths[0])
+			: DocumentReader(STDIN_FILENO, "stdin"));
+
+		util::scoped_fd out_fd(paths.size() > 1 ? util::CreateOrThrow(paths[1].c_str()) : dup(STDOUT_FILENO));
+
+		StringPiece line;
+
+		if (unpack) {
+			util::FileStream out(out_fd.get());
+			while (in.ReadLineOrEOF(line))
+				out << line << '\n';
+		} else {
+			BlockFileWriter out(out_fd.get(), documents_per_block);
+			while (in.ReadLineOrEOF(line))
+				out.Add(line);
+			out.Finish();
+		}
+	} catch (util::Exception const &e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	return 0;
+}
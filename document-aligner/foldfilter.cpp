@@ -1,7 +1,14 @@
 #include <thread>
-#include <deque>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <iomanip>
+#include <fstream>
+#include <memory>
+#include <getopt.h>
 #include <vector>
 #include <climits>
+#include <cstdlib>
 #include <cstring>
 #include <type_traits>
 #include "util/exception.hh"
@@ -11,150 +18,66 @@
 #include "util/utf8.hh"
 #include "src/single_producer_queue.h"
 #include "src/subprocess.h"
+#include "src/pipe.h"
+#include "src/wrap.h"
+#include "src/filter_stats.h"
 
 using namespace std;
 using namespace bitextor;
 
-constexpr size_t not_found = -1;
-
-struct wrap_options {
-	// Maximum number of bytes (not unicode characters!) that may end up in a
-	// single line.
-	size_t column_width = 80;
-
-	// Keep delimiters in the split lines, or separate them out into their own
-	// queue.
-	bool keep_delimiters = true;
-
-	// Order determines preference: the first one of these to occur in the
-	// line will determine the wrapping point.
-	vector<UChar32> delimiters{':', ',', ' ', '-', '.', '/'};
-};
-
 struct program_options : wrap_options {
 	// argv for wrapped command. Should start with the program name and end
 	// with NULL.
 	char **child_argv = 0;
-};
-
-size_t find_delimiter(vector<UChar32> const &delimiters, UChar32 character) {
-	for (size_t i = 0; i < delimiters.size(); ++i)
-		if (character == delimiters[i])
-			return i;
-
-	return not_found;
-}
-
-pair<deque<StringPiece>,deque<string>> wrap_lines(StringPiece const &line, wrap_options const &options) {
-	deque<StringPiece> out_lines;
-
-	deque<string> out_delimiters;
-
-	// Current byte position
-	int32_t pos = 0;
 
-	// Length of line in bytes
-	int32_t length = line.size();
-	
-	// Byte position of last cut-off point
-	int32_t pos_last_cut = 0;
-
-	// For each delimiter the byte position of its last occurrence
-	vector<int32_t> pos_delimiters(options.delimiters.size(), 0);
+	// Hand lines to the command with vmsplice()
+	bool zero_copy = false;
 
-	// Position of the first delimiter we encountered up to pos. Reset
-	// to pos + next char if it's not a delimiter.
-	int32_t pos_first_delimiter = 0;
-
-	while (pos < length) {
-		UChar32 character;
-
-		U8_NEXT(line.data(), pos, length, character);
-		
-		if (character < 0)
-			throw utf8::NotUTF8Exception(line);
-
-		size_t delimiter_idx = find_delimiter(options.delimiters, character);
-
-		if (delimiter_idx != not_found) {
-			// Store pos_first_delimiter instead of pos because when we have
-			// consecutive delimiters we want to chop em all off, even when
-			// our ideal delimiter is somewhere in the middle.
-			pos_delimiters[delimiter_idx] = pos_first_delimiter;
-		} else {
-			// Maybe the next char is a delimiter? pos is pointing to the next
-			// one right now, U8_NEXT incremented it.
-			pos_first_delimiter = pos;
-		}
-
-		// Do we need to introduce a break? If not, move to next character
-		if (pos - pos_last_cut < static_cast<int32_t>(options.column_width))
-			continue;
-
-		// Last resort if we didn't break on a delimiter: just chop where we are
-		int32_t pos_cut = pos;
-
-		// Find a more ideal break point by looking back for a delimiter
-		for (int32_t const &pos_delimiter : pos_delimiters) {
-			if (pos_delimiter > pos_last_cut) {
-				pos_cut = pos_delimiter;
-				break;
-			}
-		}
+	// Print throughput to stderr at the end
+	bool verbose = false;
 
-		// Assume we cut without delimiters (i.e. the last resort scenario)
-		int32_t pos_cut_end = pos_cut;
+	// Number of wrapped lines to sort by length before sending them to the
+	// command. 0 sends them in order.
+	size_t batch_size = 0;
 
-		// Peek ahead to were after the cut we encounter our first not-a-delimiter
-		// because that's the point were we resume.
-		for (int32_t pos_next = pos_cut_end; pos_cut_end < length; pos_cut_end = pos_next) {
-			// When we're not skipping delimiters, don't send more bytes than
-			// column_width in total a single line, even though we try to keep
-			// the delimiters together.
-			if (options.keep_delimiters && pos_cut_end - pos_last_cut >= static_cast<int32_t>(options.column_width))
-				break;
-
-			U8_NEXT(line.data(), pos_next, length, character);
-
-			if (character < 0)
-				throw utf8::NotUTF8Exception(line);
-
-			// First character after pos_cut is probably a delimiter, unless
-			// we did a hard stop in the middle of a word, and we're not keeping
-			// the delimiters.
-			if (find_delimiter(options.delimiters, character) == not_found)
-				break;
-		}
-
-		if (options.keep_delimiters) {
-			out_lines.push_back(line.substr(pos_last_cut, pos_cut_end - pos_last_cut));
-			out_delimiters.emplace_back("");
-		} else {
-			out_lines.push_back(line.substr(pos_last_cut, pos_cut - pos_last_cut));
-			out_delimiters.emplace_back(line.substr(pos_cut, pos_cut_end - pos_cut).data(), pos_cut_end - pos_cut);
-		}
+	// Print statistics every stats_interval seconds, to stats_path or stderr
+	bool print_stats = false;
+	string stats_path;
+	double stats_interval = DEFAULT_STATS_INTERVAL;
+};
 
-		pos_last_cut = pos_cut_end;
-		pos = pos_cut_end;
-	}
+// What the reader needs to put a wrapped sentence back together
+struct wrapped_sentence {
+	// Number of lines the sentence was wrapped into. 0 tells the reader to stop.
+	size_t line_cnt = 0;
 
-	// Push out any trailing bits. Or the empty bit.
-	if (pos_last_cut < pos || pos == 0) {
-		out_lines.push_back(line.substr(pos_last_cut, pos - pos_last_cut));
-		out_delimiters.push_back("");
-	}
+	// The delimiters cut off after each line, concatenated, and where each
+	// ends. Both empty when we're keeping delimiters.
+	string delimiters;
+	vector<uint32_t> delimiter_ends;
 
-	return make_pair(out_lines, out_delimiters);
-}
+	// When it was queued, with --stats
+	chrono::steady_clock::time_point queued;
+};
 
 int usage(char **argv) {
-	cerr << "usage: " << argv[0] << " [-w width] [-s] [-h] command [command-args ...]\n"
+	cerr << "usage: " << argv[0] << " [-w width] [-s] [-b lines] [-z] [-v] [--stats[=file]] [-h] command [command-args ...]\n"
 		    "\n"
 		    "Options:\n"
 		    "  -h        Display help\n"
 		    "  -w <num>  Wrap lines to have at most <num> bytes\n"
 		    "  -d <str>  Specify punctuation to break on. Order determines preference.\n"
-		    "  -s        Skip passing punctuation around wrapping points to the command\n";
+		    "  -s        Skip passing punctuation around wrapping points to the command\n"
+		    "  -b <num>  Send lines to the command sorted by length, in batches of <num>\n"
+		    "            lines. Output is still in the order of the input.\n"
+		    "  -z        Hand lines to the command with vmsplice() instead of copying\n"
+		    "            them. Only if it reads its stdin, and does not splice() it.\n"
+		    "  -v        Print how fast data went to and came from the command\n"
+		    "  --stats[=<file>]\n"
+		    "            Every 10 seconds print throughput, time spent waiting, latency\n"
+		    "            of lines and queue depth to stderr, or to <file>\n"
+		    "  --stats-interval=<num>\n"
+		    "            Print those every <num> seconds instead\n";
 	return 1;
 }
 
@@ -179,8 +102,14 @@ vector<UChar32> parse_delimiters(char *value) {
 }
 
 void parse_options(program_options &options, int argc, char **argv) {
+	option const long_options[] = {
+		{"stats", optional_argument, nullptr, 'S'},
+		{"stats-interval", required_argument, nullptr, 'I'},
+		{nullptr, 0, nullptr, 0}
+	};
+
 	while (true) {
-		switch(getopt(argc, argv, "+w:d:sh")) {
+		switch(getopt_long(argc, argv, "+w:d:sb:zvh", long_options, nullptr)) {
 			case 'w':
 				options.column_width = atoi(optarg);
 				continue;
@@ -193,6 +122,36 @@ void parse_options(program_options &options, int argc, char **argv) {
 				options.keep_delimiters = false;
 				continue;
 
+			case 'b': {
+				// Parsed as signed, so -1 does not become a huge size_t
+				char *end;
+				long value = strtol(optarg, &end, 10);
+				if (end == optarg || *end != '\0' || value < 1)
+					exit(usage(argv));
+				options.batch_size = value;
+				continue;
+			}
+
+			case 'z':
+				options.zero_copy = true;
+				continue;
+
+			case 'v':
+				options.verbose = true;
+				continue;
+
+			case 'S':
+				options.print_stats = true;
+				if (optarg)
+					options.stats_path = optarg;
+				continue;
+
+			case 'I':
+				options.stats_interval = atof(optarg);
+				if (options.stats_interval <= 0)
+					exit(usage(argv));
+				continue;
+
 			case 'h':
 			case '?':
 			default:
@@ -215,69 +174,224 @@ int main(int argc, char **argv) {
 
 	parse_options(options, argc, argv);
 
-	SingleProducerQueue<deque<string>> queue;
+	SingleProducerQueue<wrapped_sentence> queue;
+
+	// With -b, the order in which the lines of each batch were sent
+	SingleProducerQueue<vector<uint32_t>> order_queue;
+
+	ofstream stats_file;
+	if (!options.stats_path.empty()) {
+		stats_file.open(options.stats_path);
+		if (!stats_file) {
+			cerr << "Could not open " << options.stats_path << " for writing" << endl;
+			return 1;
+		}
+	}
 
 	subprocess child(options.child_argv[0]);
 
 	child.start(options.child_argv);
 
-	thread feeder([&child, &queue, &options]() {
+	unique_ptr<FilterStats> stats;
+	if (options.print_stats) {
+		stats.reset(new FilterStats(options.stats_path.empty() ? cerr : stats_file, options.stats_interval, "sentences"));
+		stats->AddQueue([&queue]() { return queue.MaxDepth(); });
+		stats->AddQueue([&order_queue]() { return order_queue.MaxDepth(); });
+	}
+
+	auto start = chrono::steady_clock::now();
+
+	// Bytes, and time until the last byte, in each direction
+	uint64_t bytes_in = 0, bytes_out = 0;
+	double seconds_in = 0, seconds_out = 0, seconds_blocked = 0;
+	bool spliced = false;
+
+	thread feeder([&]() {
 		util::FilePiece in(STDIN_FILENO);
-		util::FileStream child_in(child.in.get());
+		PipeWriter child_in(child.in.get(), options.zero_copy);
 
-		for (StringPiece sentence : in) {
-			deque<StringPiece> lines;
-			deque<string> delimiters;
+		LineWrapper wrapper(options);
+		wrapped_sentence wrapped;
+
+		// Wrapped lines of the batch that is being collected, with -b
+		vector<string> batch;
+
+		// Lines written to the child so far
+		uint64_t line_cnt = 0;
+
+		// Sorts the batch by length, shortest first, and sends it. Batched
+		// MT decoders are a lot faster when the sentences in a batch are of
+		// similar length.
+		auto send_batch = [&]() {
+			vector<uint32_t> order(batch.size());
+			iota(order.begin(), order.end(), 0);
+			stable_sort(order.begin(), order.end(), [&batch](uint32_t a, uint32_t b) {
+				return batch[a].size() < batch[b].size();
+			});
+
+			// Like the delimiters, the order goes first
+			order_queue.Produce(order);
 
+			for (uint32_t i : order)
+				child_in << batch[i] << '\n';
+
+			line_cnt += batch.size();
+			batch.clear();
+		};
+
+		for (StringPiece sentence : in) {
 			// If there is nothing to wrap, it will end up with a single line
 			// and a single empty delimiter.
-			tie(lines, delimiters) = wrap_lines(sentence, options);
-			// assert(lines.size() == delimiters.size());
+			wrapper.Wrap(sentence);
 
 			// When we're keeping delimiters all of these will be empty strings
-			// but their amount at least will tell the reader thread how many
-			// lines it needs to consume to reconstruct the single line.
-			queue.Produce(delimiters);
+			// so we only tell the reader thread how many lines it needs to
+			// consume to reconstruct the single line.
+			wrapped.line_cnt = wrapper.lines().size();
+			wrapped.delimiters.clear();
+			wrapped.delimiter_ends.clear();
+
+			if (!options.keep_delimiters) {
+				for (StringPiece const &delimiter : wrapper.delimiters()) {
+					wrapped.delimiters.append(delimiter.data(), delimiter.size());
+					wrapped.delimiter_ends.push_back(wrapped.delimiters.size());
+				}
+			}
+
+			if (stats)
+				wrapped.queued = chrono::steady_clock::now();
+
+			queue.Produce(wrapped);
+
+			uint64_t bytes = child_in.bytes();
+			uint64_t lines = line_cnt;
+			double blocked = child_in.blocked_seconds();
 
 			// Feed the document to the child.
 			// Might block because it can cause a flush.
-			for (auto const &line : lines)
-				child_in << line << '\n';
+			if (options.batch_size == 0) {
+				for (auto const &line : wrapper.lines())
+					child_in << line << '\n';
+
+				line_cnt += wrapper.lines().size();
+			} else {
+				for (auto const &line : wrapper.lines()) {
+					batch.emplace_back(line.data(), line.size());
+					if (batch.size() == options.batch_size)
+						send_batch();
+				}
+			}
+
+			if (stats) {
+				stats->AddInput(child_in.bytes() - bytes, line_cnt - lines);
+				stats->AddFeederBlocked(child_in.blocked_seconds() - blocked);
+			}
 		}
 
+		uint64_t bytes = child_in.bytes();
+		uint64_t lines = line_cnt;
+		double blocked = child_in.blocked_seconds();
+
+		if (!batch.empty())
+			send_batch();
+
 		// Tell the reader to stop
-		queue.Produce(deque<string>());
+		queue.Produce(wrapped_sentence());
 
 		// Flush (blocks) & close the child's stdin
 		child_in.flush();
 		child.in.reset();
+
+		if (stats) {
+			stats->AddInput(child_in.bytes() - bytes, line_cnt - lines);
+			stats->AddFeederBlocked(child_in.blocked_seconds() - blocked);
+		}
+
+		bytes_in = child_in.bytes();
+		seconds_blocked = child_in.blocked_seconds();
+		spliced = child_in.zero_copy();
+		seconds_in = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 	});
 
-	thread reader([&child, &queue, &options]() {
+	thread reader([&]() {
+		// Time spent waiting for output of the child, which is everything but
+		// waiting for the queue and writing the output.
+		auto wait_start = chrono::steady_clock::now();
+		auto add_waited = [&stats, &wait_start]() {
+			if (stats)
+				stats->AddReaderBlocked(chrono::duration<double>(chrono::steady_clock::now() - wait_start).count());
+		};
+
 		util::FileStream out(STDOUT_FILENO);
+
+		// Reads the first bit of output already
 		util::FilePiece child_out(child.out.release());
+		add_waited();
 
-		deque<string> delimiters;
+		wrapped_sentence wrapped;
 		string sentence;
 
-		for (size_t sentence_num = 1; queue.Consume(delimiters).size() > 0; ++sentence_num) {
+		// With -b, the lines of the current batch back in their original
+		// order, and the next one to use.
+		vector<string> batch;
+		size_t batch_pos = 0;
+		vector<uint32_t> order;
+
+		auto read_line = [&]() -> StringPiece {
+			if (options.batch_size == 0) {
+				StringPiece line(child_out.ReadLine());
+				bytes_out += line.length() + 1;
+				return line;
+			}
+
+			if (batch_pos == batch.size()) {
+				order_queue.Consume(order);
+				batch.resize(order.size());
+
+				for (uint32_t i : order) {
+					StringPiece line(child_out.ReadLine());
+					batch[i].assign(line.data(), line.length());
+					bytes_out += line.length() + 1;
+				}
+
+				batch_pos = 0;
+			}
+
+			return batch[batch_pos++];
+		};
+
+		for (size_t sentence_num = 1; queue.Consume(wrapped).line_cnt > 0; ++sentence_num) {
 			sentence.clear();
 			
 			// Let's assume that the wrapped process plus the chopped off
 			// delimiters won't be more than twice the input we give it.
-			sentence.reserve(delimiters.size() * 2 * options.column_width);
+			sentence.reserve(wrapped.line_cnt * 2 * options.column_width);
+
+			uint64_t bytes = bytes_out;
+
+			if (stats)
+				wait_start = chrono::steady_clock::now();
 
 			try {
-				while (!delimiters.empty()) {
-					StringPiece line(child_out.ReadLine());
+				for (size_t i = 0; i < wrapped.line_cnt; ++i) {
+					StringPiece line(read_line());
 					sentence.append(line.data(), line.length());
-					sentence.append(delimiters.front());
-					delimiters.pop_front();
+
+					if (!wrapped.delimiter_ends.empty()) {
+						size_t delimiter_begin = i > 0 ? wrapped.delimiter_ends[i - 1] : 0;
+						sentence.append(wrapped.delimiters, delimiter_begin, wrapped.delimiter_ends[i] - delimiter_begin);
+					}
 				}
 			} catch (util::EndOfFileException &e) {
 				UTIL_THROW(util::Exception, "Sub-process stopped producing while expecting more lines for sentence " << sentence_num << ".");
 			}
 
+			if (stats) {
+				add_waited();
+				stats->AddOutput(bytes_out - bytes, wrapped.line_cnt);
+				stats->AddLatency(chrono::steady_clock::now() - wrapped.queued);
+			}
+
 			// Yes, this might introduce a newline at the end of the file, but
 			// yes that is what we generally want in our pipeline because we
 			// might concatenate all these files and that will mess up if they
@@ -297,7 +411,11 @@ int main(int argc, char **argv) {
 				// If peek throws EOF now our sub-process stopped before its
 				// stdin was closed (producer produces the poison before it
 				// closes the sub-process's stdin.)
+				if (stats)
+					wait_start = chrono::steady_clock::now();
+
 				child_out.peek();
+				add_waited();
 				
 				// peek() came back. We have a line-number now, right? If not
 				// sub-process is producing output without any input to base it
@@ -316,6 +434,17 @@ int main(int argc, char **argv) {
 	// everything.
 	feeder.join();
 	reader.join();
+
+	if (stats)
+		stats->Stop();
+
+	if (options.verbose) {
+		seconds_out = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		print_throughput(cerr, "to command", bytes_in, seconds_in);
+		cerr << ", " << setprecision(2) << seconds_blocked << "s blocked on a full pipe" << (spliced ? ", vmsplice" : "") << '\n';
+		print_throughput(cerr, "from command", bytes_out, seconds_out);
+		cerr << '\n';
+	}
 	
 	return retval;
 }
@@ -0,0 +1,258 @@
+#include "block_file.h"
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+#include <zlib.h>
+#include "util/exception.hh"
+
+using namespace std;
+
+namespace bitextor {
+
+namespace {
+
+char const HEADER_MAGIC[8] = {'D', 'O', 'C', 'B', 'L', 'K', '1', '\n'};
+
+char const FOOTER_MAGIC[8] = {'D', 'O', 'C', 'I', 'D', 'X', '1', '\n'};
+
+struct Footer {
+	uint64_t documents_per_block;
+	uint64_t document_cnt;
+	uint64_t block_cnt;
+	char magic[8];
+};
+
+// Reads size bytes at offset. Returns how many there were, which is less than
+// size only at the end of the file.
+size_t PReadOrEOF(int fd, void *to, size_t size, uint64_t offset) {
+	char *out = static_cast<char *>(to);
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t ret = pread(fd, out + done, size - done, offset + done);
+
+		if (ret == 0)
+			break;
+
+		UTIL_THROW_IF(ret < 0, util::ErrnoException, "Could not read from file");
+		done += ret;
+	}
+
+	return done;
+}
+
+} // namespace
+
+BlockFileWriter::BlockFileWriter(int fd, size_t documents_per_block)
+: fd_(fd),
+  documents_per_block_(max<size_t>(documents_per_block, 1)),
+  document_cnt_(0),
+  offset_(sizeof(HEADER_MAGIC)),
+  block_document_cnt_(0) {
+	util::WriteOrThrow(fd_, HEADER_MAGIC, sizeof(HEADER_MAGIC));
+}
+
+void BlockFileWriter::Add(StringPiece const &document) {
+	block_.append(document.data(), document.size());
+	block_.push_back('\n');
+	++document_cnt_;
+
+	if (++block_document_cnt_ == documents_per_block_)
+		WriteBlock();
+}
+
+void BlockFileWriter::WriteBlock() {
+	uLongf compressed_size = compressBound(block_.size());
+	compressed_.resize(compressed_size);
+
+	int ret = compress2(reinterpret_cast<Bytef *>(compressed_.data()), &compressed_size,
+		reinterpret_cast<Bytef const *>(block_.data()), block_.size(), Z_DEFAULT_COMPRESSION);
+	UTIL_THROW_IF(ret != Z_OK, util::Exception, "Could not compress block: zlib error " << ret);
+
+	util::WriteOrThrow(fd_, compressed_.data(), compressed_size);
+
+	index_.push_back(BlockIndexEntry{offset_, block_.size()});
+	offset_ += compressed_size;
+
+	block_.clear();
+	block_document_cnt_ = 0;
+}
+
+void BlockFileWriter::Finish() {
+	if (block_document_cnt_ > 0)
+		WriteBlock();
+
+	util::WriteOrThrow(fd_, index_.data(), index_.size() * sizeof(BlockIndexEntry));
+
+	Footer footer{documents_per_block_, document_cnt_, index_.size(), {}};
+	memcpy(footer.magic, FOOTER_MAGIC, sizeof(FOOTER_MAGIC));
+	util::WriteOrThrow(fd_, &footer, sizeof(footer));
+}
+
+BlockFileReader::BlockFileReader(int fd, string const &name)
+: fd_(fd),
+  name_(name),
+  block_index_(-1),
+  pos_(0),
+  next_document_(0) {
+	uint64_t file_size = util::SizeOrThrow(fd_.get());
+
+	Footer footer;
+	UTIL_THROW_IF(file_size < sizeof(HEADER_MAGIC) + sizeof(Footer)
+		|| PReadOrEOF(fd_.get(), &footer, sizeof(footer), file_size - sizeof(footer)) != sizeof(footer)
+		|| memcmp(footer.magic, FOOTER_MAGIC, sizeof(FOOTER_MAGIC)) != 0
+		|| footer.documents_per_block == 0
+		|| file_size - sizeof(HEADER_MAGIC) - sizeof(Footer) < footer.block_cnt * sizeof(BlockIndexEntry),
+		util::Exception, name_ << " is not a complete block file");
+
+	// Every block is full, except for maybe the last one
+	UTIL_THROW_IF(footer.document_cnt / footer.documents_per_block + (footer.document_cnt % footer.documents_per_block != 0) != footer.block_cnt,
+		util::Exception, name_ << " has " << footer.block_cnt << " blocks, which cannot hold " << footer.document_cnt << " documents");
+
+	documents_per_block_ = footer.documents_per_block;
+	document_cnt_ = footer.document_cnt;
+	index_offset_ = file_size - sizeof(footer) - footer.block_cnt * sizeof(BlockIndexEntry);
+
+	index_.resize(footer.block_cnt);
+	UTIL_THROW_IF(PReadOrEOF(fd_.get(), index_.data(), index_.size() * sizeof(BlockIndexEntry), index_offset_) != index_.size() * sizeof(BlockIndexEntry),
+		util::Exception, name_ << " is not a complete block file");
+
+	// The blocks have to follow each other between the header and the index.
+	// zlib does not compress more than 1032:1, so neither can they.
+	for (uint64_t block = 0; block < index_.size(); ++block) {
+		uint64_t begin = index_[block].offset;
+		uint64_t end = block + 1 < index_.size() ? index_[block + 1].offset : index_offset_;
+
+		UTIL_THROW_IF(begin < sizeof(HEADER_MAGIC) || begin > end || end > index_offset_
+			|| index_[block].size / 1032 > end - begin,
+			util::Exception, name_ << " has a corrupt block index");
+	}
+}
+
+bool BlockFileReader::Detect(int fd) {
+	char magic[sizeof(HEADER_MAGIC)];
+	ssize_t ret = pread(fd, magic, sizeof(magic), 0);
+	return ret == sizeof(magic) && memcmp(magic, HEADER_MAGIC, sizeof(magic)) == 0;
+}
+
+void BlockFileReader::LoadBlock(uint64_t block) {
+	if (block == block_index_)
+		return;
+
+	BlockIndexEntry const &entry = index_[block];
+	uint64_t end = block + 1 < index_.size() ? index_[block + 1].offset : index_offset_;
+
+	compressed_.resize(end - entry.offset);
+	UTIL_THROW_IF(PReadOrEOF(fd_.get(), compressed_.data(), compressed_.size(), entry.offset) != compressed_.size(),
+		util::Exception, name_ << " is truncated");
+
+	block_.resize(entry.size);
+	uLongf size = block_.size();
+	int ret = uncompress(reinterpret_cast<Bytef *>(block_.data()), &size,
+		reinterpret_cast<Bytef const *>(compressed_.data()), compressed_.size());
+	UTIL_THROW_IF(ret != Z_OK || size != entry.size, util::Exception, name_ << " has a corrupt block " << block);
+
+	block_index_ = block;
+	pos_ = 0;
+}
+
+void BlockFileReader::Seek(uint64_t index) {
+	UTIL_THROW_IF(index > document_cnt_, util::Exception, "Document " << index << " is beyond the end of " << name_);
+
+	next_document_ = index;
+
+	if (index == document_cnt_)
+		return;
+
+	LoadBlock(index / documents_per_block_);
+
+	// Find the document in its block
+	pos_ = 0;
+	for (uint64_t skip = index % documents_per_block_; skip > 0; --skip) {
+		char const *newline = static_cast<char const *>(memchr(block_.data() + pos_, '\n', block_.size() - pos_));
+		UTIL_THROW_IF(!newline, util::Exception, name_ << " has fewer documents in block " << block_index_ << " than expected");
+		pos_ = newline - block_.data() + 1;
+	}
+}
+
+bool BlockFileReader::ReadLineOrEOF(StringPiece &line) {
+	if (next_document_ == document_cnt_)
+		return false;
+
+	// Start of a new block?
+	if (next_document_ % documents_per_block_ == 0)
+		LoadBlock(next_document_ / documents_per_block_);
+
+	char const *begin = block_.data() + pos_;
+	char const *newline = static_cast<char const *>(memchr(begin, '\n', block_.size() - pos_));
+	UTIL_THROW_IF(!newline, util::Exception, name_ << " has fewer documents in block " << block_index_ << " than expected");
+
+	line = StringPiece(begin, newline - begin);
+	pos_ = newline - block_.data() + 1;
+	++next_document_;
+	return true;
+}
+
+DocumentReader::DocumentReader(string const &path, IndexUse index)
+: name_(path) {
+	int fd = util::OpenReadOrThrow(path.c_str());
+	string index_path(path + ".idx");
+
+	// An index that is missing, or made for an older version of the file, for
+	// example one that has grown since, is no reason not to read it.
+	if (index == USE_INDEX && !BlockFileReader::Detect(fd) && LineIndex::Matches(path, index_path)) {
+		index_.reset(new LineIndex(path, index_path));
+		indexed_.reset(new IndexedLineReader(fd, *index_));
+	} else {
+		Open(fd);
+	}
+}
+
+DocumentReader::DocumentReader(int fd, string const &name)
+: name_(name) {
+	Open(fd);
+}
+
+void DocumentReader::Open(int fd) {
+	if (BlockFileReader::Detect(fd))
+		block_.reset(new BlockFileReader(fd, name_));
+	else
+		piece_.reset(new util::FilePiece(fd, name_.c_str()));
+}
+
+bool DocumentReader::ReadLineOrEOF(StringPiece &line, char delim, bool strip_cr) {
+	if (block_ || indexed_)
+		UTIL_THROW_IF(delim != '\n', util::Exception, name_ << " can only be read one line at a time");
+
+	if (block_)
+		return block_->ReadLineOrEOF(line);
+	else if (indexed_)
+		return indexed_->ReadLineOrEOF(line);
+	else
+		return piece_->ReadLineOrEOF(line, delim, strip_cr);
+}
+
+size_t DocumentReader::Skip(size_t n) {
+	if (block_) {
+		uint64_t target = min<uint64_t>(block_->Tell() + n, block_->size());
+		size_t skipped = target - block_->Tell();
+		block_->Seek(target);
+		return skipped;
+	}
+
+	if (indexed_) {
+		uint64_t target = min<uint64_t>(indexed_->Tell() + n, indexed_->size());
+		size_t skipped = target - indexed_->Tell();
+		indexed_->Seek(target);
+		return skipped;
+	}
+
+	StringPiece line;
+	for (size_t i = 0; i < n; ++i)
+		if (!piece_->ReadLineOrEOF(line))
+			return i;
+
+	return n;
+}
+
+} // namespace bitextor
@@ -0,0 +1,152 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "util/file.hh"
+#include "util/file_piece.hh"
+#include "util/string_piece.hh"
+#include "line_index.h"
+
+namespace bitextor {
+
+/*
+ * Seekable container for documents, one per line as in the other formats the
+ * tools read. Documents are stored in blocks of a fixed number of documents
+ * that are each compressed with zlib on their own, followed by an index with
+ * the offset of every block. Reading document i only needs its block to be
+ * read and decompressed.
+ *
+ * Layout: a header with a magic string, the blocks, the index entries and a
+ * footer with the number of blocks and documents and another magic string.
+ */
+
+// Index entry of a block
+struct BlockIndexEntry {
+	// Position in the file
+	uint64_t offset;
+
+	// Size after decompression
+	uint64_t size;
+};
+
+/**
+ * Writes documents as a block file.
+ */
+class BlockFileWriter {
+public:
+	// Writes to fd, which is not closed.
+	BlockFileWriter(int fd, size_t documents_per_block);
+
+	// Adds a document, without its newline
+	void Add(StringPiece const &document);
+
+	// Writes the last block and the index. The file is not complete without.
+	void Finish();
+
+private:
+	void WriteBlock();
+
+	int fd_;
+	size_t documents_per_block_;
+	uint64_t document_cnt_;
+	uint64_t offset_;
+	std::string block_;
+	size_t block_document_cnt_;
+	std::vector<char> compressed_;
+	std::vector<BlockIndexEntry> index_;
+};
+
+/**
+ * Reads a file written by BlockFileWriter.
+ */
+class BlockFileReader {
+public:
+	// Takes ownership of fd
+	explicit BlockFileReader(int fd, std::string const &name = "");
+
+	// Whether the file behind fd is a block file. Only looks at the header,
+	// which it reads without moving the file position. False for pipes.
+	static bool Detect(int fd);
+
+	// Number of documents
+	uint64_t size() const {
+		return document_cnt_;
+	}
+
+	// Moves to document index, starting at 0, so that it is what
+	// ReadLineOrEOF reads next. Index size() is the end of the file.
+	void Seek(uint64_t index);
+
+	// Index of the document ReadLineOrEOF reads next
+	uint64_t Tell() const {
+		return next_document_;
+	}
+
+	// Reads the next document. Returns false at the end of the file.
+	bool ReadLineOrEOF(StringPiece &line);
+
+private:
+	void LoadBlock(uint64_t block);
+
+	util::scoped_fd fd_;
+	std::string name_;
+	uint64_t documents_per_block_;
+	uint64_t document_cnt_;
+	std::vector<BlockIndexEntry> index_;
+	uint64_t index_offset_;
+	std::vector<char> compressed_;
+
+	// Decompressed contents of the current block, and the position of the
+	// next document in it.
+	std::vector<char> block_;
+	uint64_t block_index_;
+	size_t pos_;
+	uint64_t next_document_;
+};
+
+/**
+ * Reads documents from either a block file or anything util::FilePiece can
+ * read (plain, gzip, xz, ...), whichever the file turns out to be. Block
+ * files, and plain and gzip files with a FILE.idx index next to them (see
+ * LineIndex), can skip to any document without reading the ones before it.
+ */
+class DocumentReader {
+public:
+	enum IndexUse {
+		USE_INDEX,
+		NO_INDEX
+	};
+
+	// Uses path + ".idx" if it matches the file as it is now, otherwise reads
+	// through the file.
+	explicit DocumentReader(std::string const &path, IndexUse index = USE_INDEX);
+
+	// Takes ownership of fd
+	explicit DocumentReader(int fd, std::string const &name = "");
+
+	bool ReadLineOrEOF(StringPiece &line, char delim = '\n', bool strip_cr = true);
+
+	// Skips n documents. Returns how many there were to skip.
+	size_t Skip(size_t n);
+
+	// Whether Skip() takes constant time
+	bool Seekable() const {
+		return block_ || indexed_;
+	}
+
+	std::string const &FileName() const {
+		return name_;
+	}
+
+private:
+	void Open(int fd);
+
+	std::string name_;
+	std::unique_ptr<BlockFileReader> block_;
+	std::unique_ptr<LineIndex> index_;
+	std::unique_ptr<IndexedLineReader> indexed_;
+	std::unique_ptr<util::FilePiece> piece_;
+};
+
+} // namespace bitextor
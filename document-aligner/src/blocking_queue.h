@@ -3,12 +3,17 @@
 #include <mutex>
 #include <condition_variable>
 #include <ostream>
+#include <vector>
 
 namespace bitextor {
 
 struct queue_performance {
 	size_t overflow;
 	size_t underflow;
+
+	// How often the queue held n items right after a push, for n in
+	// [1, capacity]. Index 0 is unused.
+	std::vector<size_t> occupancy;
 };
 
 template <typename T> class blocking_queue
@@ -32,7 +37,7 @@ private:
 template <typename T> blocking_queue<T>::blocking_queue(size_t size)
 :
 	_size(size),
-	_performance{0,0} {
+	_performance{0, 0, std::vector<size_t>(size + 1, 0)} {
 	//
 }
 
@@ -45,6 +50,7 @@ template <typename T> void blocking_queue<T>::push(T &&item) {
 	}
 
 	_buffer.push(std::move(item));
+	++_performance.occupancy[_buffer.size()];
 	mlock.unlock();
 	_added.notify_one();
 }
@@ -58,6 +64,7 @@ template <typename T> void blocking_queue<T>::push(T const &item) {
 	}
 	
 	_buffer.push(item);
+	++_performance.occupancy[_buffer.size()];
 	mlock.unlock();
 	_added.notify_one();
 }
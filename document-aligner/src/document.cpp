@@ -1,6 +1,7 @@
 #include "document.h"
 #include "base64.h"
 #include "ngram.h"
+#include "murmur_hash.h"
 #include <sstream>
 #include <iostream>
 #include <cmath>
@@ -9,53 +10,119 @@ using namespace std;
 
 namespace bitextor {
 
+namespace {
+
+template <size_t N, typename NGramT> void count_ngrams(StringPiece const &body, unordered_map<NGramT, size_t> &vocab)
+{
+	for (FixedNGramIter<N> ngram_it(body); ngram_it; ++ngram_it)
+		vocab[fold_ngram<NGramT>(*ngram_it)] += 1;
+}
+
+template <typename NGramT> void count_ngrams(StringPiece const &body, unordered_map<NGramT, size_t> &vocab, size_t ngram_size)
+{
+	// The ngram sizes that are used in practice have a specialised iterator,
+	// anything else falls back to NGramIter.
+	typedef void (*count_ngrams_fn)(StringPiece const &, unordered_map<NGramT, size_t> &);
+
+	static const count_ngrams_fn fixed_size[] = {
+		nullptr,
+		&count_ngrams<1, NGramT>,
+		&count_ngrams<2, NGramT>,
+		&count_ngrams<3, NGramT>,
+		&count_ngrams<4, NGramT>,
+		&count_ngrams<5, NGramT>
+	};
+
+	if (ngram_size > 0 && ngram_size < sizeof(fixed_size) / sizeof(fixed_size[0]))
+		return fixed_size[ngram_size](body, vocab);
+
+	for (NGramIter ngram_it(body, ngram_size); ngram_it; ++ngram_it)
+		vocab[fold_ngram<NGramT>(*ngram_it)] += 1;
+}
+
+} // namespace
+
 /**
  * Reads a single line of base64 encoded document into a Document.
  */
-void ReadDocument(const StringPiece &encoded, Document &document, size_t ngram_size)
+template <typename NGramT> void ReadDocument(const StringPiece &encoded, BasicDocument<NGramT> &document, size_t ngram_size)
 {
 	std::string body;
 	base64_decode(encoded, body);
 
 	document.vocab.clear();
-	for (NGramIter ngram_it(body, ngram_size); ngram_it; ++ngram_it)
-		document.vocab[*ngram_it] += 1;
+	count_ngrams(body, document.vocab, ngram_size);
+}
+
+/**
+ * Reads a document counting ngrams of several sizes. With a single size this
+ * is the same as the function above.
+ */
+template <typename NGramT> void ReadDocument(const StringPiece &encoded, BasicDocument<NGramT> &document, vector<size_t> const &ngram_sizes)
+{
+	if (ngram_sizes.size() == 1)
+		return ReadDocument(encoded, document, ngram_sizes.front());
+
+	std::string body;
+	base64_decode(encoded, body);
+
+	document.vocab.clear();
+	for (MultiNGramIter ngram_it(body, ngram_sizes); ngram_it; ++ngram_it)
+		document.vocab[fold_ngram<NGramT>(*ngram_it)] += 1;
 }
 	
+namespace {
+
 inline float tfidf(size_t tf, size_t dc, size_t df) {
 	// Note: Matches tf_smooth setting 14 (2 for TF and 2 for IDF) of the python implementation
 	return logf(tf + 1) * logf(dc / (1.0f + df));
 }
 	
+template <typename NGramT> NGramT const &entry_ngram(pair<NGramT const, size_t> const &entry) {
+	return entry.first;
+}
+
+template <typename NGramT> size_t entry_count(pair<NGramT const, size_t> const &entry) {
+	return entry.second;
+}
+
+NGram entry_ngram(NGramCount const &entry) {
+	return NGram{entry.hash};
+}
+
+size_t entry_count(NGramCount const &entry) {
+	return entry.count;
+}
+
 /**
  * Calculate TF/DF based on how often an ngram occurs in this document and how often it occurs at least once
  * across all documents. Only terms that are seen in this document and in the document frequency table are
- * counted. All other terms are ignored.
+ * counted. All other terms are ignored. The entries of the document are the ngram counts in [begin, end).
 */
-void calculate_tfidf(Document const &document, DocumentRef &document_ref, size_t document_count, unordered_map<NGram, size_t> const &df) {
-	document_ref.id = document.id;
+template <typename NGramT, typename Iterator> void calculate_tfidf_entries(size_t id, Iterator begin, Iterator end, size_t size, BasicDocumentRef<NGramT> &document_ref, size_t document_count, unordered_map<NGramT, size_t> const &df) {
+	document_ref.id = id;
 
 	document_ref.wordvec.clear();
-	document_ref.wordvec.reserve(document.vocab.size());
+	document_ref.wordvec.reserve(size);
 	
 	float total_tfidf_l2 = 0;
 	
-	for (auto const &entry : document.vocab) {
+	for (Iterator entry = begin; entry != end; ++entry) {
 		// How often does the term occur in the whole dataset?
-		auto it = df.find(entry.first);
+		auto it = df.find(entry_ngram(*entry));
 
 		// Skip words that are not in the document frequency map entirely.
 		// (Matches Python implementation)
 		if (it == df.end())
 			continue;
 	
-		float document_tfidf = tfidf(entry.second, document_count, it->second);
+		float document_tfidf = tfidf(entry_count(*entry), document_count, it->second);
 		
 		// Keep track of the squared sum of all values for L2 normalisation
 		total_tfidf_l2 += document_tfidf * document_tfidf;
 		
-		document_ref.wordvec.push_back(WordScore{
-			.hash = entry.first,
+		document_ref.wordvec.push_back(BasicWordScore<NGramT>{
+			.hash = it->first,
 			.tfidf = document_tfidf
 		});
 	}
@@ -66,4 +133,57 @@ void calculate_tfidf(Document const &document, DocumentRef &document_ref, size_t
 		entry.tfidf /= total_tfidf_l2;
 }
 
+} // namespace
+
+template <typename NGramT> void calculate_tfidf(BasicDocument<NGramT> const &document, BasicDocumentRef<NGramT> &document_ref, size_t document_count, unordered_map<NGramT, size_t> const &df) {
+	calculate_tfidf_entries(document.id, document.vocab.begin(), document.vocab.end(), document.vocab.size(), document_ref, document_count, df);
+}
+
+void calculate_tfidf(size_t id, NGramCount const *begin, NGramCount const *end, DocumentRef &document_ref, size_t document_count, unordered_map<NGram, size_t> const &df) {
+	calculate_tfidf_entries(id, begin, end, end - begin, document_ref, document_count, df);
+}
+
+template <typename NGramT> size_t score_document(BasicDocumentRef<NGramT> const &document, BasicNGramIndex<NGramT> const &index, unordered_map<size_t, float> &scores) {
+	size_t postings_cnt = 0;
+
+	for (auto const &word_score : document.wordvec) {
+		auto it = index.find(word_score.hash);
+
+		if (it == index.end())
+			continue;
+
+		postings_cnt += it->second.size();
+
+		for (auto const &ref_score : it->second)
+			scores[ref_score.doc_id] += word_score.tfidf * ref_score.tfidf;
+	}
+
+	return postings_cnt;
+}
+
+template <typename NGramT> uint64_t hash_vocab(BasicDocument<NGramT> const &document) {
+	// A sum, because the order of vocab depends on how it was filled
+	uint64_t sum = 0;
+
+	for (auto const &entry : document.vocab)
+		sum += MurmurHashCombine(entry.first.hash, entry.second);
+
+	return MurmurHashCombine(sum, document.vocab.size());
+}
+
+template void ReadDocument(const StringPiece &, BasicDocument<NGram> &, size_t);
+template void ReadDocument(const StringPiece &, BasicDocument<NGram32> &, size_t);
+
+template void ReadDocument(const StringPiece &, BasicDocument<NGram> &, vector<size_t> const &);
+template void ReadDocument(const StringPiece &, BasicDocument<NGram32> &, vector<size_t> const &);
+
+template void calculate_tfidf(BasicDocument<NGram> const &, BasicDocumentRef<NGram> &, size_t, unordered_map<NGram, size_t> const &);
+template void calculate_tfidf(BasicDocument<NGram32> const &, BasicDocumentRef<NGram32> &, size_t, unordered_map<NGram32, size_t> const &);
+
+template size_t score_document(BasicDocumentRef<NGram> const &, BasicNGramIndex<NGram> const &, unordered_map<size_t, float> &);
+template size_t score_document(BasicDocumentRef<NGram32> const &, BasicNGramIndex<NGram32> const &, unordered_map<size_t, float> &);
+
+template uint64_t hash_vocab(BasicDocument<NGram> const &);
+template uint64_t hash_vocab(BasicDocument<NGram32> const &);
+
 } // namespace bitextor
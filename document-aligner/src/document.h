@@ -1,36 +1,79 @@
 #pragma once
 #include "util/string_piece.hh"
 #include "ngram.h"
+#include <cstdint>
 #include <istream>
 #include <unordered_map>
 #include <vector>
 
 namespace bitextor {
 
-struct WordScore {
-	NGram hash;
+// The structures below are templated on the ngram hash type, NGram or
+// NGram32. They are instantiated for both in document.cpp.
+
+template <typename NGramT> struct BasicWordScore {
+	NGramT hash;
 	float tfidf;
 };
 
-struct Document {
+template <typename NGramT> struct BasicDocument {
 	// Document offset, used as identifier
 	size_t id;
 	
 	// ngram frequency in document
-	std::unordered_map<NGram, size_t> vocab;
+	std::unordered_map<NGramT, size_t> vocab;
 };
 
-struct DocumentRef {
+template <typename NGramT> struct BasicDocumentRef {
 	// Document offset, used as identifier
 	size_t id;
 	
 	// ngram scores as a sorted array for quick sparse dot product
-	std::vector<WordScore> wordvec;
+	std::vector<BasicWordScore<NGramT>> wordvec;
+};
+
+// An ngram and how often it occurs in a document, as stored on disk
+struct NGramCount {
+	uint64_t hash;
+	uint64_t count;
+};
+
+// Posting of an ngram in an index: a document it occurs in and its weight
+struct DocumentNGramScore {
+	size_t doc_id;
+	float tfidf;
 };
 
+// Index from ngram to the documents it occurs in
+template <typename NGramT> using BasicNGramIndex = std::unordered_map<NGramT, std::vector<DocumentNGramScore>>;
+
+typedef BasicWordScore<NGram> WordScore;
+
+typedef BasicDocument<NGram> Document;
+
+typedef BasicDocumentRef<NGram> DocumentRef;
+
+typedef BasicNGramIndex<NGram> NGramIndex;
+
 // Assumes base64 encoded still.
-void ReadDocument(const StringPiece &encoded, Document &to, size_t ngram_size);
+template <typename NGramT> void ReadDocument(const StringPiece &encoded, BasicDocument<NGramT> &to, size_t ngram_size);
+
+// Same, but counts the ngrams of all sizes in ngram_sizes (sorted, unique)
+template <typename NGramT> void ReadDocument(const StringPiece &encoded, BasicDocument<NGramT> &to, std::vector<size_t> const &ngram_sizes);
+
+template <typename NGramT> void calculate_tfidf(BasicDocument<NGramT> const &document, BasicDocumentRef<NGramT> &document_ref, size_t document_count, std::unordered_map<NGramT, size_t> const &df);
+
+// Same, for the document with this id stored as the ngram counts in [begin,
+// end). In the order of its vocab, that gives the same vector.
+void calculate_tfidf(size_t id, NGramCount const *begin, NGramCount const *end, DocumentRef &document_ref, size_t document_count, std::unordered_map<NGram, size_t> const &df);
+
+// Adds the dot product of document with each indexed document it shares an
+// ngram with to scores, by indexed document id. Returns the number of postings
+// visited.
+template <typename NGramT> size_t score_document(BasicDocumentRef<NGramT> const &document, BasicNGramIndex<NGramT> const &index, std::unordered_map<size_t, float> &scores);
 
-void calculate_tfidf(Document const &document, DocumentRef &document_ref, size_t document_count, std::unordered_map<NGram, size_t> const &df);
+// Hash of the ngrams in document and how often each occurs, independent of
+// their order. Documents with the same ngram bag get the same TF/IDF vector.
+template <typename NGramT> uint64_t hash_vocab(BasicDocument<NGramT> const &document);
 
 } // namespace bitextor
@@ -0,0 +1,160 @@
+#include "filter_stats.h"
+#include <algorithm>
+#include <iomanip>
+
+using namespace std;
+
+namespace bitextor {
+
+namespace {
+
+// Writes the upper bound of latency bucket i, e.g. "<4.1ms"
+void print_bucket(ostream &out, size_t bucket) {
+	out << '<' << fixed << setprecision(1) << (uint64_t(1) << bucket) / 1000.0 << "ms";
+}
+
+} // namespace
+
+constexpr size_t FilterStats::LATENCY_BUCKETS;
+
+FilterStats::FilterStats(ostream &out, double interval, char const *unit)
+: out_(out),
+  interval_(interval),
+  unit_(unit),
+  start_(clock::now()),
+  bytes_in_(0),
+  lines_in_(0),
+  bytes_out_(0),
+  lines_out_(0),
+  feeder_blocked_(0),
+  reader_blocked_(0),
+  stopped_(false) {
+	for (auto &bucket : latency_)
+		bucket.store(0, memory_order_relaxed);
+
+	thread_ = thread(&FilterStats::Run, this);
+}
+
+FilterStats::~FilterStats() {
+	Stop();
+}
+
+void FilterStats::AddLatency(clock::duration latency) {
+	uint64_t microseconds = chrono::duration_cast<chrono::microseconds>(latency).count();
+
+	size_t bucket = 0;
+	while (bucket + 1 < LATENCY_BUCKETS && microseconds >= (uint64_t(1) << bucket))
+		++bucket;
+
+	latency_[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+void FilterStats::AddQueue(function<size_t()> max_depth) {
+	lock_guard<mutex> lock(mutex_);
+	queues_.push_back(max_depth);
+}
+
+void FilterStats::Stop() {
+	{
+		lock_guard<mutex> lock(mutex_);
+		if (stopped_)
+			return;
+		stopped_ = true;
+	}
+
+	stop_.notify_all();
+	thread_.join();
+
+	Report("total", Read(), Totals(), chrono::duration<double>(clock::now() - start_).count());
+	out_.flush();
+}
+
+FilterStats::Totals FilterStats::Read() const {
+	Totals totals;
+	totals.bytes_in = bytes_in_.load(memory_order_relaxed);
+	totals.lines_in = lines_in_.load(memory_order_relaxed);
+	totals.bytes_out = bytes_out_.load(memory_order_relaxed);
+	totals.lines_out = lines_out_.load(memory_order_relaxed);
+	totals.feeder_blocked = feeder_blocked_.load(memory_order_relaxed);
+	totals.reader_blocked = reader_blocked_.load(memory_order_relaxed);
+
+	for (size_t i = 0; i < LATENCY_BUCKETS; ++i)
+		totals.latency[i] = latency_[i].load(memory_order_relaxed);
+
+	return totals;
+}
+
+void FilterStats::Report(char const *label, Totals const &now, Totals const &since, double seconds) {
+	auto per_second = [seconds](uint64_t value) {
+		return seconds > 0 ? value / seconds : 0.0;
+	};
+
+	out_ << "stats " << label << (*label ? " " : "") << fixed << setprecision(1) << seconds << "s: "
+	     << "to command " << setprecision(0) << per_second(now.lines_in - since.lines_in) << " lines/s "
+	     << setprecision(1) << per_second(now.bytes_in - since.bytes_in) / 1000000.0 << " MB/s, "
+	     << "from command " << setprecision(0) << per_second(now.lines_out - since.lines_out) << " lines/s "
+	     << setprecision(1) << per_second(now.bytes_out - since.bytes_out) / 1000000.0 << " MB/s, "
+	     << setprecision(2)
+	     << "feeder blocked " << (now.feeder_blocked - since.feeder_blocked) / 1e9 << "s, "
+	     << "reader blocked " << (now.reader_blocked - since.reader_blocked) / 1e9 << "s, ";
+
+	array<uint64_t, LATENCY_BUCKETS> latency;
+	uint64_t documents = 0;
+	for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+		latency[i] = now.latency[i] - since.latency[i];
+		documents += latency[i];
+	}
+
+	if (documents > 0) {
+		out_ << "latency";
+
+		// The bucket that the document at each percentile falls in
+		for (auto percentile : {make_pair("p50", 50), make_pair("p90", 90), make_pair("p99", 99), make_pair("max", 100)}) {
+			uint64_t rank = max<uint64_t>(1, (documents * percentile.second + 99) / 100);
+			uint64_t seen = 0;
+			size_t bucket = 0;
+
+			while ((seen += latency[bucket]) < rank)
+				++bucket;
+
+			out_ << ' ' << percentile.first << ' ';
+			print_bucket(out_, bucket);
+		}
+
+		out_ << " over " << documents << ' ' << unit_ << ", ";
+	} else {
+		out_ << "no " << unit_ << ", ";
+	}
+
+	size_t max_depth = 0;
+	{
+		lock_guard<mutex> lock(mutex_);
+		for (auto const &queue : queues_)
+			max_depth = max(max_depth, queue());
+	}
+
+	out_ << "max queue depth " << max_depth << '\n';
+}
+
+void FilterStats::Run() {
+	Totals since(Read());
+	clock::time_point last = start_;
+
+	unique_lock<mutex> lock(mutex_);
+
+	while (!stop_.wait_for(lock, interval_, [this]() { return stopped_; })) {
+		lock.unlock();
+
+		Totals now(Read());
+		clock::time_point time = clock::now();
+		Report("", now, since, chrono::duration<double>(time - last).count());
+		out_.flush();
+
+		since = now;
+		last = time;
+
+		lock.lock();
+	}
+}
+
+} // namespace bitextor
@@ -0,0 +1,126 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+namespace bitextor {
+
+// How often --stats reports when no interval is given
+constexpr double DEFAULT_STATS_INTERVAL = 10.0;
+
+/**
+ * Counters behind the --stats option of b64filter and foldfilter. The feeder
+ * and reader threads add to them, and a thread of its own writes what happened
+ * in the last interval to out every interval seconds. Stop() writes a last
+ * report of the whole run.
+ *
+ * A report looks like:
+ *
+ *   stats 10.0s: to command 51234 lines/s 6.1 MB/s, from command 51230 lines/s
+ *   6.3 MB/s, feeder blocked 0.02s, reader blocked 9.71s, latency p50 <2.0ms
+ *   p90 <4.1ms p99 <16.4ms max <32.8ms over 5120 documents, max queue depth 12
+ *
+ * but on a single line. Latencies are rounded up to a power of two
+ * microseconds. The queue depth is the highest since the start.
+ */
+class FilterStats {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	// Does not take ownership of out, which must outlive this. unit is what
+	// latency is measured of, e.g. "documents".
+	FilterStats(std::ostream &out, double interval, char const *unit);
+
+	// Stops
+	~FilterStats();
+
+	// Data written to the command
+	void AddInput(uint64_t bytes, uint64_t lines) {
+		bytes_in_.fetch_add(bytes, std::memory_order_relaxed);
+		lines_in_.fetch_add(lines, std::memory_order_relaxed);
+	}
+
+	// Data read from the command
+	void AddOutput(uint64_t bytes, uint64_t lines) {
+		bytes_out_.fetch_add(bytes, std::memory_order_relaxed);
+		lines_out_.fetch_add(lines, std::memory_order_relaxed);
+	}
+
+	// Time the feeder waited for the command to read its input
+	void AddFeederBlocked(double seconds) {
+		feeder_blocked_.fetch_add(seconds * 1e9, std::memory_order_relaxed);
+	}
+
+	// Time a reader waited for output of the command
+	void AddReaderBlocked(double seconds) {
+		reader_blocked_.fetch_add(seconds * 1e9, std::memory_order_relaxed);
+	}
+
+	// Time from queueing the line count of a document (or sentence) until its
+	// output was put back together.
+	void AddLatency(clock::duration latency);
+
+	// Adds a function that returns how many entries a queue held at most
+	void AddQueue(std::function<size_t()> max_depth);
+
+	// Stops the reporting thread, and writes the report of the whole run.
+	// Does nothing the second time.
+	void Stop();
+
+private:
+	// Bucket i counts latencies below 2^i microseconds
+	static constexpr size_t LATENCY_BUCKETS = 40;
+
+	struct Totals {
+		uint64_t bytes_in = 0;
+		uint64_t lines_in = 0;
+		uint64_t bytes_out = 0;
+		uint64_t lines_out = 0;
+		uint64_t feeder_blocked = 0;
+		uint64_t reader_blocked = 0;
+		std::array<uint64_t, LATENCY_BUCKETS> latency{};
+	};
+
+	Totals Read() const;
+
+	// Writes the difference between now and since, which was taken seconds ago
+	void Report(char const *label, Totals const &now, Totals const &since, double seconds);
+
+	void Run();
+
+	std::ostream &out_;
+	std::chrono::duration<double> interval_;
+	char const *unit_;
+	clock::time_point start_;
+
+	std::atomic<uint64_t> bytes_in_;
+	std::atomic<uint64_t> lines_in_;
+	std::atomic<uint64_t> bytes_out_;
+	std::atomic<uint64_t> lines_out_;
+
+	// In nanoseconds
+	std::atomic<uint64_t> feeder_blocked_;
+	std::atomic<uint64_t> reader_blocked_;
+
+	std::array<std::atomic<uint64_t>, LATENCY_BUCKETS> latency_;
+
+	// Guards queues_ and stopped_
+	std::mutex mutex_;
+	std::condition_variable stop_;
+	bool stopped_;
+	std::vector<std::function<size_t()>> queues_;
+
+	std::thread thread_;
+
+	FilterStats(FilterStats const &) = delete;
+	FilterStats &operator=(FilterStats const &) = delete;
+};
+
+} // namespace bitextor
@@ -0,0 +1,198 @@
+#include "index_segment.h"
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "util/file_stream.hh"
+
+using namespace std;
+
+namespace bitextor {
+
+namespace {
+
+char const SEGMENT_MAGIC[8] = {'D', 'A', 'S', 'E', 'G', '0', '2', '\n'};
+
+char const DF_MAGIC[8] = {'D', 'A', 'D', 'F', '0', '1', '\n', '\0'};
+
+struct SegmentHeader {
+	char magic[8];
+	uint64_t key_cnt;
+	uint64_t posting_cnt;
+	uint64_t document_cnt;
+	uint64_t count_cnt;
+};
+
+struct DFEntry {
+	uint64_t hash;
+	uint64_t count;
+};
+
+} // namespace
+
+IndexSegment::IndexSegment(string const &path)
+: path_(path),
+  data_(nullptr),
+  data_size_(0) {
+	util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+	data_size_ = util::SizeOrThrow(fd.get());
+
+	UTIL_THROW_IF(data_size_ < sizeof(SegmentHeader), util::Exception, "Index segment " << path << " is truncated");
+
+	data_ = mmap(nullptr, data_size_, PROT_READ, MAP_SHARED, fd.get(), 0);
+	UTIL_THROW_IF(data_ == MAP_FAILED, util::ErrnoException, "Could not mmap " << path);
+
+	SegmentHeader const *header = reinterpret_cast<SegmentHeader const *>(data_);
+	key_cnt_ = header->key_cnt;
+	posting_cnt_ = header->posting_cnt;
+	document_cnt_ = header->document_cnt;
+	count_cnt_ = header->count_cnt;
+
+	UTIL_THROW_IF(memcmp(header->magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0
+		|| data_size_ != sizeof(SegmentHeader) + key_cnt_ * sizeof(Key) + posting_cnt_ * sizeof(uint64_t)
+		               + document_cnt_ * sizeof(DocumentKey) + count_cnt_ * sizeof(NGramCount),
+		util::Exception, path << " is not an index segment");
+
+	keys_ = reinterpret_cast<Key const *>(header + 1);
+	postings_ = reinterpret_cast<uint64_t const *>(keys_ + key_cnt_);
+	documents_ = reinterpret_cast<DocumentKey const *>(postings_ + posting_cnt_);
+	counts_ = reinterpret_cast<NGramCount const *>(documents_ + document_cnt_);
+}
+
+IndexSegment::~IndexSegment() {
+	munmap(data_, data_size_);
+}
+
+pair<uint64_t const *, uint64_t const *> IndexSegment::find(NGram const &ngram) const {
+	Key const *it = lower_bound(keys_, keys_ + key_cnt_, ngram.hash, [](Key const &key, uint64_t hash) {
+		return key.hash < hash;
+	});
+
+	if (it == keys_ + key_cnt_ || it->hash != ngram.hash)
+		return make_pair(postings_, postings_);
+
+	uint64_t end = it + 1 < keys_ + key_cnt_ ? (it + 1)->offset : posting_cnt_;
+	return make_pair(postings_ + it->offset, postings_ + end);
+}
+
+IndexSegment::DocumentKey const *IndexSegment::find_document(size_t id) const {
+	DocumentKey const *it = lower_bound(documents_, documents_ + document_cnt_, id, [](DocumentKey const &document, size_t id) {
+		return document.id < id;
+	});
+
+	return it != documents_ + document_cnt_ && it->id == id ? it : nullptr;
+}
+
+bool IndexSegment::contains(size_t id) const {
+	return find_document(id) != nullptr;
+}
+
+void IndexSegment::calculate_tfidf(size_t id, DocumentRef &document_ref, size_t document_count, unordered_map<NGram,size_t> const &df) const {
+	DocumentKey const *document = find_document(id);
+	UTIL_THROW_IF(!document, util::Exception, "Document " << id << " is not in index segment " << path_);
+
+	uint64_t end = document + 1 < documents_ + document_cnt_ ? (document + 1)->offset : count_cnt_;
+	UTIL_THROW_IF(document->offset > end || end > count_cnt_, util::Exception, path_ << " is not an index segment");
+
+	bitextor::calculate_tfidf(id, counts_ + document->offset, counts_ + end, document_ref, document_count, df);
+}
+
+void WriteIndexSegment(string const &path, vector<Document> const &documents) {
+	unordered_map<NGram, vector<uint64_t>> index;
+	uint64_t posting_cnt = 0;
+	uint64_t count_cnt = 0;
+
+	for (auto const &document : documents) {
+		for (auto const &entry : document.vocab) {
+			index[entry.first].push_back(document.id);
+			++posting_cnt;
+		}
+
+		count_cnt += document.vocab.size();
+	}
+
+	vector<NGram> keys;
+	keys.reserve(index.size());
+	for (auto const &entry : index)
+		keys.push_back(entry.first);
+
+	sort(keys.begin(), keys.end(), [](NGram const &a, NGram const &b) {
+		return a.hash < b.hash;
+	});
+
+	util::scoped_fd fd(util::CreateOrThrow(path.c_str()));
+	util::FileStream out(fd.get());
+
+	SegmentHeader header;
+	memcpy(header.magic, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+	header.key_cnt = keys.size();
+	header.posting_cnt = posting_cnt;
+	header.document_cnt = documents.size();
+	header.count_cnt = count_cnt;
+	out.write(&header, sizeof(header));
+
+	uint64_t offset = 0;
+	for (NGram const &key : keys) {
+		uint64_t entry[2]{key.hash, offset};
+		out.write(entry, sizeof(entry));
+		offset += index[key].size();
+	}
+
+	for (NGram const &key : keys) {
+		vector<uint64_t> const &postings = index[key];
+		out.write(postings.data(), postings.size() * sizeof(uint64_t));
+	}
+
+	offset = 0;
+	for (auto const &document : documents) {
+		uint64_t entry[2]{document.id, offset};
+		out.write(entry, sizeof(entry));
+		offset += document.vocab.size();
+	}
+
+	// In the order of the vocab, so calculate_tfidf() adds them up in the
+	// same order as it does for the document itself.
+	for (auto const &document : documents) {
+		for (auto const &entry : document.vocab) {
+			NGramCount count{entry.first.hash, entry.second};
+			out.write(&count, sizeof(count));
+		}
+	}
+
+	out.flush();
+}
+
+void ReadDF(string const &path, unordered_map<NGram,size_t> &df) {
+	util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+	uint64_t size = util::SizeOrThrow(fd.get());
+
+	char magic[sizeof(DF_MAGIC)];
+	UTIL_THROW_IF(size < sizeof(magic) || (size - sizeof(magic)) % sizeof(DFEntry) != 0, util::Exception, path << " is not a DF table");
+
+	util::ReadOrThrow(fd.get(), magic, sizeof(magic));
+	UTIL_THROW_IF(memcmp(magic, DF_MAGIC, sizeof(DF_MAGIC)) != 0, util::Exception, path << " is not a DF table");
+
+	vector<DFEntry> entries((size - sizeof(magic)) / sizeof(DFEntry));
+	util::ReadOrThrow(fd.get(), entries.data(), entries.size() * sizeof(DFEntry));
+
+	df.reserve(df.size() + entries.size());
+	for (DFEntry const &entry : entries)
+		df[NGram{entry.hash}] += entry.count;
+}
+
+void WriteDF(string const &path, unordered_map<NGram,size_t> const &df) {
+	util::scoped_fd fd(util::CreateOrThrow(path.c_str()));
+	util::FileStream out(fd.get());
+
+	out.write(DF_MAGIC, sizeof(DF_MAGIC));
+
+	for (auto const &entry : df) {
+		DFEntry record{entry.first.hash, entry.second};
+		out.write(&record, sizeof(record));
+	}
+
+	out.flush();
+}
+
+} // namespace bitextor
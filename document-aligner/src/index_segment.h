@@ -0,0 +1,83 @@
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "ngram.h"
+#include "document.h"
+
+namespace bitextor {
+
+/**
+ * Read-only set of documents, stored on disk as the ngram counts of each
+ * document, next to a sorted array of ngram hashes with for each the ids of
+ * the documents it occurs in. As counts, the TF/IDF vectors of the documents
+ * can be calculated with the DF of any later run. The file is memory mapped,
+ * so looking up the ngrams of a few documents only touches the pages their
+ * postings and counts are on, not the whole segment.
+ */
+class IndexSegment {
+public:
+	explicit IndexSegment(std::string const &path);
+
+	~IndexSegment();
+
+	// Ids of the documents ngram occurs in as [begin, end), empty if none
+	std::pair<uint64_t const *, uint64_t const *> find(NGram const &ngram) const;
+
+	// Whether the document with this id is in here
+	bool contains(size_t id) const;
+
+	// TF/IDF vector of the document with this id, the same as calculate_tfidf()
+	// gives for the document that was written. Throws if it is not in here.
+	void calculate_tfidf(size_t id, DocumentRef &document_ref, size_t document_count, std::unordered_map<NGram,size_t> const &df) const;
+
+	// Number of distinct ngrams
+	size_t size() const {
+		return key_cnt_;
+	}
+
+private:
+	struct Key {
+		uint64_t hash;
+		uint64_t offset;
+	};
+
+	// A document and where its ngram counts start
+	struct DocumentKey {
+		uint64_t id;
+		uint64_t offset;
+	};
+
+	DocumentKey const *find_document(size_t id) const;
+
+	std::string path_;
+	void *data_;
+	size_t data_size_;
+	Key const *keys_;
+	uint64_t key_cnt_;
+	uint64_t const *postings_;
+	uint64_t posting_cnt_;
+	DocumentKey const *documents_;
+	uint64_t document_cnt_;
+	NGramCount const *counts_;
+	uint64_t count_cnt_;
+
+	IndexSegment(IndexSegment const &) = delete;
+	IndexSegment &operator=(IndexSegment const &) = delete;
+};
+
+/**
+ * Writes documents as an index segment to path. Their ids have to be in
+ * ascending order.
+ */
+void WriteIndexSegment(std::string const &path, std::vector<Document> const &documents);
+
+/**
+ * Reads and writes a document frequency table in binary form.
+ */
+void ReadDF(std::string const &path, std::unordered_map<NGram,size_t> &df);
+
+void WriteDF(std::string const &path, std::unordered_map<NGram,size_t> const &df);
+
+} // namespace bitextor
@@ -0,0 +1,161 @@
+#include "line_cache.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "util/file_stream.hh"
+#include "murmur_hash.h"
+
+using namespace std;
+
+namespace bitextor {
+
+namespace {
+
+char const CACHE_MAGIC[8] = {'L', 'N', 'C', 'A', 'C', 'H', 'E', '1'};
+
+struct CacheHeader {
+	char magic[8];
+	uint64_t key_cnt;
+	uint64_t text_size;
+};
+
+} // namespace
+
+LineCache::LineCache()
+: data_(nullptr),
+  data_size_(0),
+  keys_(nullptr),
+  key_cnt_(0),
+  text_(nullptr) {
+}
+
+LineCache::LineCache(string const &path)
+: LineCache() {
+	path_ = path;
+
+	struct stat path_stat;
+	if (stat(path.c_str(), &path_stat) != 0)
+		return;
+
+	util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+	data_size_ = util::SizeOrThrow(fd.get());
+
+	UTIL_THROW_IF(data_size_ < sizeof(CacheHeader), util::Exception, path << " is not a line cache");
+
+	data_ = mmap(nullptr, data_size_, PROT_READ, MAP_SHARED, fd.get(), 0);
+	UTIL_THROW_IF(data_ == MAP_FAILED, util::ErrnoException, "Could not mmap " << path);
+
+	CacheHeader const *header = reinterpret_cast<CacheHeader const *>(data_);
+	key_cnt_ = header->key_cnt;
+
+	UTIL_THROW_IF(memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+		|| key_cnt_ > (data_size_ - sizeof(CacheHeader)) / sizeof(Key)
+		|| data_size_ - sizeof(CacheHeader) - key_cnt_ * sizeof(Key) != header->text_size,
+		util::Exception, path << " is not a line cache");
+
+	keys_ = reinterpret_cast<Key const *>(header + 1);
+	text_ = reinterpret_cast<char const *>(keys_ + key_cnt_);
+
+	// Lookups are binary searches, and the text of each key is read as is
+	for (Key const *key = keys_; key != keys_ + key_cnt_; ++key)
+		UTIL_THROW_IF(key->size > header->text_size || key->offset > header->text_size - key->size
+			|| (key != keys_ && key->hash < (key - 1)->hash),
+			util::Exception, path << " is a corrupt line cache");
+}
+
+LineCache::~LineCache() {
+	if (data_)
+		munmap(data_, data_size_);
+}
+
+uint64_t LineCache::Hash(StringPiece const &line) {
+	return MurmurHashNative(line.data(), line.size(), 0);
+}
+
+bool LineCache::FindStored(uint64_t hash, StringPiece &output) const {
+	Key const *it = lower_bound(keys_, keys_ + key_cnt_, hash, [](Key const &key, uint64_t hash) {
+		return key.hash < hash;
+	});
+
+	if (it == keys_ + key_cnt_ || it->hash != hash)
+		return false;
+
+	output = StringPiece(text_ + it->offset, it->size);
+	return true;
+}
+
+bool LineCache::Find(uint64_t hash, StringPiece &output) const {
+	auto it = added_.find(hash);
+
+	if (it == added_.end())
+		return FindStored(hash, output);
+
+	output = StringPiece(it->second.data(), it->second.size());
+	return true;
+}
+
+void LineCache::Add(uint64_t hash, StringPiece const &output) {
+	added_.emplace(hash, string(output.data(), output.size()));
+}
+
+void LineCache::Save() const {
+	if (path_.empty())
+		return;
+
+	// Merge the added lines into the sorted ones from the file
+	vector<pair<uint64_t, StringPiece>> lines;
+	lines.reserve(key_cnt_ + added_.size());
+
+	for (Key const *key = keys_; key != keys_ + key_cnt_; ++key)
+		lines.emplace_back(key->hash, StringPiece(text_ + key->offset, key->size));
+
+	for (auto const &entry : added_)
+		lines.emplace_back(entry.first, StringPiece(entry.second.data(), entry.second.size()));
+
+	// Stable, so for a hash in both the line from the file is kept
+	stable_sort(lines.begin(), lines.end(), [](pair<uint64_t, StringPiece> const &a, pair<uint64_t, StringPiece> const &b) {
+		return a.first < b.first;
+	});
+
+	lines.erase(unique(lines.begin(), lines.end(), [](pair<uint64_t, StringPiece> const &a, pair<uint64_t, StringPiece> const &b) {
+		return a.first == b.first;
+	}), lines.end());
+
+	CacheHeader header;
+	memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+	header.key_cnt = lines.size();
+	header.text_size = 0;
+
+	vector<Key> keys;
+	keys.reserve(lines.size());
+
+	for (auto const &line : lines) {
+		keys.push_back(Key{line.first, header.text_size, line.second.size()});
+		header.text_size += line.second.size();
+	}
+
+	// Write next to it and move it in place, so the file is never half
+	// written, and the one that is mapped right now stays as it is.
+	string tmp_path(path_ + ".tmp");
+
+	{
+		util::scoped_fd fd(util::CreateOrThrow(tmp_path.c_str()));
+		util::FileStream out(fd.get());
+		out.write(&header, sizeof(header));
+		out.write(keys.data(), keys.size() * sizeof(Key));
+
+		for (auto const &line : lines)
+			out << line.second;
+
+		out.flush();
+	}
+
+	UTIL_THROW_IF(rename(tmp_path.c_str(), path_.c_str()) != 0, util::ErrnoException, "Could not move " << tmp_path << " to " << path_);
+}
+
+} // namespace bitextor
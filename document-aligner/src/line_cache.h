@@ -0,0 +1,69 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include "util/string_piece.hh"
+
+namespace bitextor {
+
+/**
+ * What a command made of each line it was given, keyed by a hash of the line.
+ * Lets b64filter send every distinct line to the command only once.
+ *
+ * Lines added in this run are kept in memory. Optionally the cache is backed
+ * by a file with the lines of earlier runs: a sorted array of hashes with the
+ * offset and length of their output, followed by the outputs. The file is
+ * memory mapped and not changed until Save(), so FindStored() can be called
+ * from another thread than the one adding lines.
+ */
+class LineCache {
+public:
+	// Only in memory
+	LineCache();
+
+	// Backed by the file at path, if it exists. Save() writes it.
+	explicit LineCache(std::string const &path);
+
+	~LineCache();
+
+	static uint64_t Hash(StringPiece const &line);
+
+	// Looks up the output of a line in the file only
+	bool FindStored(uint64_t hash, StringPiece &output) const;
+
+	// Looks up the output of a line added in this run or in the file
+	bool Find(uint64_t hash, StringPiece &output) const;
+
+	void Add(uint64_t hash, StringPiece const &output);
+
+	// Number of lines added in this run
+	size_t added() const {
+		return added_.size();
+	}
+
+	// Writes the lines of the file and the ones added to the file, if there is
+	// one. Replaces the file once it is complete.
+	void Save() const;
+
+private:
+	struct Key {
+		uint64_t hash;
+		uint64_t offset;
+		uint64_t size;
+	};
+
+	std::string path_;
+
+	void *data_;
+	size_t data_size_;
+	Key const *keys_;
+	uint64_t key_cnt_;
+	char const *text_;
+
+	std::unordered_map<uint64_t, std::string> added_;
+
+	LineCache(LineCache const &) = delete;
+	LineCache &operator=(LineCache const &) = delete;
+};
+
+} // namespace bitextor
@@ -0,0 +1,565 @@
+#include "line_index.h"
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "util/exception.hh"
+
+using namespace std;
+
+namespace bitextor {
+
+namespace {
+
+char const INDEX_MAGIC[8] = {'D', 'O', 'C', 'L', 'I', 'D', 'X', '2'};
+
+struct IndexHeader {
+	char magic[8];
+	uint64_t file_size;
+	uint64_t file_mtime_sec;
+	uint64_t file_mtime_nsec;
+	uint64_t compressed;
+	uint64_t document_cnt;
+	uint64_t stride;
+	uint64_t offset_cnt;
+	uint64_t checkpoint_cnt;
+};
+
+constexpr size_t WINDOW_SIZE = LineIndex::WINDOW_SIZE;
+
+constexpr size_t CHUNK_SIZE = 1 << 16;
+
+bool read_header(int fd, IndexHeader &header) {
+	return util::ReadOrEOF(fd, &header, sizeof(header)) == sizeof(header)
+		&& memcmp(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0
+		&& header.stride != 0;
+}
+
+bool header_matches(IndexHeader const &header, struct stat const &file) {
+	return header.file_size == static_cast<uint64_t>(file.st_size)
+		&& header.file_mtime_sec == static_cast<uint64_t>(file.st_mtim.tv_sec)
+		&& header.file_mtime_nsec == static_cast<uint64_t>(file.st_mtim.tv_nsec);
+}
+
+bool is_gzip(int fd) {
+	unsigned char magic[2];
+	return pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+
+// Other compression formats util::FilePiece reads, that cannot be indexed
+bool is_other_compressed(int fd) {
+	unsigned char magic[6];
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		return false;
+
+	return memcmp(magic, "\xFD" "7zXZ\0", 6) == 0 // xz
+		|| memcmp(magic, "BZh", 3) == 0 // bzip2
+		|| memcmp(magic, "\x28\xB5\x2F\xFD", 4) == 0; // zstd
+}
+
+/**
+ * Counts documents in data as it is read, and records the offset of every
+ * stride-th one.
+ */
+class LineCounter {
+public:
+	LineCounter(uint64_t stride, vector<uint64_t> &offsets)
+	: stride_(stride),
+	  offsets_(offsets),
+	  offset_(0),
+	  document_cnt_(0),
+	  in_line_(false) {
+		offsets_.push_back(0);
+	}
+
+	void operator()(char const *data, size_t size) {
+		char const *end = data + size;
+
+		for (char const *it = data; it != end;) {
+			char const *newline = static_cast<char const *>(memchr(it, '\n', end - it));
+
+			if (!newline) {
+				in_line_ = true;
+				break;
+			}
+
+			if (++document_cnt_ % stride_ == 0)
+				offsets_.push_back(offset_ + (newline - data) + 1);
+
+			in_line_ = false;
+			it = newline + 1;
+		}
+
+		offset_ += size;
+	}
+
+	// At the end of the data: the offset after every stride-th document
+	// includes a last one without newline, which then ends at the end.
+	void finish() {
+		if (in_line_ && (document_cnt_ + 1) % stride_ == 0)
+			offsets_.push_back(offset_);
+	}
+
+	// Number of documents, including a last one without newline
+	uint64_t document_cnt() const {
+		return document_cnt_ + (in_line_ ? 1 : 0);
+	}
+
+private:
+	uint64_t stride_;
+	vector<uint64_t> &offsets_;
+	uint64_t offset_;
+	uint64_t document_cnt_;
+	bool in_line_;
+};
+
+} // namespace
+
+constexpr size_t LineIndex::WINDOW_SIZE;
+
+LineIndex::LineIndex()
+: file_size_(0),
+  file_mtime_sec_(0),
+  file_mtime_nsec_(0),
+  compressed_(false),
+  document_cnt_(0),
+  stride_(1),
+  windows_offset_(0) {
+}
+
+LineIndex::LineIndex(string const &path, string const &index_path) {
+	util::scoped_fd fd(util::OpenReadOrThrow(index_path.c_str()));
+
+	IndexHeader header;
+	UTIL_THROW_IF(!read_header(fd.get(), header), util::Exception, index_path << " is not a document index");
+
+	struct stat file;
+	UTIL_THROW_IF(stat(path.c_str(), &file) != 0, util::ErrnoException, "Could not stat " << path);
+	UTIL_THROW_IF(!header_matches(header, file), util::Exception,
+		index_path << " does not match the size or modification time of " << path << ". Remove it to build a new one.");
+
+	file_size_ = header.file_size;
+	file_mtime_sec_ = header.file_mtime_sec;
+	file_mtime_nsec_ = header.file_mtime_nsec;
+	compressed_ = header.compressed;
+	document_cnt_ = header.document_cnt;
+	stride_ = header.stride;
+
+	uint64_t index_size = util::SizeOrThrow(fd.get());
+	UTIL_THROW_IF(header.offset_cnt > index_size / sizeof(uint64_t)
+		|| header.checkpoint_cnt > index_size / (sizeof(Checkpoint) + WINDOW_SIZE)
+		|| header.offset_cnt < document_cnt_ / stride_ + 1,
+		util::Exception, index_path << " is truncated");
+
+	offsets_.resize(header.offset_cnt);
+	util::ReadOrThrow(fd.get(), offsets_.data(), offsets_.size() * sizeof(uint64_t));
+
+	checkpoints_.resize(header.checkpoint_cnt);
+	util::ReadOrThrow(fd.get(), checkpoints_.data(), checkpoints_.size() * sizeof(Checkpoint));
+
+	// The windows follow, they are read when a checkpoint is used
+	windows_offset_ = sizeof(header) + offsets_.size() * sizeof(uint64_t) + checkpoints_.size() * sizeof(Checkpoint);
+	UTIL_THROW_IF(index_size < windows_offset_ + checkpoints_.size() * WINDOW_SIZE, util::Exception, index_path << " is truncated");
+
+	index_fd_.reset(new util::scoped_fd(fd.release()));
+}
+
+bool LineIndex::Matches(string const &path, string const &index_path) {
+	util::scoped_fd fd(open(index_path.c_str(), O_RDONLY));
+	struct stat file;
+	IndexHeader header;
+
+	return fd.get() != -1
+		&& stat(path.c_str(), &file) == 0
+		&& read_header(fd.get(), header)
+		&& header_matches(header, file);
+}
+
+void LineIndex::Stamp(int fd) {
+	struct stat file;
+	UTIL_THROW_IF(fstat(fd, &file) != 0, util::ErrnoException, "Could not stat file to index");
+
+	file_size_ = file.st_size;
+	file_mtime_sec_ = file.st_mtim.tv_sec;
+	file_mtime_nsec_ = file.st_mtim.tv_nsec;
+}
+
+LineIndex LineIndex::Build(string const &path, uint64_t stride, uint64_t span) {
+	util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+
+	UTIL_THROW_IF(is_other_compressed(fd.get()), util::Exception, "Only plain and gzip files can be indexed, which " << path << " is not");
+
+	// Before reading, so a file that changes meanwhile does not match
+	LineIndex index;
+	index.Stamp(fd.get());
+	index.compressed_ = is_gzip(fd.get());
+	index.stride_ = max<uint64_t>(stride, 1);
+
+	LineCounter count(index.stride_, index.offsets_);
+	vector<unsigned char> input(CHUNK_SIZE);
+
+	if (!index.compressed_) {
+		for (size_t size; (size = util::ReadOrEOF(fd.get(), input.data(), input.size())) > 0;)
+			count(reinterpret_cast<char const *>(input.data()), size);
+
+		count.finish();
+		index.document_cnt_ = count.document_cnt();
+		return index;
+	}
+
+	// Decompress block by block and add a checkpoint at a block boundary every
+	// span bytes. The output goes through window, so the 32KB before each
+	// checkpoint is always in there. Same as zran.c in the zlib examples.
+	vector<unsigned char> window(WINDOW_SIZE);
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	UTIL_THROW_IF(inflateInit2(&stream, 47) != Z_OK, util::Exception, "Could not initialise zlib");
+
+	uint64_t in = 0, out = 0, last = 0;
+	bool member_end = false;
+
+	try {
+		while (true) {
+			if (stream.avail_in == 0) {
+				stream.avail_in = util::ReadOrEOF(fd.get(), input.data(), input.size());
+				stream.next_in = input.data();
+
+				if (stream.avail_in == 0)
+					break;
+			}
+
+			if (stream.avail_out == 0) {
+				stream.avail_out = window.size();
+				stream.next_out = window.data();
+			}
+
+			unsigned char *begin = stream.next_out;
+			in += stream.avail_in;
+			out += stream.avail_out;
+			int ret = inflate(&stream, Z_BLOCK);
+			in -= stream.avail_in;
+			out -= stream.avail_out;
+
+			count(reinterpret_cast<char const *>(begin), stream.next_out - begin);
+
+			// Concatenated gzip files are read as one
+			if (ret == Z_STREAM_END) {
+				inflateReset(&stream);
+				member_end = true;
+				continue;
+			}
+
+			UTIL_THROW_IF(ret != Z_OK && ret != Z_BUF_ERROR, util::Exception, path << " is not a valid gzip file: zlib error " << ret);
+			member_end = false;
+
+			if ((stream.data_type & 128) && !(stream.data_type & 64) && (out == 0 || out - last > span)) {
+				index.checkpoints_.emplace_back();
+				Checkpoint &checkpoint = index.checkpoints_.back();
+				checkpoint.out = out;
+				checkpoint.in = in;
+				checkpoint.bits = stream.data_type & 7;
+				checkpoint.padding = 0;
+
+				size_t left = stream.avail_out;
+				index.windows_.insert(index.windows_.end(), window.end() - left, window.end());
+				index.windows_.insert(index.windows_.end(), window.begin(), window.end() - left);
+
+				last = out;
+			}
+		}
+	} catch (...) {
+		inflateEnd(&stream);
+		throw;
+	}
+
+	inflateEnd(&stream);
+
+	UTIL_THROW_IF(!member_end, util::Exception, path << " is a truncated gzip file");
+
+	count.finish();
+	index.document_cnt_ = count.document_cnt();
+	return index;
+}
+
+LineIndex LineIndex::FromLineLengths(int fd, vector<uint64_t> const &lengths, uint64_t stride) {
+	LineIndex index;
+	index.stride_ = max<uint64_t>(stride, 1);
+	index.document_cnt_ = lengths.size();
+
+	for (size_t i = 0; i < lengths.size(); ++i) {
+		if (i % index.stride_ == 0)
+			index.offsets_.push_back(index.file_size_);
+
+		index.file_size_ += lengths[i];
+	}
+
+	// Same as Build(): the end is where the next stride would start
+	if (lengths.size() % index.stride_ == 0)
+		index.offsets_.push_back(index.file_size_);
+
+	// Only a regular file can be checked later. Anything else gets an index
+	// that never matches.
+	struct stat file;
+	UTIL_THROW_IF(fstat(fd, &file) != 0, util::ErrnoException, "Could not stat indexed file");
+
+	if (S_ISREG(file.st_mode)) {
+		UTIL_THROW_IF(static_cast<uint64_t>(file.st_size) != index.file_size_, util::Exception,
+			"The file has " << file.st_size << " bytes, but its lines add up to " << index.file_size_);
+		index.Stamp(fd);
+	}
+
+	return index;
+}
+
+void LineIndex::Save(string const &index_path) const {
+	util::scoped_fd fd(util::CreateOrThrow(index_path.c_str()));
+
+	IndexHeader header;
+	memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	header.file_size = file_size_;
+	header.file_mtime_sec = file_mtime_sec_;
+	header.file_mtime_nsec = file_mtime_nsec_;
+	header.compressed = compressed_;
+	header.document_cnt = document_cnt_;
+	header.stride = stride_;
+	header.offset_cnt = offsets_.size();
+	header.checkpoint_cnt = checkpoints_.size();
+
+	util::WriteOrThrow(fd.get(), &header, sizeof(header));
+	util::WriteOrThrow(fd.get(), offsets_.data(), offsets_.size() * sizeof(uint64_t));
+	util::WriteOrThrow(fd.get(), checkpoints_.data(), checkpoints_.size() * sizeof(Checkpoint));
+
+	vector<unsigned char> window(WINDOW_SIZE);
+	for (Checkpoint const &checkpoint : checkpoints_) {
+		this->window(checkpoint, window.data());
+		util::WriteOrThrow(fd.get(), window.data(), window.size());
+	}
+}
+
+LineIndex::Checkpoint const *LineIndex::checkpoint(uint64_t out) const {
+	auto it = upper_bound(checkpoints_.begin(), checkpoints_.end(), out, [](uint64_t out, Checkpoint const &checkpoint) {
+		return out < checkpoint.out;
+	});
+
+	return it == checkpoints_.begin() ? nullptr : &*(it - 1);
+}
+
+void LineIndex::window(Checkpoint const &checkpoint, unsigned char *to) const {
+	uint64_t n = &checkpoint - checkpoints_.data();
+
+	if (!index_fd_) {
+		memcpy(to, windows_.data() + n * WINDOW_SIZE, WINDOW_SIZE);
+		return;
+	}
+
+	UTIL_THROW_IF(pread(index_fd_->get(), to, WINDOW_SIZE, windows_offset_ + n * WINDOW_SIZE) != static_cast<ssize_t>(WINDOW_SIZE),
+		util::ErrnoException, "Could not read checkpoint " << n << " from document index");
+}
+
+IndexedLineReader::IndexedLineReader(int fd, LineIndex const &index)
+: fd_(fd),
+  index_(index),
+  stream_initialised_(false),
+  raw_(false),
+  in_(CHUNK_SIZE),
+  buffer_(CHUNK_SIZE),
+  buffer_begin_(0),
+  buffer_end_(0),
+  eof_(false),
+  next_document_(0) {
+	Restart(0);
+}
+
+IndexedLineReader::~IndexedLineReader() {
+	if (stream_initialised_)
+		inflateEnd(&stream_);
+}
+
+void IndexedLineReader::Restart(uint64_t out) {
+	buffer_begin_ = 0;
+	buffer_end_ = 0;
+	eof_ = false;
+
+	if (!index_.compressed()) {
+		util::SeekOrThrow(fd_.get(), out);
+		return;
+	}
+
+	if (stream_initialised_)
+		inflateEnd(&stream_);
+
+	memset(&stream_, 0, sizeof(stream_));
+
+	LineIndex::Checkpoint const *checkpoint = index_.checkpoint(out);
+	uint64_t skip = out;
+
+	if (!checkpoint) {
+		// From the start, gzip header and all
+		UTIL_THROW_IF(inflateInit2(&stream_, 47) != Z_OK, util::Exception, "Could not initialise zlib");
+		stream_initialised_ = true;
+		raw_ = false;
+		util::SeekOrThrow(fd_.get(), 0);
+	} else {
+		// From the middle of a deflate stream
+		UTIL_THROW_IF(inflateInit2(&stream_, -15) != Z_OK, util::Exception, "Could not initialise zlib");
+		stream_initialised_ = true;
+		raw_ = true;
+
+		util::SeekOrThrow(fd_.get(), checkpoint->in - (checkpoint->bits ? 1 : 0));
+
+		if (checkpoint->bits) {
+			unsigned char byte;
+			util::ReadOrThrow(fd_.get(), &byte, 1);
+			inflatePrime(&stream_, checkpoint->bits, byte >> (8 - checkpoint->bits));
+		}
+
+		window_.resize(WINDOW_SIZE);
+		index_.window(*checkpoint, window_.data());
+		inflateSetDictionary(&stream_, window_.data(), window_.size());
+		skip -= checkpoint->out;
+	}
+
+	// Decompress up to out
+	while (skip > 0) {
+		size_t size = Decompress(buffer_.data(), min<uint64_t>(skip, buffer_.size()));
+		UTIL_THROW_IF(size == 0, util::Exception, "File is shorter than its index says");
+		skip -= size;
+	}
+}
+
+size_t IndexedLineReader::Decompress(char *to, size_t size) {
+	stream_.next_out = reinterpret_cast<unsigned char *>(to);
+	stream_.avail_out = size;
+
+	while (stream_.avail_out == size) {
+		if (stream_.avail_in == 0) {
+			stream_.avail_in = util::ReadOrEOF(fd_.get(), in_.data(), in_.size());
+			stream_.next_in = in_.data();
+
+			if (stream_.avail_in == 0)
+				break;
+		}
+
+		int ret = inflate(&stream_, Z_NO_FLUSH);
+
+		if (ret == Z_STREAM_END) {
+			// Started from a checkpoint, so the 8 byte gzip trailer is still
+			// there. Skip it, and read the next member with its header.
+			if (raw_) {
+				for (size_t trailer = 8; trailer > 0;) {
+					if (stream_.avail_in == 0) {
+						stream_.avail_in = util::ReadOrEOF(fd_.get(), in_.data(), in_.size());
+						stream_.next_in = in_.data();
+
+						if (stream_.avail_in == 0)
+							break;
+					}
+
+					size_t n = min<size_t>(trailer, stream_.avail_in);
+					stream_.next_in += n;
+					stream_.avail_in -= n;
+					trailer -= n;
+				}
+
+				inflateReset2(&stream_, 31);
+				raw_ = false;
+			} else {
+				inflateReset(&stream_);
+			}
+
+			continue;
+		}
+
+		UTIL_THROW_IF(ret != Z_OK && ret != Z_BUF_ERROR, util::Exception, "Invalid gzip data: zlib error " << ret);
+	}
+
+	return size - stream_.avail_out;
+}
+
+bool IndexedLineReader::Fill() {
+	if (eof_)
+		return false;
+
+	// Keep the start of the line that is being read
+	if (buffer_begin_ > 0) {
+		memmove(buffer_.data(), buffer_.data() + buffer_begin_, buffer_end_ - buffer_begin_);
+		buffer_end_ -= buffer_begin_;
+		buffer_begin_ = 0;
+	}
+
+	if (buffer_end_ == buffer_.size())
+		buffer_.resize(buffer_.size() * 2);
+
+	size_t size = index_.compressed()
+		? Decompress(buffer_.data() + buffer_end_, buffer_.size() - buffer_end_)
+		: util::ReadOrEOF(fd_.get(), buffer_.data() + buffer_end_, buffer_.size() - buffer_end_);
+
+	if (size == 0) {
+		eof_ = true;
+		return false;
+	}
+
+	buffer_end_ += size;
+	return true;
+}
+
+void IndexedLineReader::Seek(uint64_t index) {
+	UTIL_THROW_IF(index > index_.size(), util::Exception, "Document " << index << " is beyond the end of the file");
+
+	// The end needs no reading at all
+	if (index == index_.size()) {
+		buffer_begin_ = 0;
+		buffer_end_ = 0;
+		eof_ = true;
+		next_document_ = index;
+		return;
+	}
+
+	// Read on if it is close by, otherwise start at the nearest indexed one
+	if (index < next_document_ || index / index_.stride() != next_document_ / index_.stride()) {
+		uint64_t indexed = index / index_.stride();
+		Restart(index_.offset(indexed));
+		next_document_ = indexed * index_.stride();
+	}
+
+	StringPiece line;
+	while (next_document_ < index)
+		UTIL_THROW_IF(!ReadLineOrEOF(line), util::Exception, "File has fewer documents than its index says");
+}
+
+bool IndexedLineReader::ReadLineOrEOF(StringPiece &line) {
+	size_t scanned = 0;
+
+	while (true) {
+		char *begin = buffer_.data() + buffer_begin_;
+		char *newline = static_cast<char *>(memchr(begin + scanned, '\n', buffer_end_ - buffer_begin_ - scanned));
+
+		if (newline) {
+			line = StringPiece(begin, newline - begin);
+			buffer_begin_ = newline - buffer_.data() + 1;
+			break;
+		}
+
+		scanned = buffer_end_ - buffer_begin_;
+
+		if (!Fill()) {
+			// Last line without a newline. Fill() may have moved it.
+			if (buffer_begin_ == buffer_end_)
+				return false;
+
+			line = StringPiece(buffer_.data() + buffer_begin_, buffer_end_ - buffer_begin_);
+			buffer_begin_ = buffer_end_;
+			break;
+		}
+	}
+
+	// Same as util::FilePiece
+	if (!line.empty() && line.data()[line.size() - 1] == '\r')
+		line = StringPiece(line.data(), line.size() - 1);
+
+	++next_document_;
+	return true;
+}
+
+} // namespace bitextor
@@ -0,0 +1,165 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "util/file.hh"
+#include "util/string_piece.hh"
+
+namespace bitextor {
+
+/**
+ * Index of where the documents of a file with a document on each line start,
+ * so they can be read without going through the ones before them. Stored next
+ * to the file as FILE.idx. Works for plain and gzip compressed files.
+ *
+ * Only the offset of every stride-th document is kept, the documents in
+ * between are found by reading on from there. For gzip files the index also
+ * has decompressor checkpoints every span bytes of decompressed data: the
+ * position in the compressed file and the 32KB of data before it, which is
+ * all zlib needs to start decompressing from there. Those windows stay in the
+ * index file until they are needed.
+ *
+ * The index remembers the size and modification time of its file, so one
+ * that was made for an older version of the file is not used by accident.
+ */
+class LineIndex {
+public:
+	struct Checkpoint {
+		// Position in the decompressed data
+		uint64_t out;
+
+		// Position in the compressed file. If bits is not 0, the checkpoint
+		// starts that many bits before in.
+		uint64_t in;
+		uint32_t bits;
+		uint32_t padding;
+	};
+
+	// Size of the window of data before a checkpoint
+	static constexpr size_t WINDOW_SIZE = 32768;
+
+	// Reads an index from index_path, and checks that it matches the size and
+	// modification time of the file at path.
+	LineIndex(std::string const &path, std::string const &index_path);
+
+	// Whether index_path is an index that matches the file at path as it is
+	// now. False if there is no index.
+	static bool Matches(std::string const &path, std::string const &index_path);
+
+	// Reads through the file at path and indexes it.
+	static LineIndex Build(std::string const &path, uint64_t stride = 1024, uint64_t span = 1 << 20);
+
+	// Builds the index of the plain file written to fd from the length of
+	// each of its lines, newline included. For writing an index while writing
+	// the file; call it once all of it is written.
+	static LineIndex FromLineLengths(int fd, std::vector<uint64_t> const &lengths, uint64_t stride = 1024);
+
+	void Save(std::string const &index_path) const;
+
+	// Number of documents
+	uint64_t size() const {
+		return document_cnt_;
+	}
+
+	bool compressed() const {
+		return compressed_;
+	}
+
+	uint64_t stride() const {
+		return stride_;
+	}
+
+	// Offset in the decompressed data of document stride * n
+	uint64_t offset(uint64_t n) const {
+		return offsets_[n];
+	}
+
+	// Last checkpoint at or before offset out, or nullptr if decompression
+	// has to start at the beginning of the file.
+	Checkpoint const *checkpoint(uint64_t out) const;
+
+	// Copies the WINDOW_SIZE bytes before checkpoint, which has to be one of
+	// this index, into to. Reads them from the index file if it was loaded.
+	void window(Checkpoint const &checkpoint, unsigned char *to) const;
+
+private:
+	LineIndex();
+
+	// Sets file_size_ and file_mtime_ from the file behind fd
+	void Stamp(int fd);
+
+	uint64_t file_size_;
+	uint64_t file_mtime_sec_;
+	uint64_t file_mtime_nsec_;
+	bool compressed_;
+	uint64_t document_cnt_;
+	uint64_t stride_;
+	std::vector<uint64_t> offsets_;
+	std::vector<Checkpoint> checkpoints_;
+
+	// Windows of the checkpoints, either in memory for an index that was just
+	// built, or in the index file at windows_offset_.
+	std::vector<unsigned char> windows_;
+	std::unique_ptr<util::scoped_fd> index_fd_;
+	uint64_t windows_offset_;
+};
+
+/**
+ * Reads the documents of a plain or gzip file one by one, like
+ * util::FilePiece, but can use a LineIndex to start at any document.
+ */
+class IndexedLineReader {
+public:
+	// Takes ownership of fd. The index has to outlive the reader.
+	IndexedLineReader(int fd, LineIndex const &index);
+
+	~IndexedLineReader();
+
+	// Moves to document index, starting at 0, so that it is what
+	// ReadLineOrEOF reads next. Index size() is the end of the file.
+	void Seek(uint64_t index);
+
+	// Index of the document ReadLineOrEOF reads next
+	uint64_t Tell() const {
+		return next_document_;
+	}
+
+	uint64_t size() const {
+		return index_.size();
+	}
+
+	// Reads the next document without its newline. Returns false at the end
+	// of the file.
+	bool ReadLineOrEOF(StringPiece &line);
+
+private:
+	// Restarts decompression at offset out of the decompressed data
+	void Restart(uint64_t out);
+
+	// Decompresses or reads more data after buffer_end_. Returns false at the
+	// end of the file.
+	bool Fill();
+
+	// Decompresses into to. Returns the number of bytes, 0 at the end.
+	size_t Decompress(char *to, size_t size);
+
+	util::scoped_fd fd_;
+	LineIndex const &index_;
+
+	z_stream stream_;
+	bool stream_initialised_;
+	bool raw_; // whether stream_ is decompressing without gzip headers
+	std::vector<unsigned char> in_;
+	std::vector<unsigned char> window_;
+
+	std::vector<char> buffer_;
+	size_t buffer_begin_;
+	size_t buffer_end_;
+	bool eof_;
+
+	uint64_t next_document_;
+};
+
+} // namespace bitextor
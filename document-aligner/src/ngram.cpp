@@ -49,4 +49,45 @@ void NGramIter::increment() {
 	++token_it_;
 }
 
+MultiNGramIter::MultiNGramIter(StringPiece const &source, std::vector<size_t> const &ngram_sizes)
+: token_it_(source, " \n"),
+  ngram_sizes_(ngram_sizes),
+  pos_(0),
+  size_idx_(ngram_sizes.size()),
+  end_(false),
+  buffer_(ngram_sizes.empty() ? 1 : ngram_sizes.back()) {
+	increment();
+}
+
+void MultiNGramIter::increment() {
+	while (true) {
+		// Next ngram ending in the current token, if there are enough tokens
+		// read for it. Sizes are sorted, so if this one does not fit, the
+		// rest will not either.
+		if (size_idx_ < ngram_sizes_.size() && ngram_sizes_[size_idx_] <= pos_) {
+			size_t ngram_size = ngram_sizes_[size_idx_++];
+
+			ngram_.hash = 0;
+			for (size_t offset = ngram_size; offset > 0; --offset)
+				ngram_.hash = MurmurHashCombine(buffer_[(pos_ - offset) % buffer_.size()], ngram_.hash);
+
+			if (ngram_sizes_.size() > 1)
+				ngram_.hash = MurmurHashCombine(ngram_size, ngram_.hash);
+
+			return;
+		}
+
+		if (!token_it_) {
+			end_ = true;
+			return;
+		}
+
+		// Read next word & store hash
+		buffer_[pos_ % buffer_.size()] = MurmurHashNative(token_it_->data(), token_it_->size(), 0);
+		++pos_;
+		++token_it_;
+		size_idx_ = 0;
+	}
+}
+
 } // namespace bitextor
@@ -2,17 +2,40 @@
 #include <vector>
 #include <boost/iterator/iterator_facade.hpp>
 #include <util/tokenize_piece.hh>
+#include "murmur_hash.h"
 
 namespace bitextor {
 
-struct NGram {
-	uint64_t hash;
+template <typename T> struct BasicNGram {
+	typedef T hash_type;
 
-	inline bool operator==(NGram const &other) const {
+	T hash;
+
+	inline bool operator==(BasicNGram const &other) const {
 		return hash == other.hash;
 	}
 };
 
+typedef BasicNGram<uint64_t> NGram;
+
+// Half the size of NGram, for corpora where 32 bits is enough to keep hash
+// collisions rare.
+typedef BasicNGram<uint32_t> NGram32;
+
+/**
+ * Converts an ngram hash as produced by NGramIter into one of type NGramT.
+ * For NGram32 both halves of the 64 bit hash are mixed in.
+ */
+template <typename NGramT> inline NGramT fold_ngram(NGram const &ngram);
+
+template <> inline NGram fold_ngram<NGram>(NGram const &ngram) {
+	return ngram;
+}
+
+template <> inline NGram32 fold_ngram<NGram32>(NGram const &ngram) {
+	return NGram32{static_cast<uint32_t>(ngram.hash ^ (ngram.hash >> 32))};
+}
+
 class NGramIter : public boost::iterator_facade<NGramIter, const NGram, boost::forward_traversal_tag> {
 public:
 	NGramIter();
@@ -50,11 +73,129 @@ private:
 	}
 };
 
+/**
+ * Same as NGramIter, but with the ngram size fixed at compile time. The
+ * window of token hashes is a fixed array that is shifted instead of indexed
+ * modulo the size, and combining it into the ngram hash is unrolled. Produces
+ * the same hashes as NGramIter(source, N). See ReadDocument for how a runtime
+ * size is mapped onto one of these.
+ */
+template <size_t N> class FixedNGramIter : public boost::iterator_facade<FixedNGramIter<N>, const NGram, boost::forward_traversal_tag> {
+public:
+	static_assert(N > 0, "ngram size must be at least 1");
+
+	explicit FixedNGramIter(StringPiece const &source)
+	: token_it_(source, " \n"),
+	  end_(false) {
+		for (size_t i = 1; i < N; ++i, ++token_it_) {
+			if (!token_it_) {
+				end_ = true;
+				return;
+			}
+
+			buffer_[i] = MurmurHashNative(token_it_->data(), token_it_->size(), 0);
+		}
+
+		increment();
+	}
+
+	inline bool operator!() const {
+		return end_;
+	}
+
+	inline operator bool() const {
+		return !end_;
+	}
+
+private:
+	friend class boost::iterator_core_access;
+
+	util::TokenIter<util::AnyCharacter, true> token_it_;
+
+	bool end_;
+
+	// Hashes of the last N tokens, oldest first
+	uint64_t buffer_[N];
+
+	NGram ngram_;
+
+	inline void increment() {
+		if (!token_it_) {
+			end_ = true;
+			return;
+		}
+
+		for (size_t i = 1; i < N; ++i)
+			buffer_[i - 1] = buffer_[i];
+
+		buffer_[N - 1] = MurmurHashNative(token_it_->data(), token_it_->size(), 0);
+
+		ngram_.hash = 0;
+		for (size_t i = 0; i < N; ++i)
+			ngram_.hash = MurmurHashCombine(buffer_[i], ngram_.hash);
+
+		++token_it_;
+	}
+
+	inline bool equal(FixedNGramIter const &other) const {
+		return token_it_ == other.token_it_ && end_ == other.end_;
+	}
+
+	inline const NGram &dereference() const {
+		UTIL_THROW_IF(end_, util::OutOfTokens, "We already reached end");
+		return ngram_;
+	}
+};
+
+/**
+ * Iterates over the ngrams of several sizes in a single pass over the tokens.
+ * For each token it produces the ngrams ending in that token, from the
+ * smallest size to the largest. ngram_sizes has to be sorted and unique. With
+ * a single size the hashes are the same as those of NGramIter. Otherwise the
+ * hash of each ngram is salted with its size, so a unigram and a bigram never
+ * end up as the same feature.
+ */
+class MultiNGramIter : public boost::iterator_facade<MultiNGramIter, const NGram, boost::forward_traversal_tag> {
+public:
+	MultiNGramIter(StringPiece const &source, std::vector<size_t> const &ngram_sizes);
+
+	inline bool operator!() const {
+		return end_;
+	}
+
+	inline operator bool() const {
+		return !end_;
+	}
+
+private:
+	friend class boost::iterator_core_access;
+
+	util::TokenIter<util::AnyCharacter, true> token_it_;
+
+	std::vector<size_t> ngram_sizes_;
+	size_t pos_;
+	size_t size_idx_;
+	bool end_;
+	std::vector<uint64_t> buffer_;
+	NGram ngram_;
+
+	void increment();
+
+	inline bool equal(MultiNGramIter const &other) const {
+		return token_it_ == other.token_it_ && size_idx_ == other.size_idx_ && end_ == other.end_;
+	}
+
+	inline const NGram &dereference() const {
+		UTIL_THROW_IF(end_, util::OutOfTokens, "We already reached end");
+		return ngram_;
+	}
+};
+
 } // namespace bitextor
 
 namespace std {
-	template <> struct hash<bitextor::NGram> {
-		inline size_t operator()(bitextor::NGram const &val) const {
+	template <typename T> struct hash<bitextor::BasicNGram<T>> {
+		inline size_t operator()(bitextor::BasicNGram<T> const &val) const {
 			return val.hash;
 		}
 	};
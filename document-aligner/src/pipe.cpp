@@ -0,0 +1,176 @@
+#include "pipe.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+#include "util/exception.hh"
+#include "util/file.hh"
+
+using namespace std;
+
+namespace bitextor {
+
+namespace {
+
+// Buffer size when the capacity of the pipe is unknown
+constexpr size_t FALLBACK_BUFFER_SIZE = 1 << 16;
+
+} // namespace
+
+size_t set_pipe_size(int fd, size_t size) {
+#ifdef F_SETPIPE_SZ
+	int capacity = fcntl(fd, F_GETPIPE_SZ);
+	if (capacity <= 0)
+		return 0;
+
+	// Unprivileged processes cannot go over /proc/sys/fs/pipe-max-size, nor
+	// over pipe-user-pages-soft in total, so try smaller until it is allowed.
+	// If nothing is, the pipe keeps the capacity it has.
+	for (; size > static_cast<size_t>(capacity); size /= 2) {
+		int ret = fcntl(fd, F_SETPIPE_SZ, size);
+		if (ret > 0)
+			return ret;
+	}
+
+	return capacity;
+#else
+	return 0;
+#endif
+}
+
+size_t pipe_size_for(size_t pipe_cnt) {
+	size_t pages = 0;
+
+#ifdef __linux__
+	ifstream limit("/proc/sys/fs/pipe-user-pages-soft");
+	limit >> pages;
+#endif
+
+	// No limit, or not one we know of
+	if (!pages || !pipe_cnt)
+		return DEFAULT_PIPE_SIZE;
+
+	size_t size = pages / 2 * sysconf(_SC_PAGESIZE) / pipe_cnt;
+	return max(min(size, DEFAULT_PIPE_SIZE), FALLBACK_BUFFER_SIZE);
+}
+
+void print_throughput(ostream &out, char const *direction, uint64_t bytes, double seconds) {
+	out << direction << ": " << bytes << " bytes in " << fixed << setprecision(2) << seconds << "s ("
+	    << setprecision(1) << (seconds > 0 ? bytes / seconds / 1000000.0 : 0.0) << " MB/s)";
+}
+
+PipeWriter::PipeWriter(int fd, bool zero_copy)
+: fd_(fd),
+  zero_copy_(false),
+  capacity_(FALLBACK_BUFFER_SIZE),
+  buffer_(nullptr),
+  half_(0),
+  pos_(0),
+  bytes_(0),
+  blocked_(0) {
+#ifdef F_GETPIPE_SZ
+	int capacity = fcntl(fd_, F_GETPIPE_SZ);
+	if (capacity > 0) {
+		capacity_ = capacity;
+		zero_copy_ = zero_copy;
+	}
+#endif
+
+	// Page aligned, so every page of a half is a whole slot in the pipe
+	void *buffer;
+	UTIL_THROW_IF(posix_memalign(&buffer, sysconf(_SC_PAGESIZE), capacity_ * (zero_copy_ ? 2 : 1)) != 0,
+		util::Exception, "Could not allocate pipe buffer");
+	buffer_ = static_cast<char *>(buffer);
+}
+
+PipeWriter::~PipeWriter() {
+	flush();
+	free(buffer_);
+}
+
+void PipeWriter::write(char const *data, size_t size) {
+	bytes_ += size;
+
+	// Too large to bother copying into the buffer
+	if (!zero_copy_ && size >= capacity_) {
+		flush();
+		WriteOut(data, size);
+		return;
+	}
+
+	while (size > 0) {
+		char *half = buffer_ + half_ * capacity_;
+		size_t n = min(size, capacity_ - pos_);
+		memcpy(half + pos_, data, n);
+		pos_ += n;
+		data += n;
+		size -= n;
+
+		if (pos_ < capacity_)
+			continue;
+
+		if (zero_copy_) {
+			Splice(half, capacity_);
+			half_ = 1 - half_;
+		} else {
+			WriteOut(half, capacity_);
+		}
+
+		pos_ = 0;
+	}
+}
+
+void PipeWriter::flush() {
+	// A part of a half is written, not spliced. Otherwise it could be
+	// followed by less than capacity_ of spliced data before it is reused.
+	if (pos_ > 0)
+		WriteOut(buffer_ + half_ * capacity_, pos_);
+
+	pos_ = 0;
+}
+
+void PipeWriter::WriteOut(char const *data, size_t size) {
+	auto start = chrono::steady_clock::now();
+	util::WriteOrThrow(fd_, data, size);
+	blocked_ += chrono::steady_clock::now() - start;
+}
+
+void PipeWriter::Splice(char const *data, size_t size) {
+#ifdef __linux__
+	auto start = chrono::steady_clock::now();
+
+	while (size > 0) {
+		iovec iov{const_cast<char *>(data), size};
+		ssize_t ret = vmsplice(fd_, &iov, 1, 0);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+
+		// Not a pipe, or not supported: write what is left from now on.
+		if (ret == -1 && (errno == EINVAL || errno == ENOSYS || errno == EBADF)) {
+			zero_copy_ = false;
+			break;
+		}
+
+		UTIL_THROW_IF(ret == -1, util::ErrnoException, "vmsplice to sub-process failed");
+		data += ret;
+		size -= ret;
+	}
+
+	blocked_ += chrono::steady_clock::now() - start;
+#else
+	zero_copy_ = false;
+#endif
+
+	if (size > 0)
+		WriteOut(data, size);
+}
+
+} // namespace bitextor
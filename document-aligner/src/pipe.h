@@ -0,0 +1,98 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include "util/string_piece.hh"
+
+namespace bitextor {
+
+// Capacity the pipes to and from sub-processes get, if the system allows
+constexpr size_t DEFAULT_PIPE_SIZE = 1 << 20;
+
+// Tries to make the pipe behind fd hold size bytes, or as close to it as the
+// system allows. Never makes it smaller. Returns the capacity of the pipe, or
+// 0 if it is unknown (i.e. not on Linux).
+size_t set_pipe_size(int fd, size_t size);
+
+// Size for each of pipe_cnt pipes that are made larger at the same time, at
+// most DEFAULT_PIPE_SIZE. All pipes of a user together get only so much
+// memory (see /proc/sys/fs/pipe-user-pages-soft), after which new pipes get a
+// single page. These stay within half of that.
+size_t pipe_size_for(size_t pipe_cnt);
+
+// Prints a line like "to command: 10485760 bytes in 1.00s (10.0 MB/s)"
+void print_throughput(std::ostream &out, char const *direction, uint64_t bytes, double seconds);
+
+/**
+ * Buffered writer for the stdin of a sub-process. Use instead of
+ * util::FileStream where the other end is a pipe.
+ *
+ * Writes that are larger than the buffer go to the pipe without being copied
+ * into the buffer first. With zero_copy, full buffers are handed to the pipe
+ * with vmsplice() so the kernel does not copy them either. That is only safe
+ * if the reading process copies the data out of the pipe, i.e. read()s it,
+ * and does not splice() it on, because the pages are reused once the pipe has
+ * been filled with newer data. If vmsplice() is not available it falls back
+ * to write().
+ */
+class PipeWriter {
+public:
+	// Does not take ownership of fd
+	PipeWriter(int fd, bool zero_copy = false);
+
+	// Flushes
+	~PipeWriter();
+
+	PipeWriter &operator<<(StringPiece const &data) {
+		write(data.data(), data.size());
+		return *this;
+	}
+
+	PipeWriter &operator<<(char c) {
+		write(&c, 1);
+		return *this;
+	}
+
+	void write(char const *data, size_t size);
+
+	void flush();
+
+	// Whether data is still being vmsplice()d
+	bool zero_copy() const {
+		return zero_copy_;
+	}
+
+	// Bytes written so far, flushed or not
+	uint64_t bytes() const {
+		return bytes_;
+	}
+
+	// Time spent in write() and vmsplice(), which is mostly waiting for the
+	// reader to make room in the pipe.
+	double blocked_seconds() const {
+		return std::chrono::duration<double>(blocked_).count();
+	}
+
+private:
+	void WriteOut(char const *data, size_t size);
+
+	// vmsplice()s size bytes at data, which must not change until at least
+	// capacity_ bytes have been vmsplice()d after them.
+	void Splice(char const *data, size_t size);
+
+	int fd_;
+	bool zero_copy_;
+	size_t capacity_;
+
+	// With zero_copy two halves of capacity_ bytes: one is being filled while
+	// the other may still be in the pipe. Otherwise just one.
+	char *buffer_;
+	size_t half_;
+	size_t pos_;
+
+	uint64_t bytes_;
+	std::chrono::steady_clock::duration blocked_;
+};
+
+} // namespace bitextor
@@ -1,5 +1,7 @@
 #pragma once
+#include <atomic>
 #include <memory>
+#include <utility>
 #include "util/pcqueue.hh"
 
 namespace bitextor {
@@ -7,13 +9,13 @@ namespace bitextor {
 /**
  * Single producer queue. Straight up copy of KPU's preprocess library with
  * the addition of an Empty() method that does non-blocking checking whether
- * we might be at the end of the queue.
+ * we might be at the end of the queue, and MaxDepth() for statistics.
  */
 template <class T> class SingleProducerQueue {
   public:
   	typedef util::UnboundedPage<T> Page;
 
-    SingleProducerQueue() : valid_(0) {
+    SingleProducerQueue() : valid_(0), produced_(0), consumed_(0), max_depth_(0) {
       SetFilling(new Page());
       SetReading(filling_);
     }
@@ -25,6 +27,12 @@ template <class T> class SingleProducerQueue {
         SetFilling(next);
       }
       *(filling_current_++) = val;
+
+      // Only this thread changes produced_ and max_depth_
+      size_t depth = ++produced_ - consumed_.load(std::memory_order_relaxed);
+      if (depth > max_depth_.load(std::memory_order_relaxed))
+        max_depth_.store(depth, std::memory_order_relaxed);
+
       valid_.post();
     }
 
@@ -33,7 +41,9 @@ template <class T> class SingleProducerQueue {
       if (reading_current_ == reading_end_) {
         SetReading(reading_->next);
       }
-      out = *(reading_current_++);
+      // The entry is never read again, so its contents can be taken
+      out = std::move(*(reading_current_++));
+      consumed_.store(consumed_.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
       return out;
     }
 
@@ -43,6 +53,12 @@ template <class T> class SingleProducerQueue {
       return reading_current_ == filling_current_;
     }
 
+    // Most entries that were produced but not yet consumed at any one time.
+    // Can be called from any thread.
+    size_t MaxDepth() const {
+      return max_depth_.load(std::memory_order_relaxed);
+    }
+
   private:
     void SetFilling(Page *to) {
       filling_ = to;
@@ -67,6 +83,10 @@ template <class T> class SingleProducerQueue {
     T *reading_current_;
     T *reading_end_;
 
+    size_t produced_;
+    std::atomic<size_t> consumed_;
+    std::atomic<size_t> max_depth_;
+
     SingleProducerQueue(const SingleProducerQueue &) = delete;
     SingleProducerQueue &operator=(const SingleProducerQueue &) = delete;
 };
@@ -0,0 +1,119 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace bitextor {
+
+/**
+ * Sparse matrix in compressed sparse row form. The entries of row i are at
+ * positions [row_ptr[i], row_ptr[i + 1]) of col and value. Rows are added by
+ * push_back()ing their entries and then calling end_row().
+ */
+struct CSRMatrix {
+	std::vector<size_t> row_ptr;
+	std::vector<uint32_t> col;
+	std::vector<float> value;
+
+	CSRMatrix() : row_ptr(1, 0) {}
+
+	size_t rows() const {
+		return row_ptr.size() - 1;
+	}
+
+	void push_back(uint32_t column, float val) {
+		col.push_back(column);
+		value.push_back(val);
+	}
+
+	void end_row() {
+		row_ptr.push_back(col.size());
+	}
+
+	void clear() {
+		row_ptr.assign(1, 0);
+		col.clear();
+		value.clear();
+	}
+};
+
+/**
+ * Dense accumulator for a single row of a matrix product, as in Gustavson's
+ * algorithm. Keeps a sum for every column plus the list of columns touched so
+ * far, so clearing it only costs as much as the row had entries.
+ */
+class DenseAccumulator {
+public:
+	explicit DenseAccumulator(size_t cols)
+	: sums_(cols, 0),
+	  touched_(cols, false) {
+	}
+
+	void add(uint32_t column, float val) {
+		if (!touched_[column]) {
+			touched_[column] = true;
+			columns_.push_back(column);
+		}
+
+		sums_[column] += val;
+	}
+
+	std::vector<uint32_t> const &columns() const {
+		return columns_;
+	}
+
+	float operator[](uint32_t column) const {
+		return sums_[column];
+	}
+
+	void clear() {
+		for (uint32_t column : columns_) {
+			sums_[column] = 0;
+			touched_[column] = false;
+		}
+		columns_.clear();
+	}
+
+private:
+	std::vector<float> sums_;
+	std::vector<char> touched_;
+	std::vector<uint32_t> columns_;
+};
+
+/**
+ * Computes the product of a and b one row at a time (row-wise Gustavson). For
+ * every entry of row i of the product that is at least threshold it calls
+ * on_score(i, column, value), and after each row on_row(i). The rows of a are
+ * the block that is scored at once, acc has to have a column for each column
+ * of b. Returns the number of non-zero entries of the product, thresholded or
+ * not.
+ *
+ * Each entry is summed in the order of the entries of its row in a, so the
+ * result does not depend on how b is laid out.
+ */
+template <typename ScoreFun, typename RowFun> size_t MultiplyRows(CSRMatrix const &a, CSRMatrix const &b, float threshold, DenseAccumulator &acc, ScoreFun on_score, RowFun on_row) {
+	size_t entry_cnt = 0;
+
+	for (size_t i = 0; i < a.rows(); ++i) {
+		for (size_t p = a.row_ptr[i]; p < a.row_ptr[i + 1]; ++p) {
+			uint32_t k = a.col[p];
+			float a_ik = a.value[p];
+
+			for (size_t q = b.row_ptr[k]; q < b.row_ptr[k + 1]; ++q)
+				acc.add(b.col[q], a_ik * b.value[q]);
+		}
+
+		entry_cnt += acc.columns().size();
+
+		for (uint32_t column : acc.columns())
+			if (acc[column] >= threshold)
+				on_score(i, column, acc[column]);
+
+		acc.clear();
+		on_row(i);
+	}
+
+	return entry_cnt;
+}
+
+} // namespace bitextor
@@ -0,0 +1,48 @@
+#include "stats.h"
+#include <sys/resource.h>
+
+using namespace std;
+
+namespace bitextor {
+
+namespace {
+
+double process_cpu_time() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+	     + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+} // namespace
+
+stopwatch::stopwatch() {
+	reset();
+}
+
+void stopwatch::reset() {
+	wall_start_ = chrono::steady_clock::now();
+	cpu_start_ = process_cpu_time();
+}
+
+double stopwatch::wall_time() const {
+	return chrono::duration<double>(chrono::steady_clock::now() - wall_start_).count();
+}
+
+double stopwatch::cpu_time() const {
+	return process_cpu_time() - cpu_start_;
+}
+
+size_t peak_rss() {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+
+	// Linux reports kilobytes, macOS bytes.
+	#ifdef __APPLE__
+	return usage.ru_maxrss;
+	#else
+	return usage.ru_maxrss * 1024;
+	#endif
+}
+
+} // namespace bitextor
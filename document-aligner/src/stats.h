@@ -0,0 +1,33 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+
+namespace bitextor {
+
+/**
+ * Measures elapsed wall-clock time and CPU time (user + system, summed over
+ * all threads of the process) since construction or the last reset().
+ */
+class stopwatch {
+public:
+	stopwatch();
+
+	void reset();
+
+	// Seconds of wall-clock time since reset
+	double wall_time() const;
+
+	// Seconds of CPU time consumed by the whole process since reset
+	double cpu_time() const;
+
+private:
+	std::chrono::steady_clock::time_point wall_start_;
+	double cpu_start_;
+};
+
+/**
+ * Peak resident set size of this process so far, in bytes.
+ */
+size_t peak_rss();
+
+} // namespace bitextor
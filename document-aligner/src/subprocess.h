@@ -1,6 +1,7 @@
 #pragma once
 #include <cstdio>
 #include <exception>
+#include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
 #include <sys/wait.h>
@@ -11,6 +12,7 @@
 #include "util/exception.hh"
 #include "util/file.hh"
 #include "util/file_stream.hh"
+#include "pipe.h"
 
 namespace {
 
@@ -20,6 +22,12 @@ void make_pipe(util::scoped_fd &read_end, util::scoped_fd &write_end) {
 	if (pipe(fds) != 0)
 		throw std::runtime_error("Could not create pipe");
 
+	// Don't leak these into other sub-processes, where an open write end would
+	// keep a sub-process from ever seeing the end of its input. dup2() in the
+	// child clears the flag on the ends it uses.
+	if (fcntl(fds[0], F_SETFD, FD_CLOEXEC) == -1 || fcntl(fds[1], F_SETFD, FD_CLOEXEC) == -1)
+		throw std::runtime_error("Could not set close-on-exec on pipe");
+
 	read_end.reset(fds[0]);
 	write_end.reset(fds[1]);
 }
@@ -30,7 +38,9 @@ namespace bitextor {
 
 class subprocess {
 public:
-	explicit subprocess(std::string const &program) : program_(program) {
+	explicit subprocess(std::string const &program, size_t pipe_size = DEFAULT_PIPE_SIZE)
+	: program_(program),
+	  pipe_size_(pipe_size) {
 		//
 	}
 
@@ -41,6 +51,10 @@ public:
 		make_pipe(process_in, in);
 		make_pipe(out, process_out);
 
+		// Larger pipes mean fewer context switches between us and the child
+		set_pipe_size(in.get(), pipe_size_);
+		set_pipe_size(out.get(), pipe_size_);
+
 		pid_ = fork();
 
 		// Are we confused?
@@ -95,6 +109,7 @@ public:
 	util::scoped_fd out;
 private:
 	std::string program_;
+	size_t pipe_size_;
 	pid_t pid_;
 };
 
@@ -0,0 +1,123 @@
+#include "unix_socket.h"
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "util/exception.hh"
+#include "util/file.hh"
+
+using namespace std;
+
+namespace bitextor {
+
+namespace {
+
+sockaddr_un make_address(string const &path) {
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+
+	UTIL_THROW_IF(path.size() >= sizeof(address.sun_path), util::Exception, "Socket path " << path << " is too long");
+	memcpy(address.sun_path, path.data(), path.size());
+
+	return address;
+}
+
+} // namespace
+
+int ListenUnixSocket(string const &path) {
+	sockaddr_un address(make_address(path));
+
+	util::scoped_fd fd(socket(AF_UNIX, SOCK_STREAM, 0));
+	UTIL_THROW_IF(fd.get() == -1, util::ErrnoException, "Could not create socket");
+
+	// Remove the socket file left behind by an earlier run
+	unlink(path.c_str());
+
+	UTIL_THROW_IF(::bind(fd.get(), reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1, util::ErrnoException, "Could not bind to " << path);
+	UTIL_THROW_IF(listen(fd.get(), SOMAXCONN) == -1, util::ErrnoException, "Could not listen on " << path);
+
+	return fd.release();
+}
+
+int ConnectUnixSocket(string const &path) {
+	sockaddr_un address(make_address(path));
+
+	util::scoped_fd fd(socket(AF_UNIX, SOCK_STREAM, 0));
+	UTIL_THROW_IF(fd.get() == -1, util::ErrnoException, "Could not create socket");
+
+	UTIL_THROW_IF(connect(fd.get(), reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1, util::ErrnoException, "Could not connect to " << path);
+
+	return fd.release();
+}
+
+LineReader::LineReader(int fd)
+: fd_(fd),
+  buffer_(1 << 16),
+  begin_(0),
+  end_(0) {
+	//
+}
+
+bool LineReader::ReadLine(string &line) {
+	line.clear();
+
+	while (true) {
+		char *newline = static_cast<char *>(memchr(buffer_.data() + begin_, '\n', end_ - begin_));
+
+		if (newline) {
+			line.append(buffer_.data() + begin_, newline);
+			begin_ = newline - buffer_.data() + 1;
+			return true;
+		}
+
+		// No complete line in the buffer: keep what we have and read more
+		line.append(buffer_.data() + begin_, end_ - begin_);
+		begin_ = 0;
+		end_ = util::ReadOrEOF(fd_, buffer_.data(), buffer_.size());
+
+		if (end_ == 0)
+			return !line.empty();
+	}
+}
+
+FDStreamBuf::FDStreamBuf(int fd, size_t buffer_size)
+: fd_(fd),
+  buffer_(buffer_size) {
+	setp(buffer_.data(), buffer_.data() + buffer_.size());
+}
+
+FDStreamBuf::~FDStreamBuf() {
+	flush_buffer();
+}
+
+FDStreamBuf::int_type FDStreamBuf::overflow(int_type c) {
+	if (!flush_buffer())
+		return traits_type::eof();
+
+	if (!traits_type::eq_int_type(c, traits_type::eof())) {
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+
+	return traits_type::not_eof(c);
+}
+
+int FDStreamBuf::sync() {
+	return flush_buffer() ? 0 : -1;
+}
+
+bool FDStreamBuf::flush_buffer() {
+	size_t size = pptr() - pbase();
+
+	try {
+		util::WriteOrThrow(fd_, pbase(), size);
+	} catch (util::Exception const &) {
+		return false;
+	}
+
+	setp(buffer_.data(), buffer_.data() + buffer_.size());
+	return true;
+}
+
+} // namespace bitextor
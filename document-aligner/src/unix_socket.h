@@ -0,0 +1,60 @@
+#pragma once
+#include <streambuf>
+#include <string>
+#include <vector>
+
+namespace bitextor {
+
+/**
+ * Creates a Unix domain socket listening on path. An existing socket file at
+ * path is replaced. Returns the file descriptor.
+ */
+int ListenUnixSocket(std::string const &path);
+
+/**
+ * Connects to the Unix domain socket at path. Returns the file descriptor.
+ */
+int ConnectUnixSocket(std::string const &path);
+
+/**
+ * Reads newline separated lines from a socket or pipe without reading past
+ * what is available, so the other side can wait for a reply after sending a
+ * request.
+ */
+class LineReader {
+public:
+	explicit LineReader(int fd);
+
+	// Reads the next line, without the newline. Returns false at end of input.
+	bool ReadLine(std::string &line);
+
+private:
+	int fd_;
+	std::vector<char> buffer_;
+	size_t begin_;
+	size_t end_;
+};
+
+/**
+ * Stream buffer that writes to a file descriptor, for streaming output that
+ * is written to an std::ostream over a socket.
+ */
+class FDStreamBuf : public std::streambuf {
+public:
+	explicit FDStreamBuf(int fd, size_t buffer_size = 1 << 16);
+
+	~FDStreamBuf();
+
+protected:
+	int_type overflow(int_type c) override;
+
+	int sync() override;
+
+private:
+	int fd_;
+	std::vector<char> buffer_;
+
+	bool flush_buffer();
+};
+
+} // namespace bitextor
@@ -0,0 +1,211 @@
+#include "wrap.h"
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+namespace bitextor {
+
+namespace {
+
+// Up to how many ASCII delimiters SkipPlain() compares 16 bytes at once
+constexpr size_t MAX_SIMD_DELIMITERS = 8;
+
+} // namespace
+
+constexpr size_t LineWrapper::NOT_FOUND;
+
+LineWrapper::LineWrapper(wrap_options const &options)
+: column_width_(static_cast<int32_t>(options.column_width)),
+  keep_delimiters_(options.keep_delimiters),
+  pos_delimiters_(options.delimiters.size(), 0) {
+	ascii_delimiters_.fill(NOT_FOUND);
+
+	for (size_t i = 0; i < options.delimiters.size(); ++i) {
+		UChar32 delimiter = options.delimiters[i];
+
+		// Like a linear search, the first occurrence of a delimiter wins
+		if (FindDelimiter(delimiter) != NOT_FOUND)
+			continue;
+
+		if (delimiter >= 0 && delimiter < 128) {
+			ascii_delimiters_[delimiter] = i;
+			ascii_delimiter_chars_.push_back(static_cast<char>(delimiter));
+		} else {
+			other_delimiters_.emplace_back(delimiter, i);
+		}
+	}
+}
+
+size_t LineWrapper::FindDelimiter(UChar32 character) const {
+	if (character >= 0 && character < 128)
+		return ascii_delimiters_[character];
+
+	for (auto const &delimiter : other_delimiters_)
+		if (delimiter.first == character)
+			return delimiter.second;
+
+	return NOT_FOUND;
+}
+
+int32_t LineWrapper::SkipPlain(char const *data, int32_t pos, int32_t end) const {
+#ifdef __SSE2__
+	if (ascii_delimiter_chars_.size() <= MAX_SIMD_DELIMITERS) {
+		__m128i needles[MAX_SIMD_DELIMITERS];
+		size_t needle_cnt = ascii_delimiter_chars_.size();
+
+		for (size_t i = 0; i < needle_cnt; ++i)
+			needles[i] = _mm_set1_epi8(ascii_delimiter_chars_[i]);
+
+		for (; pos + 16 <= end; pos += 16) {
+			__m128i chunk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + pos));
+
+			// The high bit is set for bytes of non-ASCII characters, and for
+			// the delimiters after comparing.
+			__m128i found = chunk;
+			for (size_t i = 0; i < needle_cnt; ++i)
+				found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, needles[i]));
+
+			int mask = _mm_movemask_epi8(found);
+			if (mask != 0)
+				return pos + __builtin_ctz(mask);
+		}
+	}
+#endif
+
+	for (; pos < end; ++pos) {
+		unsigned char byte = data[pos];
+		if (byte >= 128 || ascii_delimiters_[byte] != NOT_FOUND)
+			break;
+	}
+
+	return pos;
+}
+
+void LineWrapper::Wrap(StringPiece const &line) {
+	lines_.clear();
+	delimiters_.clear();
+
+	// Current byte position
+	int32_t pos = 0;
+
+	// Length of line in bytes
+	int32_t length = line.size();
+
+	// Byte position of last cut-off point
+	int32_t pos_last_cut = 0;
+
+	// For each delimiter the byte position of its last occurrence
+	fill(pos_delimiters_.begin(), pos_delimiters_.end(), 0);
+
+	// Position of the first delimiter we encountered up to pos. Reset
+	// to pos + next char if it's not a delimiter.
+	int32_t pos_first_delimiter = 0;
+
+	while (pos < length) {
+		// Skip ahead over ASCII characters that are not delimiters, but not
+		// past the point where we need to introduce a break. For each of them
+		// the character-by-character path below would only move
+		// pos_first_delimiter along.
+		int32_t pos_break = static_cast<int32_t>(min<int64_t>(length, int64_t(pos_last_cut) + column_width_));
+		int32_t pos_plain = pos < pos_break ? SkipPlain(line.data(), pos, pos_break) : pos;
+
+		if (pos_plain > pos) {
+			pos = pos_plain;
+			pos_first_delimiter = pos;
+		} else {
+			UChar32 character;
+
+			U8_NEXT(line.data(), pos, length, character);
+
+			if (character < 0)
+				throw utf8::NotUTF8Exception(line);
+
+			size_t delimiter_idx = FindDelimiter(character);
+
+			if (delimiter_idx != NOT_FOUND) {
+				// Store pos_first_delimiter instead of pos because when we have
+				// consecutive delimiters we want to chop em all off, even when
+				// our ideal delimiter is somewhere in the middle.
+				pos_delimiters_[delimiter_idx] = pos_first_delimiter;
+			} else {
+				// Maybe the next char is a delimiter? pos is pointing to the next
+				// one right now, U8_NEXT incremented it.
+				pos_first_delimiter = pos;
+			}
+		}
+
+		// Do we need to introduce a break? If not, move to next character
+		if (pos - pos_last_cut < column_width_)
+			continue;
+
+		// Last resort if we didn't break on a delimiter: just chop where we are
+		int32_t pos_cut = pos;
+
+		// Find a more ideal break point by looking back for a delimiter
+		for (int32_t const &pos_delimiter : pos_delimiters_) {
+			if (pos_delimiter > pos_last_cut) {
+				pos_cut = pos_delimiter;
+				break;
+			}
+		}
+
+		// Assume we cut without delimiters (i.e. the last resort scenario)
+		int32_t pos_cut_end = pos_cut;
+
+		// Peek ahead to were after the cut we encounter our first not-a-delimiter
+		// because that's the point were we resume.
+		for (int32_t pos_next = pos_cut_end; pos_cut_end < length; pos_cut_end = pos_next) {
+			// When we're not skipping delimiters, don't send more bytes than
+			// column_width in total a single line, even though we try to keep
+			// the delimiters together.
+			if (keep_delimiters_ && pos_cut_end - pos_last_cut >= column_width_)
+				break;
+
+			UChar32 character;
+
+			U8_NEXT(line.data(), pos_next, length, character);
+
+			if (character < 0)
+				throw utf8::NotUTF8Exception(line);
+
+			// First character after pos_cut is probably a delimiter, unless
+			// we did a hard stop in the middle of a word, and we're not keeping
+			// the delimiters.
+			if (FindDelimiter(character) == NOT_FOUND)
+				break;
+		}
+
+		if (keep_delimiters_) {
+			lines_.push_back(line.substr(pos_last_cut, pos_cut_end - pos_last_cut));
+			delimiters_.emplace_back();
+		} else {
+			lines_.push_back(line.substr(pos_last_cut, pos_cut - pos_last_cut));
+			delimiters_.push_back(line.substr(pos_cut, pos_cut_end - pos_cut));
+		}
+
+		pos_last_cut = pos_cut_end;
+		pos = pos_cut_end;
+	}
+
+	// Push out any trailing bits. Or the empty bit.
+	if (pos_last_cut < pos || pos == 0) {
+		lines_.push_back(line.substr(pos_last_cut, pos - pos_last_cut));
+		delimiters_.emplace_back();
+	}
+}
+
+pair<deque<StringPiece>,deque<string>> wrap_lines(StringPiece const &line, wrap_options const &options) {
+	LineWrapper wrapper(options);
+	wrapper.Wrap(line);
+
+	deque<string> out_delimiters;
+	for (StringPiece const &delimiter : wrapper.delimiters())
+		out_delimiters.emplace_back(delimiter.data(), delimiter.size());
+
+	return make_pair(deque<StringPiece>(wrapper.lines().begin(), wrapper.lines().end()), out_delimiters);
+}
+
+} // namespace bitextor
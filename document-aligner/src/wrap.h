@@ -0,0 +1,90 @@
+#pragma once
+#include <array>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include "util/string_piece.hh"
+#include "util/utf8.hh"
+
+namespace bitextor {
+
+struct wrap_options {
+	// Maximum number of bytes (not unicode characters!) that may end up in a
+	// single line.
+	size_t column_width = 80;
+
+	// Keep delimiters in the split lines, or separate them out into their own
+	// queue.
+	bool keep_delimiters = true;
+
+	// Order determines preference: the first one of these to occur in the
+	// line will determine the wrapping point.
+	std::vector<UChar32> delimiters{':', ',', ' ', '-', '.', '/'};
+};
+
+/**
+ * Splits lines into pieces of at most column_width bytes, preferably breaking
+ * at one of the delimiters. Keeps its buffers between lines, so wrapping does
+ * not allocate once they are large enough. Use one per thread.
+ *
+ * Runs of ASCII characters that are not delimiters are skipped over 16 bytes
+ * at a time where SSE2 is available, which is most of a typical line.
+ */
+class LineWrapper {
+public:
+	explicit LineWrapper(wrap_options const &options);
+
+	// Wraps line. lines() and delimiters() point into line, and are valid
+	// until the next call.
+	void Wrap(StringPiece const &line);
+
+	// The pieces of the last line
+	std::vector<StringPiece> const &lines() const {
+		return lines_;
+	}
+
+	// For each piece, the delimiters that were cut off after it. Empty when
+	// keep_delimiters is set.
+	std::vector<StringPiece> const &delimiters() const {
+		return delimiters_;
+	}
+
+private:
+	// Index of character in options.delimiters, or NOT_FOUND
+	size_t FindDelimiter(UChar32 character) const;
+
+	// First position in [pos, end) with a non-ASCII byte or an ASCII
+	// delimiter, or end if there is none.
+	int32_t SkipPlain(char const *data, int32_t pos, int32_t end) const;
+
+	static constexpr size_t NOT_FOUND = -1;
+
+	int32_t column_width_;
+	bool keep_delimiters_;
+
+	// Index of each ASCII character in options.delimiters, or NOT_FOUND
+	std::array<size_t, 128> ascii_delimiters_;
+
+	// The ASCII delimiters, for the SSE2 search
+	std::vector<char> ascii_delimiter_chars_;
+
+	// The other delimiters with their index in options.delimiters
+	std::vector<std::pair<UChar32, size_t>> other_delimiters_;
+
+	// For each delimiter the byte position of its last occurrence
+	std::vector<int32_t> pos_delimiters_;
+
+	std::vector<StringPiece> lines_;
+	std::vector<StringPiece> delimiters_;
+};
+
+/**
+ * Splits line into pieces of at most column_width bytes, preferably breaking
+ * at one of the delimiters. Returns the pieces and, for each piece, the
+ * delimiters that were cut off after it (empty when keep_delimiters is set).
+ * Same as LineWrapper, but allocates for every line.
+ */
+std::pair<std::deque<StringPiece>,std::deque<std::string>> wrap_lines(StringPiece const &line, wrap_options const &options);
+
+} // namespace bitextor
@@ -0,0 +1,162 @@
+#define BOOST_TEST_MODULE block_file
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/test/unit_test.hpp>
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "../src/block_file.h"
+
+using namespace std;
+using namespace bitextor;
+
+namespace {
+
+vector<string> make_documents(size_t n)
+{
+	vector<string> documents;
+
+	for (size_t i = 0; i < n; ++i)
+		documents.push_back(i % 7 == 3 ? string() : "document " + to_string(i) + string(i % 50, 'x'));
+
+	return documents;
+}
+
+// Writes documents the way docpack does, into an unlinked temporary file
+int pack(vector<string> const &documents, size_t documents_per_block)
+{
+	int fd = util::MakeTemp("/tmp/block_file_test");
+	BlockFileWriter writer(fd, documents_per_block);
+
+	for (string const &document : documents)
+		writer.Add(document);
+
+	writer.Finish();
+	return fd;
+}
+
+uint64_t file_size(int fd)
+{
+	struct stat st;
+	BOOST_REQUIRE(fstat(fd, &st) == 0);
+	return st.st_size;
+}
+
+void overwrite(int fd, uint64_t value, uint64_t offset)
+{
+	BOOST_REQUIRE(pwrite(fd, &value, sizeof(value), offset) == sizeof(value));
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(round_trip)
+{
+	for (size_t documents_per_block : {1, 3, 10, 1000}) {
+		vector<string> documents(make_documents(100));
+		DocumentReader reader(pack(documents, documents_per_block), "round_trip");
+		BOOST_CHECK(reader.Seekable());
+
+		StringPiece line;
+		for (string const &document : documents) {
+			BOOST_REQUIRE(reader.ReadLineOrEOF(line));
+			BOOST_CHECK_EQUAL(string(line.data(), line.size()), document);
+		}
+
+		BOOST_CHECK(!reader.ReadLineOrEOF(line));
+	}
+}
+
+BOOST_AUTO_TEST_CASE(empty)
+{
+	DocumentReader reader(pack(vector<string>(), 10), "empty");
+	StringPiece line;
+	BOOST_CHECK(!reader.ReadLineOrEOF(line));
+}
+
+BOOST_AUTO_TEST_CASE(seek)
+{
+	vector<string> documents(make_documents(95));
+	BlockFileReader reader(pack(documents, 10), "seek");
+	BOOST_REQUIRE_EQUAL(reader.size(), documents.size());
+
+	StringPiece line;
+	for (uint64_t index : {94, 0, 57, 10, 9, 90, 58}) {
+		reader.Seek(index);
+		BOOST_CHECK_EQUAL(reader.Tell(), index);
+		BOOST_REQUIRE(reader.ReadLineOrEOF(line));
+		BOOST_CHECK_EQUAL(string(line.data(), line.size()), documents[index]);
+	}
+
+	reader.Seek(documents.size());
+	BOOST_CHECK(!reader.ReadLineOrEOF(line));
+	BOOST_CHECK_THROW(reader.Seek(documents.size() + 1), util::Exception);
+}
+
+BOOST_AUTO_TEST_CASE(skip)
+{
+	vector<string> documents(make_documents(95));
+	DocumentReader reader(pack(documents, 10), "skip");
+
+	StringPiece line;
+	BOOST_CHECK_EQUAL(reader.Skip(33), 33);
+	BOOST_REQUIRE(reader.ReadLineOrEOF(line));
+	BOOST_CHECK_EQUAL(string(line.data(), line.size()), documents[33]);
+	BOOST_CHECK_EQUAL(reader.Skip(100), documents.size() - 34);
+	BOOST_CHECK(!reader.ReadLineOrEOF(line));
+}
+
+BOOST_AUTO_TEST_CASE(truncated)
+{
+	int fd = pack(make_documents(100), 10);
+	BOOST_REQUIRE(ftruncate(fd, file_size(fd) - 1) == 0);
+	BOOST_CHECK_THROW(BlockFileReader(fd, "truncated"), util::Exception);
+}
+
+BOOST_AUTO_TEST_CASE(corrupt_footer)
+{
+	// Footer is documents_per_block, document_cnt, block_cnt, magic
+	uint64_t const footer_size = 3 * sizeof(uint64_t) + 8;
+
+	// More documents than the blocks can hold
+	int fd = pack(make_documents(100), 10);
+	overwrite(fd, 101, file_size(fd) - footer_size + sizeof(uint64_t));
+	BOOST_CHECK_THROW(BlockFileReader(fd, "document_cnt"), util::Exception);
+
+	// Fewer documents than there are blocks for
+	fd = pack(make_documents(100), 10);
+	overwrite(fd, 90, file_size(fd) - footer_size + sizeof(uint64_t));
+	BOOST_CHECK_THROW(BlockFileReader(fd, "document_cnt"), util::Exception);
+
+	// Documents per block that would overflow document_cnt
+	fd = pack(make_documents(100), 10);
+	overwrite(fd, uint64_t(1) << 62, file_size(fd) - footer_size);
+	BOOST_CHECK_THROW(BlockFileReader(fd, "documents_per_block"), util::Exception);
+}
+
+BOOST_AUTO_TEST_CASE(corrupt_index)
+{
+	// Index entries are offset, size, just before the footer
+	uint64_t const footer_size = 3 * sizeof(uint64_t) + 8;
+	uint64_t const entry_size = 2 * sizeof(uint64_t);
+
+	// Last block starting beyond the index
+	int fd = pack(make_documents(100), 10);
+	overwrite(fd, file_size(fd), file_size(fd) - footer_size - entry_size);
+	BOOST_CHECK_THROW(BlockFileReader(fd, "offset"), util::Exception);
+
+	// First block starting inside the header
+	fd = pack(make_documents(100), 10);
+	overwrite(fd, 0, file_size(fd) - footer_size - 10 * entry_size);
+	BOOST_CHECK_THROW(BlockFileReader(fd, "offset"), util::Exception);
+
+	// Blocks out of order
+	fd = pack(make_documents(100), 10);
+	overwrite(fd, file_size(fd) - footer_size - 10 * entry_size - 1, file_size(fd) - footer_size - 5 * entry_size);
+	BOOST_CHECK_THROW(BlockFileReader(fd, "offset"), util::Exception);
+
+	// Block that would decompress to far more than zlib can
+	fd = pack(make_documents(100), 10);
+	overwrite(fd, uint64_t(1) << 40, file_size(fd) - footer_size - entry_size + sizeof(uint64_t));
+	BOOST_CHECK_THROW(BlockFileReader(fd, "size"), util::Exception);
+}
@@ -0,0 +1,282 @@
+#define BOOST_TEST_MODULE line_index
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <boost/test/unit_test.hpp>
+#include "util/exception.hh"
+#include "util/file.hh"
+#include "../src/block_file.h"
+#include "../src/line_index.h"
+
+using namespace std;
+using namespace bitextor;
+
+namespace {
+
+// Directory for the files of a test, removed with everything in it after
+struct TempDir {
+	TempDir() {
+		char pattern[] = "/tmp/line_index_testXXXXXX";
+		BOOST_REQUIRE(mkdtemp(pattern));
+		path = pattern;
+	}
+
+	~TempDir() {
+		for (string const &file : files)
+			unlink(file.c_str());
+		rmdir(path.c_str());
+	}
+
+	string file(string const &name) {
+		files.push_back(path + "/" + name);
+		return files.back();
+	}
+
+	string path;
+	vector<string> files;
+};
+
+void write_file(string const &path, string const &data)
+{
+	util::scoped_fd fd(util::CreateOrThrow(path.c_str()));
+	util::WriteOrThrow(fd.get(), data.data(), data.size());
+}
+
+void write_gzip(string const &path, string const &data)
+{
+	gzFile file = gzopen(path.c_str(), "wb");
+	BOOST_REQUIRE(file);
+	BOOST_REQUIRE_EQUAL(gzwrite(file, data.data(), data.size()), static_cast<int>(data.size()));
+	BOOST_REQUIRE_EQUAL(gzclose(file), Z_OK);
+}
+
+// Documents of different lengths that do not compress too well, so a gzip
+// file of them has many deflate blocks.
+vector<string> make_documents(size_t n)
+{
+	vector<string> documents;
+	unsigned int state = 1;
+
+	for (size_t i = 0; i < n; ++i) {
+		string document(to_string(i) + ' ');
+		for (size_t length = i % 97; length > 0; --length) {
+			state = state * 1103515245 + 12345;
+			document.push_back('a' + (state >> 16) % 26);
+		}
+		documents.push_back(document);
+	}
+
+	return documents;
+}
+
+string join(vector<string> const &documents, bool trailing_newline = true)
+{
+	string data;
+
+	for (size_t i = 0; i < documents.size(); ++i) {
+		data += documents[i];
+		if (trailing_newline || i + 1 < documents.size())
+			data += '\n';
+	}
+
+	return data;
+}
+
+string read_line(IndexedLineReader &reader)
+{
+	StringPiece line;
+	BOOST_REQUIRE(reader.ReadLineOrEOF(line));
+	return string(line.data(), line.size());
+}
+
+void check_seeks(string const &path, LineIndex const &index, vector<string> const &documents)
+{
+	IndexedLineReader reader(util::OpenReadOrThrow(path.c_str()), index);
+	BOOST_REQUIRE_EQUAL(reader.size(), documents.size());
+
+	for (uint64_t target : {uint64_t(documents.size() - 1), uint64_t(0), uint64_t(documents.size() / 2), uint64_t(7), uint64_t(documents.size() - 2), uint64_t(8)}) {
+		reader.Seek(target);
+		BOOST_CHECK_EQUAL(read_line(reader), documents[target]);
+	}
+
+	reader.Seek(documents.size());
+	StringPiece line;
+	BOOST_CHECK(!reader.ReadLineOrEOF(line));
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(last_line_without_newline)
+{
+	TempDir dir;
+	string path(dir.file("short.txt"));
+	write_file(path, "YQ==\nYmNkZWZn");
+
+	LineIndex index(LineIndex::Build(path, 1));
+	BOOST_REQUIRE_EQUAL(index.size(), 2);
+
+	IndexedLineReader reader(util::OpenReadOrThrow(path.c_str()), index);
+	BOOST_CHECK_EQUAL(read_line(reader), "YQ==");
+	BOOST_CHECK_EQUAL(read_line(reader), "YmNkZWZn");
+
+	StringPiece line;
+	BOOST_CHECK(!reader.ReadLineOrEOF(line));
+
+	reader.Seek(1);
+	BOOST_CHECK_EQUAL(read_line(reader), "YmNkZWZn");
+}
+
+BOOST_AUTO_TEST_CASE(long_last_line_without_newline)
+{
+	// Longer than the read buffer, so it has to grow while reading it
+	TempDir dir;
+	vector<string> documents{"first", string(200000, 'x') + "end"};
+
+	for (bool compressed : {false, true}) {
+		string path(dir.file(compressed ? "long.gz" : "long.txt"));
+		if (compressed)
+			write_gzip(path, join(documents, false));
+		else
+			write_file(path, join(documents, false));
+
+		LineIndex index(LineIndex::Build(path, 1));
+		IndexedLineReader reader(util::OpenReadOrThrow(path.c_str()), index);
+		reader.Seek(1);
+		BOOST_CHECK(read_line(reader) == documents[1]);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(seek_plain)
+{
+	TempDir dir;
+	string path(dir.file("plain.txt")), index_path(path + ".idx");
+	vector<string> documents(make_documents(5000));
+	write_file(path, join(documents));
+
+	LineIndex::Build(path, 16).Save(dir.file("plain.txt.idx"));
+	BOOST_CHECK(LineIndex::Matches(path, index_path));
+	check_seeks(path, LineIndex(path, index_path), documents);
+}
+
+BOOST_AUTO_TEST_CASE(seek_gzip)
+{
+	TempDir dir;
+	string path(dir.file("docs.gz")), index_path(path + ".idx");
+	vector<string> documents(make_documents(20000));
+	write_gzip(path, join(documents));
+
+	// A checkpoint about every 64KB, so seeking uses windows
+	LineIndex built(LineIndex::Build(path, 16, 1 << 16));
+	BOOST_REQUIRE(built.compressed());
+	BOOST_REQUIRE(built.checkpoint(built.offset(built.size() / built.stride() - 1)));
+	check_seeks(path, built, documents);
+
+	// Same from the saved index, which reads the windows from the file
+	built.Save(dir.file("docs.gz.idx"));
+	check_seeks(path, LineIndex(path, index_path), documents);
+}
+
+BOOST_AUTO_TEST_CASE(stale_index)
+{
+	TempDir dir;
+	string path(dir.file("grows.txt")), index_path(path + ".idx");
+	vector<string> documents(make_documents(100));
+	write_file(path, join(documents));
+	LineIndex::Build(path, 16).Save(dir.file("grows.txt.idx"));
+
+	// The file grows: the index is ignored
+	documents.push_back("new");
+	write_file(path, join(documents));
+	BOOST_CHECK(!LineIndex::Matches(path, index_path));
+	BOOST_CHECK_THROW(LineIndex(path, index_path), util::Exception);
+
+	DocumentReader reader(path);
+	BOOST_CHECK(!reader.Seekable());
+	BOOST_CHECK_EQUAL(reader.Skip(documents.size() - 1), documents.size() - 1);
+
+	StringPiece line;
+	BOOST_REQUIRE(reader.ReadLineOrEOF(line));
+	BOOST_CHECK_EQUAL(string(line.data(), line.size()), "new");
+
+	// Same size, but modified later
+	LineIndex::Build(path, 16).Save(index_path);
+	BOOST_CHECK(LineIndex::Matches(path, index_path));
+
+	documents[0][0] = 'X';
+	write_file(path, join(documents));
+	util::scoped_fd fd(util::OpenReadOrThrow(path.c_str()));
+	struct timespec times[2] = {{0, UTIME_OMIT}, {12345, 0}};
+	BOOST_REQUIRE(futimens(fd.get(), times) == 0);
+	BOOST_CHECK(!LineIndex::Matches(path, index_path));
+}
+
+BOOST_AUTO_TEST_CASE(from_line_lengths)
+{
+	TempDir dir;
+	string path(dir.file("written.txt")), index_path(path + ".idx");
+	vector<string> documents(make_documents(100));
+	string data(join(documents));
+
+	vector<uint64_t> lengths;
+	for (string const &document : documents)
+		lengths.push_back(document.size() + 1);
+
+	util::scoped_fd fd(util::CreateOrThrow(path.c_str()));
+	util::WriteOrThrow(fd.get(), data.data(), data.size());
+	LineIndex::FromLineLengths(fd.get(), lengths, 16).Save(dir.file("written.txt.idx"));
+	BOOST_CHECK(LineIndex::Matches(path, index_path));
+	check_seeks(path, LineIndex(path, index_path), documents);
+
+	// Lines that are not what was written
+	lengths.pop_back();
+	BOOST_CHECK_THROW(LineIndex::FromLineLengths(fd.get(), lengths, 16), util::Exception);
+}
+
+BOOST_AUTO_TEST_CASE(seek_to_end_at_stride)
+{
+	// A multiple of the stride, so the end is where the next stride would
+	// start. Seek there from another stride.
+	TempDir dir;
+	vector<string> documents(make_documents(128));
+	string data(join(documents));
+
+	vector<uint64_t> lengths;
+	for (string const &document : documents)
+		lengths.push_back(document.size() + 1);
+
+	string written(dir.file("written.txt"));
+	util::scoped_fd fd(util::CreateOrThrow(written.c_str()));
+	util::WriteOrThrow(fd.get(), data.data(), data.size());
+	LineIndex::FromLineLengths(fd.get(), lengths, 16).Save(dir.file("written.txt.idx"));
+
+	string built(dir.file("built.txt"));
+	write_file(built, join(documents, false));
+	LineIndex::Build(built, 16).Save(dir.file("built.txt.idx"));
+
+	for (string const &path : {written, built}) {
+		LineIndex index(path, path + ".idx");
+		IndexedLineReader reader(util::OpenReadOrThrow(path.c_str()), index);
+
+		reader.Seek(3);
+		BOOST_CHECK_EQUAL(read_line(reader), documents[3]);
+		reader.Seek(documents.size());
+		BOOST_CHECK_EQUAL(reader.Tell(), documents.size());
+
+		StringPiece line;
+		BOOST_CHECK(!reader.ReadLineOrEOF(line));
+
+		// And back again
+		reader.Seek(127);
+		BOOST_CHECK_EQUAL(read_line(reader), documents[127]);
+
+		DocumentReader document_reader(path);
+		BOOST_REQUIRE(document_reader.Seekable());
+		BOOST_CHECK_EQUAL(document_reader.Skip(5), 5);
+		BOOST_CHECK_EQUAL(document_reader.Skip(1000), documents.size() - 5);
+		BOOST_CHECK(!document_reader.ReadLineOrEOF(line));
+	}
+}
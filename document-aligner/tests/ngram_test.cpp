@@ -8,6 +8,15 @@
 using namespace std;
 using namespace bitextor;
 
+namespace bitextor {
+
+ostream &operator<<(ostream &out, NGram const &ngram)
+{
+	return out << ngram.hash;
+}
+
+} // namespace bitextor
+
 NGram make_ngram(vector<string> const &words)
 {
 	uint64_t hash = 0;
@@ -15,7 +24,12 @@ NGram make_ngram(vector<string> const &words)
 	for (string const &word : words)
 		hash = MurmurHashCombine(MurmurHashNative(word.data(), word.size(), 0), hash);
 
-	return hash;
+	return NGram{hash};
+}
+
+NGram make_salted_ngram(vector<string> const &words)
+{
+	return NGram{MurmurHashCombine(words.size(), make_ngram(words).hash)};
 }
 
 BOOST_AUTO_TEST_CASE(test_trigram)
@@ -59,4 +73,64 @@ BOOST_AUTO_TEST_CASE(test_not_enough_tokens)
 		ngrams.push_back(*iter);
 
 	BOOST_TEST(ngrams.size() == 0);
-}
\ No newline at end of file
+}
+
+BOOST_AUTO_TEST_CASE(test_multiple_sizes)
+{
+	string document = "Hello this is a test";
+
+	vector<NGram> ngrams;
+	for (MultiNGramIter iter(StringPiece(document.data(), document.size()), {1, 3}); iter; ++iter)
+		ngrams.push_back(*iter);
+
+	vector<NGram> expected{
+		make_salted_ngram({"Hello"}),
+		make_salted_ngram({"this"}),
+		make_salted_ngram({"is"}),
+		make_salted_ngram({"Hello", "this", "is"}),
+		make_salted_ngram({"a"}),
+		make_salted_ngram({"this", "is", "a"}),
+		make_salted_ngram({"test"}),
+		make_salted_ngram({"is", "a", "test"})
+	};
+
+	BOOST_TEST(ngrams == expected, boost::test_tools::per_element());
+}
+
+BOOST_AUTO_TEST_CASE(test_single_size_unsalted)
+{
+	string document = "Hello this is a test";
+
+	vector<NGram> ngrams, expected;
+	for (MultiNGramIter iter(StringPiece(document.data(), document.size()), {2}); iter; ++iter)
+		ngrams.push_back(*iter);
+
+	for (NGramIter iter(StringPiece(document.data(), document.size()), 2); iter; ++iter)
+		expected.push_back(*iter);
+
+	BOOST_TEST(ngrams == expected, boost::test_tools::per_element());
+}
+
+template <size_t N> void check_fixed_size(string const &document)
+{
+	vector<NGram> ngrams, expected;
+
+	for (FixedNGramIter<N> iter(StringPiece(document.data(), document.size())); iter; ++iter)
+		ngrams.push_back(*iter);
+
+	for (NGramIter iter(StringPiece(document.data(), document.size()), N); iter; ++iter)
+		expected.push_back(*iter);
+
+	BOOST_TEST(ngrams == expected, boost::test_tools::per_element());
+}
+
+BOOST_AUTO_TEST_CASE(test_fixed_size)
+{
+	for (string document : {"", "Hello", "Hello this is", "Hello this is a test\nwith two lines "}) {
+		check_fixed_size<1>(document);
+		check_fixed_size<2>(document);
+		check_fixed_size<3>(document);
+		check_fixed_size<4>(document);
+		check_fixed_size<5>(document);
+	}
+}
@@ -0,0 +1,203 @@
+#define BOOST_TEST_MODULE wrap
+#include <deque>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+#include "../src/wrap.h"
+
+using namespace std;
+using namespace bitextor;
+
+namespace {
+
+constexpr size_t not_found = -1;
+
+size_t find_delimiter(vector<UChar32> const &delimiters, UChar32 character) {
+	for (size_t i = 0; i < delimiters.size(); ++i)
+		if (character == delimiters[i])
+			return i;
+
+	return not_found;
+}
+
+// wrap_lines as it was before LineWrapper, one character at a time. The cut
+// points of LineWrapper have to be exactly the same.
+pair<deque<StringPiece>,deque<string>> reference_wrap_lines(StringPiece const &line, wrap_options const &options) {
+	deque<StringPiece> out_lines;
+	deque<string> out_delimiters;
+
+	int32_t pos = 0;
+	int32_t length = line.size();
+	int32_t pos_last_cut = 0;
+	vector<int32_t> pos_delimiters(options.delimiters.size(), 0);
+	int32_t pos_first_delimiter = 0;
+
+	while (pos < length) {
+		UChar32 character;
+
+		U8_NEXT(line.data(), pos, length, character);
+
+		if (character < 0)
+			throw utf8::NotUTF8Exception(line);
+
+		size_t delimiter_idx = find_delimiter(options.delimiters, character);
+
+		if (delimiter_idx != not_found)
+			pos_delimiters[delimiter_idx] = pos_first_delimiter;
+		else
+			pos_first_delimiter = pos;
+
+		if (pos - pos_last_cut < static_cast<int32_t>(options.column_width))
+			continue;
+
+		int32_t pos_cut = pos;
+
+		for (int32_t const &pos_delimiter : pos_delimiters) {
+			if (pos_delimiter > pos_last_cut) {
+				pos_cut = pos_delimiter;
+				break;
+			}
+		}
+
+		int32_t pos_cut_end = pos_cut;
+
+		for (int32_t pos_next = pos_cut_end; pos_cut_end < length; pos_cut_end = pos_next) {
+			if (options.keep_delimiters && pos_cut_end - pos_last_cut >= static_cast<int32_t>(options.column_width))
+				break;
+
+			U8_NEXT(line.data(), pos_next, length, character);
+
+			if (character < 0)
+				throw utf8::NotUTF8Exception(line);
+
+			if (find_delimiter(options.delimiters, character) == not_found)
+				break;
+		}
+
+		if (options.keep_delimiters) {
+			out_lines.push_back(line.substr(pos_last_cut, pos_cut_end - pos_last_cut));
+			out_delimiters.emplace_back("");
+		} else {
+			out_lines.push_back(line.substr(pos_last_cut, pos_cut - pos_last_cut));
+			out_delimiters.emplace_back(line.substr(pos_cut, pos_cut_end - pos_cut).data(), pos_cut_end - pos_cut);
+		}
+
+		pos_last_cut = pos_cut_end;
+		pos = pos_cut_end;
+	}
+
+	if (pos_last_cut < pos || pos == 0) {
+		out_lines.push_back(line.substr(pos_last_cut, pos - pos_last_cut));
+		out_delimiters.push_back("");
+	}
+
+	return make_pair(out_lines, out_delimiters);
+}
+
+// Compares where LineWrapper cuts line with where the reference does
+void check_wrap(LineWrapper &wrapper, string const &line, wrap_options const &options) {
+	BOOST_TEST_CONTEXT("width " << options.column_width << ", keep " << options.keep_delimiters << ", line \"" << line << "\"") {
+		auto expected = reference_wrap_lines(line, options);
+
+		wrapper.Wrap(line);
+		BOOST_REQUIRE_EQUAL(wrapper.lines().size(), expected.first.size());
+		BOOST_REQUIRE_EQUAL(wrapper.delimiters().size(), expected.second.size());
+
+		for (size_t i = 0; i < expected.first.size(); ++i) {
+			BOOST_CHECK_EQUAL(wrapper.lines()[i].data() - line.data(), expected.first[i].data() - line.data());
+			BOOST_CHECK_EQUAL(wrapper.lines()[i].size(), expected.first[i].size());
+			BOOST_CHECK_EQUAL(string(wrapper.delimiters()[i].data(), wrapper.delimiters()[i].size()), expected.second[i]);
+		}
+	}
+}
+
+void check_all(vector<string> const &lines, vector<UChar32> const &delimiters = wrap_options().delimiters) {
+	for (size_t width : {1, 2, 3, 5, 15, 16, 17, 31, 32, 33, 80}) {
+		for (bool keep_delimiters : {true, false}) {
+			wrap_options options;
+			options.column_width = width;
+			options.keep_delimiters = keep_delimiters;
+			options.delimiters = delimiters;
+
+			// One wrapper for all lines, so leftovers from the previous line
+			// would show.
+			LineWrapper wrapper(options);
+			for (string const &line : lines)
+				check_wrap(wrapper, line, options);
+		}
+	}
+}
+
+} // namespace
+
+BOOST_AUTO_TEST_CASE(empty)
+{
+	check_all({"", " ", ",,,", ""});
+}
+
+BOOST_AUTO_TEST_CASE(multibyte)
+{
+	check_all({
+		"Ça coûte très cher, à peu près 30€ — n'est-ce pas? Ünïcödé everywhere: ÄÖÜäöüß.",
+		"日本語の文章には空白がありません、でも読点はあります。とても長い文になることもあります。",
+		"Привет, мир! Это длинная строка на русском языке, с запятыми и точками.",
+		"emoji 😀😃😄😁😆😅🤣😂🙂🙃😉😊😇 and more 👍👍👍👍, then text",
+		"x€€€€€€€€€€€€€€€€€€€€€€€€€€€€€€€€€€€€y",
+	});
+}
+
+BOOST_AUTO_TEST_CASE(no_spaces)
+{
+	check_all({
+		"abcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyzabcdefghijklmnopqrstuvwxyz0123456789",
+		"Donaudampfschifffahrtselektrizitätenhauptbetriebswerkbauunterbeamtengesellschaft",
+		"ééééééééééééééééééééééééééééééééééééééééééééééééé",
+	});
+}
+
+BOOST_AUTO_TEST_CASE(long_runs)
+{
+	// Runs of plain ASCII longer than the 16 bytes SkipPlain() looks at once,
+	// with delimiters and multibyte characters just before, at, and after
+	// the 16 and 32 byte limits.
+	vector<string> lines;
+	string const run(40, 'a');
+
+	for (size_t before = 0; before < 36; ++before) {
+		for (char const *special : {" ", ",", "::", "é", "€", " - ", "😀"}) {
+			lines.push_back(run.substr(0, before) + special + run);
+			lines.push_back(run.substr(0, before) + special + run.substr(0, 17) + special + run);
+		}
+	}
+
+	check_all(lines);
+}
+
+BOOST_AUTO_TEST_CASE(other_delimiters)
+{
+	// A multibyte delimiter, which SkipPlain() has to stop at as well
+	vector<UChar32> delimiters{0x3002, 0x3001, ' ', ','};
+	check_all({
+		"日本語の文章には空白がありません、でも読点はあります。とても長い文になることもあります。",
+		"abcdefghijklmnopqrstuvwxyz。abcdefghijklmnopqrstuvwxyz、abc def, ghi",
+	}, delimiters);
+}
+
+BOOST_AUTO_TEST_CASE(random_lines)
+{
+	vector<string> const pieces{"a", "b", "Z", "0", " ", ",", ":", "-", ".", "/", "é", "€", "😀", "あ", "。", "abcdefghijklmnopqrstu"};
+	mt19937 random(42);
+	uniform_int_distribution<size_t> piece(0, pieces.size() - 1), length(0, 120);
+
+	vector<string> lines;
+	for (size_t i = 0; i < 500; ++i) {
+		string line;
+		for (size_t n = length(random); n > 0; --n)
+			line += pieces[piece(random)];
+		lines.push_back(line);
+	}
+
+	check_all(lines);
+}